@@ -0,0 +1,115 @@
+use std::fs;
+use std::path::Path;
+
+use criterion::{black_box, criterion_group, criterion_main, BatchSize, Criterion};
+
+use kapy::processor::exif::{self, GpsInfo, Metadata, Tag};
+
+const SAMPLE: &str = "sample.jpg";
+const TAGS: [&str; 4] = [
+    "Exif.Image.DateTime",
+    "Exif.Photo.DateTimeOriginal",
+    "Exif.GPSInfo.GPSLatitude",
+    "Xmp.xmp.Rating",
+];
+
+fn gps_info() -> GpsInfo {
+    GpsInfo {
+        lat: 37.287075,
+        lon: 126.574463,
+        alt: 7.853204,
+    }
+}
+
+// handle with metadata already decoded, so only the measured call is timed
+fn opened(blob: &Vec<u8>) -> Metadata {
+    let mut meta = Metadata::new();
+    meta.reopen_blob(blob).unwrap();
+    meta.get_mime().unwrap();
+    let _ = meta.has_tag(Tag::DateTime);
+
+    meta
+}
+
+fn open(c: &mut Criterion) {
+    let path = Path::new(SAMPLE);
+    let blob = fs::read(path).unwrap();
+    let mut meta = Metadata::new();
+
+    // each open is followed by the first lookup, which decodes metadata
+    let mut group = c.benchmark_group("open");
+    group.bench_function("path", |b| b.iter(|| {
+        meta.reopen(black_box(path)).unwrap();
+        meta.has_tag(Tag::DateTime).unwrap()
+    }));
+    group.bench_function("blob", |b| b.iter(|| {
+        meta.reopen_blob(black_box(&blob)).unwrap();
+        meta.has_tag(Tag::DateTime).unwrap()
+    }));
+    group.bench_function("mmap", |b| b.iter(|| {
+        meta.reopen_mmap(black_box(path)).unwrap();
+        meta.has_tag(Tag::DateTime).unwrap()
+    }));
+    group.bench_function("inspect", |b| b.iter(|| {
+        exif::inspect_from_path(black_box(path)).unwrap()
+    }));
+    group.finish();
+}
+
+fn tags(c: &mut Criterion) {
+    let blob = fs::read(SAMPLE).unwrap();
+
+    // strings handed out stay in the handle until reset, so every iteration gets a fresh one
+    let mut group = c.benchmark_group("tag");
+    for tag in TAGS {
+        group.bench_function(tag, |b| b.iter_batched_ref(
+            || opened(&blob),
+            |meta| meta.get_tag(black_box(tag)),
+            BatchSize::SmallInput));
+    }
+    group.bench_function("get_tags", |b| b.iter_batched_ref(
+        || opened(&blob),
+        |meta| meta.get_tags(black_box(&TAGS)).unwrap(),
+        BatchSize::SmallInput));
+
+    // typed accessors do not allocate, the same handle is reused
+    let meta = opened(&blob);
+    group.bench_function("get_tag_datetime", |b| b.iter(|| {
+        meta.get_tag_datetime(black_box(Tag::DateTimeOriginal)).unwrap()
+    }));
+    group.finish();
+}
+
+fn save(c: &mut Criterion) {
+    let blob = fs::read(SAMPLE).unwrap();
+    let meta = opened(&blob);
+
+    c.bench_function("save_blob", |b| b.iter(|| {
+        meta.paste_to_blob(black_box(&blob)).unwrap()
+    }));
+}
+
+fn gps(c: &mut Criterion) {
+    let path = Path::new(SAMPLE);
+    let blob = fs::read(path).unwrap();
+    let meta = opened(&blob);
+    let out_path = std::env::temp_dir().join("kapy-bench-gps.jpg");
+
+    let mut group = c.benchmark_group("gps");
+    group.bench_function("add_gps_info", |b| b.iter(|| {
+        meta.add_gps_info(black_box(gps_info())).unwrap()
+    }));
+    group.bench_function("add_gps_info_and_save", |b| b.iter(|| {
+        meta.add_gps_info(gps_info()).unwrap();
+        meta.paste_to_blob(&blob).unwrap()
+    }));
+    group.bench_function("add_gps_to_file", |b| b.iter(|| {
+        exif::add_gps_info_to_file(path, &out_path, &gps_info()).unwrap()
+    }));
+    group.finish();
+
+    let _ = fs::remove_file(&out_path);
+}
+
+criterion_group!(benches, open, tags, save, gps);
+criterion_main!(benches);
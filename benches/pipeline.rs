@@ -0,0 +1,139 @@
+use std::fs;
+use std::path::{Path, PathBuf};
+
+use bytes::Bytes;
+use chrono::{DateTime, Duration as ChronoDuration};
+use criterion::{black_box, criterion_group, criterion_main, BatchSize, Criterion};
+
+use kapy::config::Config;
+use kapy::processor::exif::GpsInfo;
+use kapy::processor::gps::{GpsSearch, GpxStorage, Pour};
+use kapy::processor::image::{self, Inspection};
+
+const SAMPLE: &str = "sample.jpg";
+const CORPUS_SIZE: usize = 8;
+const TRACK_POINTS: usize = 10_000;
+const TRACK_INTERVAL_SECS: i64 = 10;
+const TRACK_START: &str = "2023-02-03T00:00:00Z";
+
+// every rating to the same command
+const BYPASS_YAML: &str = r#"import:
+  from: .
+  to: .
+policies:
+- rate: [-1,0,1,2,3,4,5]
+"#;
+
+const HEIC_YAML: &str = r#"import:
+  from: .
+  to: .
+policies:
+- rate: [-1,0,1,2,3,4,5]
+  command:
+    format: heic
+"#;
+
+// track of TRACK_POINTS fixes, one per TRACK_INTERVAL_SECS
+fn synthetic_gpx() -> String {
+    let start = DateTime::parse_from_rfc3339(TRACK_START).unwrap();
+    let mut gpx = String::from(r#"<?xml version="1.0" encoding="UTF-8"?>
+<gpx version="1.1" creator="kapy" xmlns="http://www.topografix.com/GPX/1/1">
+<trk><trkseg>
+"#);
+
+    for i in 0..TRACK_POINTS {
+        let t = start + ChronoDuration::seconds(i as i64 * TRACK_INTERVAL_SECS);
+        gpx.push_str(&format!("<trkpt lat=\"{:.6}\" lon=\"{:.6}\"><ele>{:.3}</ele><time>{}</time></trkpt>\n",
+                              37.0 + i as f64 * 1e-5, 126.0 + i as f64 * 1e-5, (i % 100) as f64,
+                              t.format("%Y-%m-%dT%H:%M:%SZ")));
+    }
+
+    gpx.push_str("</trkseg></trk>\n</gpx>\n");
+    gpx
+}
+
+fn gpx_search(c: &mut Criterion) {
+    let gpx = Bytes::from(synthetic_gpx());
+    let start = DateTime::parse_from_rfc3339(TRACK_START).unwrap();
+    let span = TRACK_POINTS as i64 * TRACK_INTERVAL_SECS;
+
+    let mut group = c.benchmark_group("gpx");
+    group.bench_function("pour", |b| b.iter(|| {
+        let mut storage = GpxStorage::new(std::time::Duration::from_secs(300), true);
+        storage.pour_into(black_box(gpx.clone())).unwrap()
+    }));
+
+    for interpolate in [false, true] {
+        let mut storage = GpxStorage::new(std::time::Duration::from_secs(300), interpolate);
+        storage.pour_into(gpx.clone()).unwrap();
+
+        // spread queries over the track, off the recorded fixes
+        let mut n = 0i64;
+        let name = if interpolate { "search_interpolated" } else { "search" };
+        group.bench_function(name, |b| b.iter(|| {
+            n = (n + 7919) % span;
+            storage.search(black_box(&(start + ChronoDuration::seconds(n))))
+        }));
+    }
+    group.finish();
+}
+
+// copies of the sample image, inspected once
+fn corpus(dir: &Path) -> Vec<(PathBuf, Inspection)> {
+    fs::create_dir_all(dir).unwrap();
+
+    (0..CORPUS_SIZE).map(|i| {
+        let path = dir.join(format!("IMG_{:04}.jpg", i));
+        fs::copy(SAMPLE, &path).unwrap();
+
+        let mut inspection = image::inspect_image_from_path(&path).unwrap();
+        inspection.gps_recorded = false;    // let the gps case always write it
+
+        (path, inspection)
+    }).collect()
+}
+
+fn process_corpus(conf: &Config, corpus: &[(PathBuf, Inspection)], out_dir: &Path, with_gps: bool) {
+    for (path, inspection) in corpus.iter() {
+        let gps_info = if with_gps {
+            Some(GpsInfo { lat: 37.287075, lon: 126.574463, alt: 7.853204 })
+        } else {
+            None
+        };
+
+        image::process(conf, path, out_dir, inspection, gps_info, None, false, |_| ()).unwrap();
+    }
+}
+
+fn process(c: &mut Criterion) {
+    let root = std::env::temp_dir().join("kapy-bench-pipeline");
+    let _ = fs::remove_dir_all(&root);
+
+    let corpus = corpus(&root.join("in"));
+    let out_dir = root.join("out");
+
+    let bypass = Config::build(String::from(BYPASS_YAML)).unwrap();
+    let heic = Config::build(String::from(HEIC_YAML)).unwrap();
+
+    let cases: [(&str, &Config, bool); 3] = [
+        ("bypass", &bypass, false),
+        ("gps_only", &bypass, true),
+        ("heic_convert", &heic, false),
+    ];
+
+    // existing outputs are skipped, so the destination is emptied before each run
+    let mut group = c.benchmark_group("process");
+    group.sample_size(10);
+    for (name, conf, with_gps) in cases {
+        group.bench_function(name, |b| b.iter_batched(
+            || { let _ = fs::remove_dir_all(&out_dir); },
+            |_| process_corpus(conf, &corpus, &out_dir, with_gps),
+            BatchSize::PerIteration));
+    }
+    group.finish();
+
+    let _ = fs::remove_dir_all(&root);
+}
+
+criterion_group!(benches, gpx_search, process);
+criterion_main!(benches);
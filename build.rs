@@ -33,13 +33,19 @@ fn main() {
     ).unwrap();
 
     // compile c files
-    cc::Build::new()
-        .cpp(true)
+    let mut build = cc::Build::new();
+    build.cpp(true)
         .file("lib/exif.cpp")
         .include("lib")
         .includes(exiv2_inc_dirs)
-        .includes(libssh_inc_dirs)
-        .compile("libexif");
+        .includes(libssh_inc_dirs);
+
+    // time libexif entry points, reported by 'clone --stats'
+    if env::var("CARGO_FEATURE_STATS").is_ok() {
+        build.define("EXIF_ENABLE_STATS", None);
+    }
+
+    build.compile("libexif");
 
     println!("cargo:rerun-if-changed=lib/exif.h");
     println!("cargo:rerun-if-changed=lib/exif.cpp");
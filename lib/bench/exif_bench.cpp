@@ -0,0 +1,187 @@
+// micro benchmarks calling lib/exif.cpp directly, without the Rust side
+//
+// build and run from the repository root:
+//   c++ -O2 -std=c++11 -Ilib lib/exif.cpp lib/bench/exif_bench.cpp $(pkg-config --cflags --libs exiv2) -o exif_bench
+//   ./exif_bench sample.jpg [iterations]
+
+#include <chrono>
+#include <functional>
+#include <vector>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "exif.h"
+
+#define DEFAULT_ITERATIONS      1000
+#define TAGS_PER_OPEN           64      // strings are kept by the handle until reset
+
+static const char *BENCH_TAGS[] = {
+    "Exif.Image.DateTime",
+    "Exif.Photo.DateTimeOriginal",
+    "Exif.GPSInfo.GPSLatitude",
+    "Xmp.xmp.Rating",
+};
+
+// internal functions
+bool s_read_file(const char *path, std::vector<unsigned char> &out);
+void s_bench(const char *name, int iterations, const std::function<bool()> &fn);
+void s_check(int rc, const char *what);
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s IMAGE [ITERATIONS]\n", argv[0]);
+        return 1;
+    }
+
+    const char *path = argv[1];
+    int iterations = argc > 2 ? atoi(argv[2]) : DEFAULT_ITERATIONS;
+
+    std::vector<unsigned char> blob;
+    if (!s_read_file(path, blob)) {
+        fprintf(stderr, "failed to read %s\n", path);
+        return 1;
+    }
+
+    exif_initialize();
+    exif_metadata_t *meta = exif_metadata_new();
+
+    // each open is followed by the first lookup, which decodes metadata
+    s_bench("open (path)", iterations, [&] {
+        return exif_metadata_reopen(meta, path) == EXIF_OK && exif_has_key(meta, BENCH_TAGS[0]) >= 0;
+    });
+    s_bench("open (blob)", iterations, [&] {
+        return exif_metadata_reopen_blob(meta, blob.data(), blob.size()) == EXIF_OK &&
+               exif_has_key(meta, BENCH_TAGS[0]) >= 0;
+    });
+    s_bench("open (mmap)", iterations, [&] {
+        return exif_metadata_open_mmap(meta, path) == EXIF_OK && exif_has_key(meta, BENCH_TAGS[0]) >= 0;
+    });
+    s_bench("inspect", iterations, [&] {
+        exif_inspection_t out;
+        return exif_metadata_inspect(path, &out) == EXIF_OK;
+    });
+
+    // per-tag lookups on decoded metadata; reopened every TAGS_PER_OPEN calls to bound the arena
+    for (const char *tag : BENCH_TAGS) {
+        char name[64];
+        snprintf(name, sizeof(name), "get_tag_string (%s)", tag);
+
+        int calls = 0;
+        s_check(exif_metadata_reopen_blob(meta, blob.data(), blob.size()), "reopen_blob");
+        s_bench(name, iterations, [&] {
+            if (++calls % TAGS_PER_OPEN == 0) {
+                exif_metadata_reopen_blob(meta, blob.data(), blob.size());
+            }
+            exif_get_tag_string(meta, tag);
+            return true;
+        });
+    }
+
+    s_bench("get_datetime", iterations, [&] {
+        int64_t epoch;
+        int32_t offset;
+        int has_offset;
+        return exif_get_datetime(meta, BENCH_TAGS[1], &epoch, &offset, &has_offset) != EXIF_ERROR_INVALID_ARGUMENT;
+    });
+    s_bench("get_tag_datetime", iterations, [&] {
+        int64_t epoch;
+        int32_t offset;
+        int has_offset;
+        return exif_get_tag_datetime(meta, EXIF_TAG_DATETIME_ORIGINAL, &epoch, &offset, &has_offset) !=
+               EXIF_ERROR_INVALID_ARGUMENT;
+    });
+
+    s_check(exif_metadata_reopen_blob(meta, blob.data(), blob.size()), "reopen_blob");
+    s_bench("save_blob", iterations, [&] {
+        unsigned char *out = nullptr;
+        size_t len = exif_metadata_save_blob(meta, blob.data(), blob.size(), &out);
+        exif_blob_free(out);
+        return len > 0;
+    });
+    s_bench("save_blob_view", iterations, [&] {
+        exif_blob_t *view = exif_metadata_save_blob_view(meta, blob.data(), blob.size());
+        bool ok = view != nullptr;
+        exif_blob_destroy(&view);
+        return ok;
+    });
+
+    s_bench("add_gps_info", iterations, [&] {
+        return exif_metadata_add_gps_info(meta, 37.287075, 126.574463, 7.853204) == EXIF_OK;
+    });
+
+    std::vector<exif_metadata_t*> handles(TAGS_PER_OPEN);
+    std::vector<exif_gps_t> coords(TAGS_PER_OPEN);
+    for (size_t i = 0; i < handles.size(); i++) {
+        handles[i] = exif_metadata_new();
+        s_check(exif_metadata_open_blob(handles[i], blob.data(), blob.size()), "open_blob");
+        coords[i] = { 37.287075 + i * 1e-4, 126.574463 - i * 1e-4, (double) i };
+    }
+    s_bench("add_gps_info_batch (64 handles)", iterations / TAGS_PER_OPEN + 1, [&] {
+        return exif_metadata_add_gps_info_batch(handles.data(), coords.data(), handles.size()) ==
+               (int) handles.size();
+    });
+
+    // every handle keeps its own coordinates, read back as written
+    for (size_t i = 0; i < handles.size(); i++) {
+        double lat, lon, alt;
+        s_check(exif_get_gps(handles[i], &lat, &lon, &alt), "get_gps");
+        if (fabs(lat - coords[i].lat) > 1e-6 || fabs(lon - coords[i].lon) > 1e-6 || fabs(alt - coords[i].alt) > 1e-3) {
+            fprintf(stderr, "add_gps_info_batch wrote (%f, %f, %f) to handle %zu, not (%f, %f, %f)\n",
+                    lat, lon, alt, i, coords[i].lat, coords[i].lon, coords[i].alt);
+            exit(1);
+        }
+    }
+    for (exif_metadata_t *handle : handles) {
+        exif_metadata_destroy(&handle);
+    }
+
+    s_bench("add_gps_to_file", iterations, [&] {
+        return exif_metadata_add_gps_to_file(path, "exif_bench_gps.jpg", 37.287075, 126.574463, 7.853204) == EXIF_OK;
+    });
+    remove("exif_bench_gps.jpg");
+
+    exif_metadata_destroy(&meta);
+    return 0;
+}
+
+bool s_read_file(const char *path, std::vector<unsigned char> &out) {
+    FILE *f = fopen(path, "rb");
+    if (f == nullptr) {
+        return false;
+    }
+
+    unsigned char buf[64 * 1024];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        out.insert(out.end(), buf, buf + n);
+    }
+
+    fclose(f);
+    return !out.empty();
+}
+
+void s_bench(const char *name, int iterations, const std::function<bool()> &fn) {
+    // warm up caches and lazily initialized state
+    if (!fn()) {
+        printf("%-40s failed\n", name);
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        fn();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    double ns = (double) std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / iterations;
+    printf("%-40s %12.0f ns/op\n", name, ns);
+}
+
+void s_check(int rc, const char *what) {
+    if (rc != EXIF_OK) {
+        fprintf(stderr, "%s failed: %s\n", what, exif_error_string(rc));
+        exit(1);
+    }
+}
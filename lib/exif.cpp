@@ -1,6 +1,24 @@
-#include <iostream>
+#include <list>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <thread>
 #include <stdio.h>
 #include <math.h>
+#include <fcntl.h>
+
+#ifdef EXIF_ENABLE_STATS
+#include <chrono>
+#endif
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include <exiv2/exiv2.hpp>
 #include <exiv2/basicio.hpp>
@@ -15,316 +33,3125 @@
 #define EXIF_KEY_GPS_LAT        "Exif.GPSInfo.GPSLatitude"
 #define EXIF_KEY_GPS_LON_REF    "Exif.GPSInfo.GPSLongitudeRef"
 #define EXIF_KEY_GPS_LON        "Exif.GPSInfo.GPSLongitude"
+#define EXIF_KEY_DATETIME       "Exif.Image.DateTime"
+#define EXIF_KEY_DATETIME_ORIG  "Exif.Photo.DateTimeOriginal"
+#define EXIF_KEY_DATETIME_DIGI  "Exif.Photo.DateTimeDigitized"
+#define EXIF_KEY_OFFSET         "Exif.Photo.OffsetTime"
+#define EXIF_KEY_OFFSET_ORIG    "Exif.Photo.OffsetTimeOriginal"
+#define EXIF_KEY_OFFSET_DIGI    "Exif.Photo.OffsetTimeDigitized"
+#define EXIF_KEY_SUBSEC         "Exif.Photo.SubSecTime"
+#define EXIF_KEY_SUBSEC_ORIG    "Exif.Photo.SubSecTimeOriginal"
+#define EXIF_KEY_PIXEL_X        "Exif.Photo.PixelXDimension"
+#define EXIF_KEY_PIXEL_Y        "Exif.Photo.PixelYDimension"
+#define XMP_KEY_RATING          "Xmp.xmp.Rating"
+
+// TIFF tags read directly by header-only inspection
+#define TIFF_TAG_DATETIME       0x0132
+#define TIFF_TAG_EXIF_IFD       0x8769
+#define TIFF_TAG_GPS_IFD        0x8825
+#define TIFF_TAG_DATETIME_ORIG  0x9003
+#define TIFF_TAG_PIXEL_X        0xa002
+#define TIFF_TAG_PIXEL_Y        0xa003
+#define TIFF_TAG_OFFSET         0x9010
+#define TIFF_TAG_OFFSET_ORIG    0x9011
+#define TIFF_TAG_SUBSEC         0x9290
+#define TIFF_TAG_SUBSEC_ORIG    0x9291
+#define TIFF_TAG_GPS_LAT        0x0002
+#define TIFF_TAG_GPS_LON        0x0004
+
+#define MIME_JPEG               "image/jpeg"
+#define MIME_HEIC               "image/heic"
+
+// upper bounds to read while inspecting headers
+#define INSPECT_MAX_META_BOX    (4 * 1024 * 1024)
+#define INSPECT_MAX_ITEM        (1024 * 1024)
+#define INSPECT_PREFETCH_FILES  8       // files read ahead of the one being parsed
+#define INSPECT_PREFETCH_SIZE   (256 * 1024)
+#define FINGERPRINT_SPAN        (64 * 1024)     // hashed from both ends of a file
+
+#define FNV_OFFSET_BASIS        0xcbf29ce484222325ULL
+#define FNV_PRIME               0x100000001b3ULL
+
+#define JPEG_MAX_SEGMENT        65533   // max payload of a JPEG segment
+#define COPY_BUFFER_SIZE        (1024 * 1024)
+
+static const char JPEG_EXIF_ID[] = "Exif\0\0";                       // 6 bytes
+static const char JPEG_XMP_ID[] = "http://ns.adobe.com/xap/1.0/";     // followed by NUL
+
+// fixed-point units of encoded GPS values
+#define GPS_SECOND_DENOM        1000000         // 1/1000000 second of arc, about 30 um
+#define GPS_ALT_DENOM           1000            // millimeter
+#define GPS_MAX_ALT             4000000.0       // keeps the numerator within uint32_t
+
+#define ARENA_BLOCK_SIZE        4096
+#define ERROR_MESSAGE_SIZE      256
+
+// bump allocator for strings handed out to callers
+typedef struct _exif_string_arena_t {
+    std::vector<char*> blocks;      // fixed-size blocks, kept across reset
+    size_t current;                 // index of the block being filled
+    size_t used;                    // used bytes of the current block
+    std::list<std::string> large;   // strings not fitting into a block
+} exif_string_arena_t;
+
+// read-only mapping of a whole file
+typedef struct _exif_mapping_t {
+    const unsigned char *data;
+    size_t len;
+#ifdef _WIN32
+    HANDLE mapping;
+#endif
+} exif_mapping_t;
 
 // private struct for exif_metadata_t
 struct _exif_metadata_private_t {
     Exiv2::Image::AutoPtr image;
+    exif_mapping_t mapping;     // backing bytes of image when opened by exif_metadata_open_mmap
+    bool metadata_read;     // whether readMetadata() was already done for current image
+    exif_string_arena_t arena;
+    int error_code;         // exif_error_t of the last failure
+    char error_message[ERROR_MESSAGE_SIZE];
+};
+
+// metadata-written image, its MemIo holds the output bytes
+struct _exif_blob_t {
+    Exiv2::Image::AutoPtr image;
+    const unsigned char *data;
+    size_t len;
+};
+
+// view of the TIFF structure of an Exif payload, to pick a few tags without decoding all of it
+typedef struct _exif_tiff_t {
+    const unsigned char *data;
+    size_t len;
+    bool big_endian;
+} exif_tiff_t;
+
+// GPS position converted to the values stored in GPSInfo IFD
+typedef struct _exif_gps_rationals_t {
+    uint32_t lat[3];        // numerators of degree/1, minute/1, second/GPS_SECOND_DENOM
+    uint32_t lon[3];
+    uint32_t alt;           // numerator of meter/GPS_ALT_DENOM
+    char lat_ref;           // 'N' or 'S'
+    char lon_ref;           // 'E' or 'W'
+    Exiv2::byte alt_ref;    // 0 above sea level, 1 below
+} exif_gps_rationals_t;
+
+// what HEIF boxes tell beyond metadata, found while inspecting
+typedef struct _exif_heif_items_t {
+    uint32_t width;             // ispe of the primary item, 0 if not found
+    uint32_t height;
+    uint64_t exif_offset;       // file position of the Exif item, 0 unless stored as a single extent in the file
+    uint64_t exif_len;
+    uint64_t base_offset;       // of the Exif item in 'iloc', extent offsets are relative to it
+    uint64_t offset_field;      // file positions of extent_offset and extent_length of the Exif item in 'iloc'
+    uint64_t length_field;
+    int offset_size;            // bytes of those fields
+    int length_size;
+} exif_heif_items_t;
+
+// key of each exif_tag_t, with the OffsetTime* of datetimes (-1 for other tags)
+typedef struct _exif_tag_key_t {
+    const char *key;
+    bool xmp;
+    int offset_tag;
+} exif_tag_key_t;
+
+static constexpr exif_tag_key_t TAG_KEYS[] = {
+    { EXIF_KEY_DATETIME,        false, EXIF_TAG_OFFSET },
+    { EXIF_KEY_DATETIME_ORIG,   false, EXIF_TAG_OFFSET_ORIGINAL },
+    { EXIF_KEY_DATETIME_DIGI,   false, EXIF_TAG_OFFSET_DIGITIZED },
+    { EXIF_KEY_OFFSET,          false, -1 },
+    { EXIF_KEY_OFFSET_ORIG,     false, -1 },
+    { EXIF_KEY_OFFSET_DIGI,     false, -1 },
+    { EXIF_KEY_SUBSEC,          false, -1 },
+    { EXIF_KEY_SUBSEC_ORIG,     false, -1 },
+    { EXIF_KEY_PIXEL_X,         false, -1 },
+    { EXIF_KEY_PIXEL_Y,         false, -1 },
+    { EXIF_KEY_GPS_LAT,         false, -1 },
+    { EXIF_KEY_GPS_LAT_REF,     false, -1 },
+    { EXIF_KEY_GPS_LON,         false, -1 },
+    { EXIF_KEY_GPS_LON_REF,     false, -1 },
+    { EXIF_KEY_GPS_ALT,         false, -1 },
+    { EXIF_KEY_GPS_ALT_REF,     false, -1 },
+    { XMP_KEY_RATING,           true,  -1 },
+};
+
+static_assert(sizeof(TAG_KEYS) / sizeof(TAG_KEYS[0]) == EXIF_TAG_COUNT, "TAG_KEYS must follow exif_tag_t");
+
+// process-wide state of Exiv2, initialized once
+static std::once_flag s_init_flag;
+static std::mutex s_xmp_mutex;
+
+// TAG_KEYS parsed by s_initialize, kept for the process lifetime; set for Exif or Xmp tags only
+static const Exiv2::ExifKey *s_exif_keys[EXIF_TAG_COUNT];
+static const Exiv2::XmpKey *s_xmp_keys[EXIF_TAG_COUNT];
+
+// handles reused by batch inspection, kept for the process lifetime
+static std::mutex s_pool_mutex;
+static std::vector<exif_metadata_t*> s_handle_pool;
+
+#ifdef EXIF_ENABLE_STATS
+// counters are updated with relaxed atomics; totals are only read after the work is done
+static std::atomic<uint64_t> s_stat_calls[EXIF_STAT_COUNT];
+static std::atomic<uint64_t> s_stat_nanos[EXIF_STAT_COUNT];
+
+// adds the time spent in the enclosing scope on leaving it, whichever return is taken
+class exif_stat_span_t {
+public:
+    explicit exif_stat_span_t(exif_stat_t stat) : stat_(stat), start_(std::chrono::steady_clock::now()) {}
+
+    ~exif_stat_span_t() {
+        auto elapsed = std::chrono::steady_clock::now() - start_;
+        s_stat_calls[stat_].fetch_add(1, std::memory_order_relaxed);
+        s_stat_nanos[stat_].fetch_add((uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+                                      std::memory_order_relaxed);
+    }
+
+private:
+    exif_stat_t stat_;
+    std::chrono::steady_clock::time_point start_;
 };
 
+#define EXIF_STAT_SPAN(stat)    exif_stat_span_t stat_span_(stat)
+#else
+#define EXIF_STAT_SPAN(stat)
+#endif
+
 // internal functions
-char* s_to_cstr(std::string &str);
-int s_try_destroy_gps_info(exif_metadata_t *self);
-int s_try_update_gps_info(exif_metadata_t *self, double lat, double lon, double alt);
+void s_initialize();
+void s_xmp_lock(void *data, bool lock);
+int s_set_error(exif_metadata_t *self, int code, const char *what, const char *detail);
+void s_clear_error(exif_metadata_t *self);
+int s_prepare_read(exif_metadata_t *self);
+int s_tag_of(const char *key);
+Exiv2::ExifData::iterator s_find_exif(Exiv2::ExifData &exif_data, int tag);
+Exiv2::XmpData::iterator s_find_xmp(Exiv2::XmpData &xmp_data, int tag);
+int s_int64_value(exif_metadata_t *self, const Exiv2::Value *value, const char *what, int64_t *out);
+int s_exif_datetime(Exiv2::ExifData &exif_data, int tag, int64_t *epoch, int32_t *offset, int *has_offset);
+bool s_parse_datetime(const char *buf, size_t len, int64_t *epoch);
+bool s_gps_coordinate(Exiv2::ExifData &exif_data, int tag, int ref_tag, char negative_ref, double *out);
+bool s_rational_at(const Exiv2::Exifdatum &datum, size_t i, double *out);
+bool s_parse_offset(const char *buf, size_t len, int32_t *offset);
+bool s_parse_digits(const char *p, int n, int *out);
+int64_t s_days_from_civil(int y, int m, int d);
+const char* s_arena_strdup(exif_string_arena_t *arena, const std::string &str);
+void s_arena_reset(exif_string_arena_t *arena);
+void s_arena_destroy(exif_string_arena_t *arena);
+int s_map_file(const char *path, exif_mapping_t *mapping);
+void s_unmap_file(exif_mapping_t *mapping);
+int s_read_metadata(exif_metadata_t *self);
+Exiv2::Image::AutoPtr s_write_metadata_to_blob(exif_metadata_t *self, const unsigned char *blob, size_t blob_len);
+const char* s_get_tag_string(exif_metadata_t *self, const char *tag);
+void s_destroy_gps_info(Exiv2::ExifData &exif_data, Exiv2::XmpData &xmp_data);
+void s_update_gps_info(Exiv2::ExifData &exif_data, const exif_gps_rationals_t &gps);
+bool s_gps_valid(const exif_gps_t &coord);
+void s_encode_gps(const exif_gps_t *coords, size_t n, exif_gps_rationals_t *out);
+void s_encode_dms(double degrees, uint32_t *dms);
+int s_apply_gps_info(exif_metadata_t *self, const exif_gps_t &coord, const exif_gps_rationals_t &gps);
+
+int s_open_readonly(const char *path);
+void s_close(int fd);
+long s_read_at(int fd, unsigned char *buf, size_t len, uint64_t offset);
+uint16_t s_be16(const unsigned char *p);
+uint32_t s_be32(const unsigned char *p);
+uint64_t s_be_n(const unsigned char *p, int n);
+int s_inspect_jpeg(int fd, std::vector<unsigned char> &tiff, Exiv2::XmpData &xmp_data);
+int s_inspect_heif(int fd, std::vector<unsigned char> &tiff, Exiv2::XmpData &xmp_data, exif_heif_items_t *items);
+bool s_is_heif(const unsigned char *magic);
+int s_add_gps_to_heif(int fd, const char *out_path, const exif_gps_rationals_t &gps);
+void s_put_be_n(unsigned char *p, uint64_t value, int n);
+bool s_heif_primary_size(const unsigned char *pitm, size_t pitm_len, const unsigned char *iprp, size_t iprp_len,
+                         uint32_t *width, uint32_t *height);
+bool s_heif_ispe(const unsigned char *ipco, size_t ipco_len, uint32_t index, uint32_t *width, uint32_t *height);
+int s_jpeg_sof(int fd, uint32_t *width, uint32_t *height);
+bool s_tiff_open(exif_tiff_t *tiff, const unsigned char *data, size_t len);
+uint32_t s_tiff_u16(const exif_tiff_t *tiff, size_t pos);
+uint32_t s_tiff_u32(const exif_tiff_t *tiff, size_t pos);
+bool s_tiff_find(const exif_tiff_t *tiff, uint32_t ifd, uint16_t tag, uint16_t *type, uint32_t *count, size_t *value_pos);
+uint32_t s_tiff_sub_ifd(const exif_tiff_t *tiff, uint32_t ifd, uint16_t tag);
+bool s_tiff_ascii(const exif_tiff_t *tiff, uint32_t ifd, uint16_t tag, const char **str, size_t *len);
+bool s_tiff_uint(const exif_tiff_t *tiff, uint32_t ifd, uint16_t tag, uint32_t *out);
+bool s_tiff_has_gps(const exif_tiff_t *tiff, uint32_t gps_ifd);
+int s_copy_range(int fd, FILE *out, uint64_t offset, uint64_t len);
+void s_write_segment(FILE *out, unsigned char marker, const unsigned char *id, size_t id_len,
+                     const unsigned char *payload, size_t payload_len);
+void s_fill_inspection(Exiv2::ExifData &exif_data, Exiv2::XmpData &xmp_data, exif_inspection_t *out);
+void s_fill_inspection_tiff(const std::vector<unsigned char> &tiff_data, Exiv2::XmpData &xmp_data, exif_inspection_t *out);
+void s_fill_rating(Exiv2::XmpData &xmp_data, exif_inspection_t *out);
+int s_inspect_with_handle(exif_metadata_t *handle, const char *path, exif_inspection_t *out);
+exif_metadata_t* s_pool_acquire();
+void s_pool_release(exif_metadata_t *handle);
+void s_prefetch(const char **paths, size_t n, std::atomic<size_t> &prefetched, size_t upto);
+void s_readahead(const char *path);
+bool s_file_size(int fd, uint64_t *size);
+uint64_t s_fnv1a(uint64_t hash, const unsigned char *data, size_t len);
+uint64_t s_fingerprint_content(int fd);
+uint64_t s_fingerprint_ascii(uint64_t hash, const char *str, size_t len);
+
+void exif_initialize() {
+    s_initialize();
+}
+
+int exif_stats_get(exif_stat_counter_t *out, size_t n) {
+#ifdef EXIF_ENABLE_STATS
+    if (out == nullptr && n > 0) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
+    }
+
+    size_t count = n < EXIF_STAT_COUNT ? n : EXIF_STAT_COUNT;
+    for (size_t i = 0; i < count; i++) {
+        out[i].calls = s_stat_calls[i].load(std::memory_order_relaxed);
+        out[i].nanos = s_stat_nanos[i].load(std::memory_order_relaxed);
+    }
+
+    return (int) count;
+#else
+    (void) out;
+    (void) n;
+    return EXIF_ERROR_UNSUPPORTED;
+#endif
+}
+
+void exif_stats_reset() {
+#ifdef EXIF_ENABLE_STATS
+    for (size_t i = 0; i < EXIF_STAT_COUNT; i++) {
+        s_stat_calls[i].store(0, std::memory_order_relaxed);
+        s_stat_nanos[i].store(0, std::memory_order_relaxed);
+    }
+#endif
+}
+
+const char* exif_stat_name(int stat) {
+    switch (stat) {
+        case EXIF_STAT_OPEN:                return "open";
+        case EXIF_STAT_READ_METADATA:       return "read metadata";
+        case EXIF_STAT_GET_TAG:             return "get tag";
+        case EXIF_STAT_GET_VALUE:           return "get value";
+        case EXIF_STAT_SAVE_BLOB:           return "save blob";
+        case EXIF_STAT_ADD_GPS:             return "add gps";
+        case EXIF_STAT_ADD_GPS_TO_FILE:     return "add gps to file";
+        case EXIF_STAT_INSPECT:             return "inspect";
+        case EXIF_STAT_INSPECT_FALLBACK:    return "inspect fallback";
+        case EXIF_STAT_WRITE_SIDECAR:       return "write sidecar";
+        default:                            return "unknown";
+    }
+}
+
+const char* exif_error_string(int code) {
+    switch (code) {
+        case EXIF_OK:                       return "ok";
+        case EXIF_ERROR_INVALID_ARGUMENT:   return "invalid argument";
+        case EXIF_ERROR_IO:                 return "i/o error";
+        case EXIF_ERROR_UNSUPPORTED:        return "unsupported format";
+        case EXIF_ERROR_CORRUPTED:          return "corrupted image";
+        case EXIF_ERROR_OPEN:               return "failed to open image";
+        case EXIF_ERROR_READ_METADATA:      return "failed to read metadata";
+        case EXIF_ERROR_WRITE_METADATA:     return "failed to write metadata";
+        case EXIF_ERROR_TOO_LARGE:          return "metadata too large";
+        case EXIF_ERROR_NOT_FOUND:          return "key not found";
+        default:                            return "unknown error";
+    }
+}
+
+int exif_metadata_last_error_code(exif_metadata_t *self) {
+    if (self == nullptr || self->priv == nullptr) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
+    }
+
+    return self->priv->error_code;
+}
+
+const char* exif_metadata_last_error(exif_metadata_t *self) {
+    if (self == nullptr || self->priv == nullptr) {
+        return exif_error_string(EXIF_ERROR_INVALID_ARGUMENT);
+    }
+
+    return self->priv->error_message;
+}
 
 exif_metadata_t* exif_metadata_new() {
+    s_initialize();
+
     exif_metadata_t *self = (exif_metadata_t*) malloc(sizeof(exif_metadata_t));
     memset(self, 0, sizeof(exif_metadata_t));
 
-    exif_metadata_private_t *priv = (exif_metadata_private_t*) malloc(sizeof(exif_metadata_private_t));
-    memset(priv, 0, sizeof(exif_metadata_private_t));
+    exif_metadata_private_t *priv = new exif_metadata_private_t();
 
     self->priv = priv;
     return self;
 }
 
 int exif_metadata_open(exif_metadata_t *self, const char *path) {
+    EXIF_STAT_SPAN(EXIF_STAT_OPEN);
+
+    if (self == nullptr || self->priv == nullptr || path == nullptr) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
+    }
+
+    s_clear_error(self);
+
     try {
         // read image from file
         self->priv->image = Exiv2::ImageFactory::open(path);
+        self->priv->metadata_read = false;
+        s_unmap_file(&self->priv->mapping);
 
     } catch (Exiv2::Error &e) {
-        std::cerr << "Error while read image: " << e << std::endl;
-        return -1;
+        return s_set_error(self, EXIF_ERROR_OPEN, "Failed to open image", e.what());
     }
 
-    return 0;
+    return EXIF_OK;
 }
 
 int exif_metadata_open_blob(exif_metadata_t *self, const unsigned char *blob, size_t blob_len) {
+    EXIF_STAT_SPAN(EXIF_STAT_OPEN);
+
+    if (self == nullptr || self->priv == nullptr || blob == nullptr) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
+    }
+
+    s_clear_error(self);
+
     try {
         // read image from blob
         self->priv->image = Exiv2::ImageFactory::open(blob, blob_len);
+        self->priv->metadata_read = false;
+        s_unmap_file(&self->priv->mapping);
 
     } catch (Exiv2::Error &e) {
-        std::cerr << "Error while read image from blob: " << e << std::endl;
-        return -1;
+        return s_set_error(self, EXIF_ERROR_OPEN, "Failed to open image from blob", e.what());
     }
 
-    return 0;
+    return EXIF_OK;
 }
 
-char* exif_get_tag_string(exif_metadata_t *self, const char *tag) {
-    if (self == nullptr|| self->priv == nullptr) {
-        return nullptr;
+int exif_metadata_open_mmap(exif_metadata_t *self, const char *path) {
+    EXIF_STAT_SPAN(EXIF_STAT_OPEN);
+
+    if (self == nullptr || self->priv == nullptr || path == nullptr) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
     }
 
-    if (self->priv->image.get() == nullptr) {
-        return nullptr;
+    s_clear_error(self);
+
+    exif_mapping_t mapping;
+    if (s_map_file(path, &mapping) != 0) {
+        return s_set_error(self, EXIF_ERROR_IO, "Failed to map file", path);
     }
 
     try {
-        // read metadata
-        self->priv->image->readMetadata();
+        // MemIo does not copy the borrowed bytes, and copies them only if written
+        Exiv2::BasicIo::AutoPtr io(new Exiv2::MemIo(mapping.data, (long) mapping.len));
+        self->priv->image = Exiv2::ImageFactory::open(io);
+        self->priv->metadata_read = false;
 
-        if (strncmp("Xmp.", tag, 4) == 0) {
-            Exiv2::XmpData &xmpData = self->priv->image->xmpData();
-            if (xmpData.empty()) {
-                return nullptr;
-            }
+    } catch (Exiv2::Error &e) {
+        s_unmap_file(&mapping);
+        return s_set_error(self, EXIF_ERROR_OPEN, "Failed to open image", e.what());
+    }
 
-            std::string val = xmpData[tag].toString();
-            return s_to_cstr(val);
+    // previous image is released, so its mapping can go as well
+    s_unmap_file(&self->priv->mapping);
+    self->priv->mapping = mapping;
 
-        } else {
-            Exiv2::ExifData &exifData = self->priv->image->exifData();
-            if (exifData.empty()) {
-                return nullptr;
-            }
+    return EXIF_OK;
+}
 
-            std::string val = exifData[tag].toString();
-            return s_to_cstr(val);
+const unsigned char* exif_metadata_mapped_data(exif_metadata_t *self, size_t *len) {
+    if (self == nullptr || self->priv == nullptr || self->priv->mapping.data == nullptr) {
+        if (len != nullptr) {
+            *len = 0;
         }
-    } catch ( ... ) {
         return nullptr;
     }
 
-    return nullptr;
+    if (len != nullptr) {
+        *len = self->priv->mapping.len;
+    }
+
+    return self->priv->mapping.data;
 }
 
-char* exif_get_mime(exif_metadata_t *self) {
-    if (self == nullptr|| self->priv == nullptr) {
-        return nullptr;
+int exif_metadata_reopen(exif_metadata_t *self, const char *path) {
+    if (self == nullptr || self->priv == nullptr) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
     }
 
-    if (self->priv->image.get() == nullptr) {
-        return nullptr;
+    // recycle the handle: drop previous image and strings, keep the arena blocks
+    exif_metadata_reset(self);
+    return exif_metadata_open(self, path);
+}
+
+int exif_metadata_reopen_blob(exif_metadata_t *self, const unsigned char *blob, size_t blob_len) {
+    if (self == nullptr || self->priv == nullptr) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
     }
 
-    std::string mime = self->priv->image->mimeType();
-    return s_to_cstr(mime);
+    exif_metadata_reset(self);
+    return exif_metadata_open_blob(self, blob, blob_len);
 }
 
-void exif_metadata_destroy(exif_metadata_t **self) {
-    if (self == nullptr || *self == nullptr || (*self)->priv == nullptr) {
-        return;
+const char* exif_get_tag_string(exif_metadata_t *self, const char *tag) {
+    EXIF_STAT_SPAN(EXIF_STAT_GET_TAG);
+
+    if (self == nullptr|| self->priv == nullptr) {
+        return nullptr;
     }
 
-    if ((*self)->priv->image.get() != nullptr) {
-        (*self)->priv->image.reset();
+    if (self->priv->image.get() == nullptr) {
+        s_set_error(self, EXIF_ERROR_INVALID_ARGUMENT, "No image opened", nullptr);
+        return nullptr;
     }
 
-    free((*self)->priv);
-    free(*self);
+    // read metadata
+    if (s_read_metadata(self) != EXIF_OK) {
+        return nullptr;
+    }
 
-    *self = NULL;
+    return s_get_tag_string(self, tag);
 }
 
+int exif_get_tags(exif_metadata_t *self, const char **tags, size_t n, const char **out_values) {
+    EXIF_STAT_SPAN(EXIF_STAT_GET_TAG);
 
-size_t exif_metadata_save_blob(exif_metadata_t *self, unsigned char* blob, size_t blob_len, unsigned char **out_blob) {
-    size_t out_blob_len = 0;
-
-    if (self == nullptr || self->priv == nullptr) {
-        return 0;
+    if (self == nullptr || self->priv == nullptr || tags == nullptr || out_values == nullptr) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
     }
 
     if (self->priv->image.get() == nullptr) {
-        return 0;
+        return s_set_error(self, EXIF_ERROR_INVALID_ARGUMENT, "No image opened", nullptr);
     }
 
-    unsigned char *buf = nullptr;
+    for (size_t i = 0; i < n; i++) {
+        out_values[i] = nullptr;
+    }
 
-    try {
-        // create MemIO class from blob
-        Exiv2::MemIo *mem = new Exiv2::MemIo(blob, blob_len);
-        Exiv2::BasicIo::AutoPtr memBlock(mem);
+    // read metadata only once for all tags
+    int rc = s_read_metadata(self);
+    if (rc != EXIF_OK) {
+        return rc;
+    }
 
-        // make image from blob and read its metadata
-        Exiv2::Image::AutoPtr image = Exiv2::ImageFactory::open(memBlock);
-        image->readMetadata();
+    int found = 0;
 
-        // write metadata from self
-        Exiv2::AccessMode mode = image->checkMode(Exiv2::mdExif);
-        if (mode == Exiv2::amWrite || mode == Exiv2::amReadWrite) {
-            image->setExifData(self->priv->image->exifData());
+    for (size_t i = 0; i < n; i++) {
+        out_values[i] = s_get_tag_string(self, tags[i]);
+        if (out_values[i] != nullptr) {
+            found++;
         }
+    }
 
-        mode = image->checkMode(Exiv2::mdXmp);
-        if (mode == Exiv2::amWrite || mode == Exiv2::amReadWrite) {
-            image->setXmpData(self->priv->image->xmpData());
-        }
+    return found;
+}
 
-        mode = image->checkMode(Exiv2::mdIptc);
-        if (mode == Exiv2::amWrite || mode == Exiv2::amReadWrite) {
-            image->setIptcData(self->priv->image->iptcData());
-        }
+const char* exif_get_mime(exif_metadata_t *self) {
+    if (self == nullptr|| self->priv == nullptr) {
+        return nullptr;
+    }
 
-        mode = image->checkMode(Exiv2::mdComment);
-        if (mode == Exiv2::amWrite || mode == Exiv2::amReadWrite) {
-            image->setComment(self->priv->image->comment());
-        }
+    if (self->priv->image.get() == nullptr) {
+        return nullptr;
+    }
 
-        image->writeMetadata();
+    return s_arena_strdup(&self->priv->arena, self->priv->image->mimeType());
+}
 
-        // copying MemIO memory block to new blob
-        mem->seek(0, Exiv2::BasicIo::beg);
+int exif_has_key(exif_metadata_t *self, const char *key) {
+    if (key == nullptr) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
+    }
 
-        size_t block_len = mem->size();
-        if (block_len < 1) {
-            return 0;
-        }
+    // keys of TAG_KEYS are looked up with the ones parsed at startup
+    int tag = s_tag_of(key);
+    if (tag >= 0) {
+        return exif_has_tag(self, tag);
+    }
 
-        buf = (unsigned char*) malloc(sizeof(unsigned char) * block_len);
-        size_t read_len = mem->read(buf, block_len);
+    EXIF_STAT_SPAN(EXIF_STAT_GET_VALUE);
 
-        out_blob_len = read_len;
-        *out_blob = buf;
+    int rc = s_prepare_read(self);
+    if (rc != EXIF_OK) {
+        return rc;
+    }
 
-    } catch (Exiv2::Error &e) {
-        std::cerr << "Failed to metadata to blob: " << e << std::endl;
-        if (out_blob != nullptr) {
-            free(out_blob);
+    try {
+        if (strncmp("Xmp.", key, 4) == 0) {
+            Exiv2::XmpData &xmp_data = self->priv->image->xmpData();
+            return xmp_data.findKey(Exiv2::XmpKey(key)) != xmp_data.end() ? 1 : 0;
         }
-    }
 
-    return out_blob_len;
+        Exiv2::ExifData &exif_data = self->priv->image->exifData();
+        return exif_data.findKey(Exiv2::ExifKey(key)) != exif_data.end() ? 1 : 0;
+
+    } catch (Exiv2::Error &e) {
+        return s_set_error(self, EXIF_ERROR_INVALID_ARGUMENT, key, e.what());
+    }
 }
 
-int exif_metadata_add_gps_info(exif_metadata_t *self, double lat, double lon, double alt) {
-    if (self == nullptr || self->priv == nullptr || self->priv->image.get() == nullptr) {
-        return -1;
+int exif_get_int64(exif_metadata_t *self, const char *key, int64_t *out) {
+    if (key == nullptr || out == nullptr) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
     }
 
-    // read metadata
-    self->priv->image->readMetadata();
+    int tag = s_tag_of(key);
+    if (tag >= 0) {
+        return exif_get_tag_int64(self, tag, out);
+    }
 
-    // try to delete previous gps info
-    int rc = s_try_destroy_gps_info(self);
-    if (rc != 0) {
+    EXIF_STAT_SPAN(EXIF_STAT_GET_VALUE);
+
+    int rc = s_prepare_read(self);
+    if (rc != EXIF_OK) {
         return rc;
     }
 
-    // update gps info
-    return s_try_update_gps_info(self, lat, lon, alt);
-}
+    try {
+        const Exiv2::Value *value = nullptr;
+
+        if (strncmp("Xmp.", key, 4) == 0) {
+            Exiv2::XmpData &xmp_data = self->priv->image->xmpData();
+            Exiv2::XmpData::iterator it = xmp_data.findKey(Exiv2::XmpKey(key));
+            if (it != xmp_data.end() && it->count() > 0) {
+                value = &it->value();
+            }
+        } else {
+            Exiv2::ExifData &exif_data = self->priv->image->exifData();
+            Exiv2::ExifData::iterator it = exif_data.findKey(Exiv2::ExifKey(key));
+            if (it != exif_data.end() && it->count() > 0) {
+                value = &it->value();
+            }
+        }
 
-char* s_to_cstr(std::string &str) {
-    char *ret = new char[str.length() + 1];
-    std::strcpy(ret, str.c_str());
+        return s_int64_value(self, value, key, out);
 
-    return ret;
+    } catch (Exiv2::Error &e) {
+        return s_set_error(self, EXIF_ERROR_INVALID_ARGUMENT, key, e.what());
+    }
 }
 
-int s_try_destroy_gps_info(exif_metadata_t *self) {
+int exif_has_tag(exif_metadata_t *self, int tag) {
+    EXIF_STAT_SPAN(EXIF_STAT_GET_VALUE);
+
+    if (tag < 0 || tag >= EXIF_TAG_COUNT) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
+    }
+
+    int rc = s_prepare_read(self);
+    if (rc != EXIF_OK) {
+        return rc;
+    }
+
     try {
+        if (TAG_KEYS[tag].xmp) {
+            Exiv2::XmpData &xmp_data = self->priv->image->xmpData();
+            return s_find_xmp(xmp_data, tag) != xmp_data.end() ? 1 : 0;
+        }
+
         Exiv2::ExifData &exif_data = self->priv->image->exifData();
+        return s_find_exif(exif_data, tag) != exif_data.end() ? 1 : 0;
 
-        Exiv2::ExifData::iterator exif_iter = exif_data.begin();
-        while (exif_iter != exif_data.end()) {
-            if (exif_iter->groupName() == "GPSInfo") {
-                exif_iter = exif_data.erase(exif_iter);
-            } else {
-                exif_iter++;
-            }
-        }
     } catch (Exiv2::Error &e) {
-        std::cerr << "Failed to destroy gps info in exif: " << e << std::endl;
-        return -1;
+        return s_set_error(self, EXIF_ERROR_READ_METADATA, TAG_KEYS[tag].key, e.what());
+    }
+}
+
+int exif_get_tag_int64(exif_metadata_t *self, int tag, int64_t *out) {
+    EXIF_STAT_SPAN(EXIF_STAT_GET_VALUE);
+
+    if (tag < 0 || tag >= EXIF_TAG_COUNT || out == nullptr) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
+    }
+
+    int rc = s_prepare_read(self);
+    if (rc != EXIF_OK) {
+        return rc;
     }
 
     try {
-        Exiv2::XmpData &xmp_data = self->priv->image->xmpData();
+        const Exiv2::Value *value = nullptr;
 
-        Exiv2::XmpData::iterator xmp_iter = xmp_data.begin();
-        while (xmp_iter != xmp_data.end()) {
-            if (xmp_iter->tagName().compare(0, 3, "GPS") == 0) {
-                xmp_iter = xmp_data.erase(xmp_iter);
-            } else {
-                xmp_iter++;
+        if (TAG_KEYS[tag].xmp) {
+            Exiv2::XmpData &xmp_data = self->priv->image->xmpData();
+            Exiv2::XmpData::iterator it = s_find_xmp(xmp_data, tag);
+            if (it != xmp_data.end() && it->count() > 0) {
+                value = &it->value();
+            }
+        } else {
+            Exiv2::ExifData &exif_data = self->priv->image->exifData();
+            Exiv2::ExifData::iterator it = s_find_exif(exif_data, tag);
+            if (it != exif_data.end() && it->count() > 0) {
+                value = &it->value();
             }
         }
+
+        return s_int64_value(self, value, TAG_KEYS[tag].key, out);
+
     } catch (Exiv2::Error &e) {
-        std::cerr << "Failed to destroy gps info in xmp: " << e << std::endl;
-        return -1;
+        return s_set_error(self, EXIF_ERROR_READ_METADATA, TAG_KEYS[tag].key, e.what());
     }
-
-    return 0;
 }
 
-int s_try_update_gps_info(exif_metadata_t *self, double lat, double lon, double alt) {
+int exif_get_rational_array(exif_metadata_t *self, const char *key, exif_rational_t *out, size_t cap, size_t *out_n) {
+    EXIF_STAT_SPAN(EXIF_STAT_GET_VALUE);
+
+    if (key == nullptr || (out == nullptr && cap > 0) || out_n == nullptr) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
+    }
+
+    *out_n = 0;
+
+    int rc = s_prepare_read(self);
+    if (rc != EXIF_OK) {
+        return rc;
+    }
+
     try {
         Exiv2::ExifData &exif_data = self->priv->image->exifData();
-
-        // set GPS info version
-        Exiv2::ExifKey key(EXIF_KEY_GPS_VERSION);
-        Exiv2::ExifData::iterator it = exif_data.findKey(key);
+        Exiv2::ExifData::iterator it = exif_data.findKey(Exiv2::ExifKey(key));
         if (it == exif_data.end()) {
-            exif_data [EXIF_KEY_GPS_VERSION] = "2 0 0 0";
+            return s_set_error(self, EXIF_ERROR_NOT_FOUND, key, nullptr);
         }
 
-        // set GPS info format
-        exif_data[EXIF_KEY_GPS_FORMAT] = "WGS-84";
+        // read the decoded pairs as they are, toRational() would truncate unsigned ones
+        size_t n = 0;
 
-        // set altitude
-        if (alt < 0.0) {
-            exif_data[EXIF_KEY_GPS_ALT_REF] = "1";
+        if (it->typeId() == Exiv2::unsignedRational) {
+            const std::vector<Exiv2::URational> &vals =
+                    static_cast<const Exiv2::ValueType<Exiv2::URational>&>(it->value()).value_;
+            n = vals.size();
+            for (size_t i = 0; i < n && i < cap; i++) {
+                out[i].numerator = vals[i].first;
+                out[i].denominator = vals[i].second;
+            }
+        } else if (it->typeId() == Exiv2::signedRational) {
+            const std::vector<Exiv2::Rational> &vals =
+                    static_cast<const Exiv2::ValueType<Exiv2::Rational>&>(it->value()).value_;
+            n = vals.size();
+            for (size_t i = 0; i < n && i < cap; i++) {
+                out[i].numerator = vals[i].first;
+                out[i].denominator = vals[i].second;
+            }
         } else {
-            exif_data[EXIF_KEY_GPS_ALT_REF] = "0";
+            return s_set_error(self, EXIF_ERROR_UNSUPPORTED, key, "not a rational");
         }
 
-        Exiv2::Rational frac = Exiv2::floatToRationalCast(static_cast<float>(fabs(alt)));
-        exif_data[EXIF_KEY_GPS_ALT] = frac;
+        *out_n = n;
 
-        // set latitude
-        if (lat < 0.0) {
-            exif_data[EXIF_KEY_GPS_LAT_REF] = "S";
-        } else {
-            exif_data[EXIF_KEY_GPS_LAT_REF] = "N";
+    } catch (Exiv2::Error &e) {
+        return s_set_error(self, EXIF_ERROR_INVALID_ARGUMENT, key, e.what());
+    }
+
+    return EXIF_OK;
+}
+
+int exif_get_datetime(exif_metadata_t *self, const char *key, int64_t *epoch, int32_t *offset, int *has_offset) {
+    if (key == nullptr) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
+    }
+
+    // only datetimes with a matching OffsetTime* are known
+    int tag = s_tag_of(key);
+    if (tag < 0 || TAG_KEYS[tag].offset_tag < 0) {
+        if (self == nullptr || self->priv == nullptr) {
+            return EXIF_ERROR_INVALID_ARGUMENT;
         }
 
-        double whole;
-        double remainder = modf(fabs(lat), &whole);
-        int deg = (int) floor(whole);
+        return s_set_error(self, EXIF_ERROR_INVALID_ARGUMENT, key, "not a datetime");
+    }
+
+    return exif_get_tag_datetime(self, tag, epoch, offset, has_offset);
+}
 
-        const int denom = 1000000;
-        remainder = modf(fabs(remainder * 60), &whole);
-        int min = (int) floor(whole);
-        int sec = (int) floor(remainder * 60 * denom);
+int exif_get_tag_datetime(exif_metadata_t *self, int tag, int64_t *epoch, int32_t *offset, int *has_offset) {
+    EXIF_STAT_SPAN(EXIF_STAT_GET_VALUE);
 
-        char buf[100];
-        snprintf(buf, 100, "%d/1 %d/1 %d/%d", deg, min, sec, denom);
-        exif_data[EXIF_KEY_GPS_LAT] = buf;
+    if (tag < 0 || tag >= EXIF_TAG_COUNT || epoch == nullptr || offset == nullptr || has_offset == nullptr) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
+    }
 
-        // set longitude
-        if (lon < 0.0) {
-            exif_data[EXIF_KEY_GPS_LON_REF] = "W";
-        } else {
-            exif_data[EXIF_KEY_GPS_LON_REF] = "E";
+    int rc = s_prepare_read(self);
+    if (rc != EXIF_OK) {
+        return rc;
+    }
+
+    try {
+        rc = s_exif_datetime(self->priv->image->exifData(), tag, epoch, offset, has_offset);
+        if (rc != EXIF_OK) {
+            return s_set_error(self, rc, TAG_KEYS[tag].key, nullptr);
         }
 
-        remainder = modf(fabs(lon), &whole);
-        deg = (int) floor(whole);
+    } catch (Exiv2::Error &e) {
+        return s_set_error(self, EXIF_ERROR_READ_METADATA, TAG_KEYS[tag].key, e.what());
+    }
+
+    return EXIF_OK;
+}
+
+const char* exif_tag_key(int tag) {
+    if (tag < 0 || tag >= EXIF_TAG_COUNT) {
+        return nullptr;
+    }
+
+    return TAG_KEYS[tag].key;
+}
+
+int exif_get_gps(exif_metadata_t *self, double *lat, double *lon, double *alt) {
+    EXIF_STAT_SPAN(EXIF_STAT_GET_VALUE);
+
+    if (lat == nullptr || lon == nullptr || alt == nullptr) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
+    }
+
+    int rc = s_prepare_read(self);
+    if (rc != EXIF_OK) {
+        return rc;
+    }
+
+    try {
+        Exiv2::ExifData &exif_data = self->priv->image->exifData();
+
+        if (!s_gps_coordinate(exif_data, EXIF_TAG_GPS_LATITUDE, EXIF_TAG_GPS_LATITUDE_REF, 'S', lat) ||
+            !s_gps_coordinate(exif_data, EXIF_TAG_GPS_LONGITUDE, EXIF_TAG_GPS_LONGITUDE_REF, 'W', lon)) {
+            return s_set_error(self, EXIF_ERROR_NOT_FOUND, "GPS coordinates", nullptr);
+        }
 
-        remainder = modf(fabs(remainder * 60), &whole);
-        min = (int) floor(whole);
-        sec = (int) floor(remainder * 60 * denom);
+        *alt = 0.0;
 
-        snprintf(buf, 100, "%d/1 %d/1 %d/%d", deg, min, sec, denom);
-        exif_data[EXIF_KEY_GPS_LON] = buf;
+        Exiv2::ExifData::iterator it = s_find_exif(exif_data, EXIF_TAG_GPS_ALTITUDE);
+        if (it != exif_data.end() && s_rational_at(*it, 0, alt)) {
+            Exiv2::ExifData::iterator ref = s_find_exif(exif_data, EXIF_TAG_GPS_ALTITUDE_REF);
+            if (ref != exif_data.end() && ref->count() > 0 && ref->toLong(0) == 1) {
+                *alt = -*alt;   // below sea level
+            }
+        }
 
     } catch (Exiv2::Error &e) {
-        std::cerr << "Failed to update gps info in exif: " << e << std::endl;
-        return -1;
+        return s_set_error(self, EXIF_ERROR_READ_METADATA, "Failed to read gps info", e.what());
     }
 
-    return 0;
+    return EXIF_OK;
+}
+
+int exif_metadata_inspect(const char *path, exif_inspection_t *out) {
+    EXIF_STAT_SPAN(EXIF_STAT_INSPECT);
+
+    if (path == nullptr || out == nullptr) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
+    }
+
+    s_initialize();
+
+    memset(out, 0, sizeof(exif_inspection_t));
+    out->rating = -1;
+
+    int fd = s_open_readonly(path);
+    if (fd < 0) {
+        return EXIF_ERROR_IO;
+    }
+
+    unsigned char magic[12];
+    if (s_read_at(fd, magic, sizeof(magic), 0) != sizeof(magic)) {
+        s_close(fd);
+        return EXIF_ERROR_UNSUPPORTED;  // too short to be an image we know
+    }
+
+    // Exif is kept raw and only the needed tags are picked; MakerNote is never decoded
+    std::vector<unsigned char> tiff;
+    Exiv2::XmpData xmp_data;
+    int rc;
+
+    try {
+        if (magic[0] == 0xff && magic[1] == 0xd8) {
+            strncpy(out->mime, MIME_JPEG, sizeof(out->mime) - 1);
+            rc = s_inspect_jpeg(fd, tiff, xmp_data);
+
+            // frame header follows the APP segments, within the same pages
+            if (rc == 0 && s_jpeg_sof(fd, &out->width, &out->height) != 0) {
+                out->width = out->height = 0;
+            }
+
+        } else if (s_is_heif(magic)) {
+            strncpy(out->mime, MIME_HEIC, sizeof(out->mime) - 1);
+
+            exif_heif_items_t items;
+            rc = s_inspect_heif(fd, tiff, xmp_data, &items);
+            out->width = items.width;
+            out->height = items.height;
+
+        } else {
+            // unsupported by the fast path; caller should fallback to exif_metadata_open
+            rc = EXIF_ERROR_UNSUPPORTED;
+        }
+
+        if (rc == 0) {
+            out->fingerprint = s_fingerprint_content(fd);
+            s_fill_inspection_tiff(tiff, xmp_data, out);
+        } else if (rc != EXIF_ERROR_UNSUPPORTED) {
+            rc = EXIF_ERROR_CORRUPTED;
+        }
+    } catch (Exiv2::Error &) {
+        rc = EXIF_ERROR_READ_METADATA;
+    }
+
+    s_close(fd);
+    return rc;
+}
+
+int exif_inspect_batch(const char **paths, size_t n, exif_inspection_t *out, int threads) {
+    if (n > 0 && (paths == nullptr || out == nullptr)) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
+    }
+
+    s_initialize();
+
+    size_t workers = threads > 0 ? (size_t) threads : std::thread::hardware_concurrency();
+    if (workers < 1) {
+        workers = 1;
+    } else if (workers > n) {
+        workers = n;
+    }
+
+    std::atomic<size_t> next(0);
+    std::atomic<size_t> prefetched(0);
+    std::atomic<int> inspected(0);
+
+    auto work = [&]() {
+        exif_metadata_t *handle = nullptr;  // only files unsupported by the fast path need one
+
+        for (;;) {
+            size_t i = next.fetch_add(1);
+            if (i >= n) {
+                break;
+            }
+
+            // let the device fetch the next headers while this one is parsed
+            s_prefetch(paths, n, prefetched, i + 1 + INSPECT_PREFETCH_FILES);
+
+            int rc = exif_metadata_inspect(paths[i], &out[i]);
+            if (rc != EXIF_OK && rc != EXIF_ERROR_IO && rc != EXIF_ERROR_INVALID_ARGUMENT) {
+                if (handle == nullptr) {
+                    handle = s_pool_acquire();
+                }
+
+                rc = s_inspect_with_handle(handle, paths[i], &out[i]);
+            }
+
+            out[i].status = rc;
+            if (rc == EXIF_OK) {
+                inspected++;
+            }
+        }
+
+        if (handle != nullptr) {
+            s_pool_release(handle);
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (size_t w = 1; w < workers; w++) {
+        try {
+            pool.emplace_back(work);
+        } catch (std::exception &) {
+            break;  // run with the workers started so far
+        }
+    }
+
+    work();
+
+    for (size_t w = 0; w < pool.size(); w++) {
+        pool[w].join();
+    }
+
+    return inspected.load();
+}
+
+void exif_metadata_reset(exif_metadata_t *self) {
+    if (self == nullptr || self->priv == nullptr) {
+        return;
+    }
+
+    if (self->priv->image.get() != nullptr) {
+        self->priv->image.reset();
+    }
+
+    // after the image, which reads from it
+    s_unmap_file(&self->priv->mapping);
+
+    self->priv->metadata_read = false;
+    s_arena_reset(&self->priv->arena);
+    s_clear_error(self);
+}
+
+void exif_metadata_destroy(exif_metadata_t **self) {
+    if (self == nullptr || *self == nullptr || (*self)->priv == nullptr) {
+        return;
+    }
+
+    if ((*self)->priv->image.get() != nullptr) {
+        (*self)->priv->image.reset();
+    }
+
+    s_unmap_file(&(*self)->priv->mapping);
+    s_arena_destroy(&(*self)->priv->arena);
+
+    delete (*self)->priv;
+    free(*self);
+
+    *self = NULL;
+}
+
+
+size_t exif_metadata_save_blob(exif_metadata_t *self, unsigned char* blob, size_t blob_len, unsigned char **out_blob) {
+    EXIF_STAT_SPAN(EXIF_STAT_SAVE_BLOB);
+
+    size_t out_blob_len = 0;
+
+    if (self == nullptr || self->priv == nullptr || out_blob == nullptr) {
+        return 0;
+    }
+
+    *out_blob = nullptr;
+
+    if (self->priv->image.get() == nullptr) {
+        s_set_error(self, EXIF_ERROR_INVALID_ARGUMENT, "No image opened", nullptr);
+        return 0;
+    }
+
+    try {
+        Exiv2::Image::AutoPtr image = s_write_metadata_to_blob(self, blob, blob_len);
+
+        // copying MemIO memory block to new blob
+        Exiv2::BasicIo &mem = image->io();
+        mem.seek(0, Exiv2::BasicIo::beg);
+
+        size_t block_len = mem.size();
+        if (block_len < 1) {
+            s_set_error(self, EXIF_ERROR_WRITE_METADATA, "Written image is empty", nullptr);
+            return 0;
+        }
+
+        unsigned char *buf = (unsigned char*) malloc(sizeof(unsigned char) * block_len);
+        size_t read_len = mem.read(buf, block_len);
+
+        out_blob_len = read_len;
+        *out_blob = buf;
+
+    } catch (Exiv2::Error &e) {
+        s_set_error(self, EXIF_ERROR_WRITE_METADATA, "Failed to write metadata to blob", e.what());
+    }
+
+    return out_blob_len;
+}
+
+exif_blob_t* exif_metadata_save_blob_view(exif_metadata_t *self, const unsigned char *blob, size_t blob_len) {
+    EXIF_STAT_SPAN(EXIF_STAT_SAVE_BLOB);
+
+    if (self == nullptr || self->priv == nullptr) {
+        return nullptr;
+    }
+
+    if (self->priv->image.get() == nullptr) {
+        s_set_error(self, EXIF_ERROR_INVALID_ARGUMENT, "No image opened", nullptr);
+        return nullptr;
+    }
+
+    try {
+        Exiv2::Image::AutoPtr image = s_write_metadata_to_blob(self, blob, blob_len);
+
+        // MemIo owns the written image after writeMetadata(), hand it out without copying
+        Exiv2::BasicIo &mem = image->io();
+        size_t block_len = mem.size();
+        if (block_len < 1) {
+            s_set_error(self, EXIF_ERROR_WRITE_METADATA, "Written image is empty", nullptr);
+            return nullptr;
+        }
+
+        exif_blob_t *out = new exif_blob_t();
+        out->data = mem.mmap();
+        out->len = block_len;
+
+        // metadata containers are no more needed, only the io is kept
+        image->clearMetadata();
+        out->image = image;
+
+        return out;
+
+    } catch (Exiv2::Error &e) {
+        s_set_error(self, EXIF_ERROR_WRITE_METADATA, "Failed to write metadata to blob", e.what());
+    }
+
+    return nullptr;
+}
+
+const unsigned char* exif_blob_data(const exif_blob_t *blob) {
+    return blob == nullptr ? nullptr : blob->data;
+}
+
+size_t exif_blob_len(const exif_blob_t *blob) {
+    return blob == nullptr ? 0 : blob->len;
+}
+
+void exif_blob_destroy(exif_blob_t **blob) {
+    if (blob == nullptr || *blob == nullptr) {
+        return;
+    }
+
+    delete *blob;
+    *blob = nullptr;
+}
+
+void exif_blob_free(unsigned char *buf) {
+    free(buf);
+}
+
+int exif_jpeg_dimensions(const char *path, uint32_t *width, uint32_t *height) {
+    if (path == nullptr || width == nullptr || height == nullptr) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
+    }
+
+    int fd = s_open_readonly(path);
+    if (fd < 0) {
+        return EXIF_ERROR_IO;
+    }
+
+    unsigned char soi[2];
+    int rc;
+
+    if (s_read_at(fd, soi, sizeof(soi), 0) != sizeof(soi) || soi[0] != 0xff || soi[1] != 0xd8) {
+        rc = EXIF_ERROR_UNSUPPORTED;
+    } else {
+        rc = s_jpeg_sof(fd, width, height) == 0 ? EXIF_OK : EXIF_ERROR_CORRUPTED;
+    }
+
+    s_close(fd);
+    return rc;
+}
+
+int exif_metadata_add_gps_info(exif_metadata_t *self, double lat, double lon, double alt) {
+    exif_gps_t coord = { lat, lon, alt };
+    exif_gps_rationals_t gps;
+    s_encode_gps(&coord, 1, &gps);
+
+    return s_apply_gps_info(self, coord, gps);
+}
+
+int exif_metadata_add_gps_info_batch(exif_metadata_t **handles, const exif_gps_t *coords, size_t n) {
+    if (handles == nullptr || coords == nullptr) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
+    }
+
+    // convert every coordinate first, in one pass over plain arrays
+    std::vector<exif_gps_rationals_t> encoded(n);
+    s_encode_gps(coords, n, encoded.data());
+
+    int updated = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (s_apply_gps_info(handles[i], coords[i], encoded[i]) == EXIF_OK) {
+            updated++;
+        }
+    }
+
+    return updated;
+}
+
+int exif_metadata_write_xmp_sidecar(exif_metadata_t *self, const char *path) {
+    EXIF_STAT_SPAN(EXIF_STAT_WRITE_SIDECAR);
+
+    if (self == nullptr || self->priv == nullptr || path == nullptr) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
+    }
+
+    s_clear_error(self);
+
+    if (self->priv->image.get() == nullptr) {
+        return s_set_error(self, EXIF_ERROR_INVALID_ARGUMENT, "No image opened", nullptr);
+    }
+
+    int rc = s_read_metadata(self);
+    if (rc != EXIF_OK) {
+        return rc;
+    }
+
+    std::string packet;
+
+    try {
+        Exiv2::Image *image = self->priv->image.get();
+
+        // only GPS is converted; the rest stays in the image, where readers find it anyway
+        Exiv2::ExifData gps_data;
+        for (Exiv2::ExifData::iterator it = image->exifData().begin(); it != image->exifData().end(); it++) {
+            if (it->ifdId() == Exiv2::gpsId) {
+                gps_data.add(*it);
+            }
+        }
+
+        Exiv2::XmpData xmp_data;
+        Exiv2::copyExifToXmp(gps_data, xmp_data);
+
+        Exiv2::XmpData::iterator rating = s_find_xmp(image->xmpData(), EXIF_TAG_RATING);
+        if (rating != image->xmpData().end()) {
+            xmp_data.add(*rating);
+        }
+
+        if (Exiv2::XmpParser::encode(packet, xmp_data) != 0) {
+            return s_set_error(self, EXIF_ERROR_WRITE_METADATA, "Failed to encode sidecar", nullptr);
+        }
+    } catch (Exiv2::Error &e) {
+        return s_set_error(self, EXIF_ERROR_WRITE_METADATA, "Failed to convert gps info", e.what());
+    }
+
+    FILE *out = fopen(path, "wb");
+    if (out == nullptr) {
+        return s_set_error(self, EXIF_ERROR_IO, "Failed to create sidecar", path);
+    }
+
+    bool written = fwrite(packet.data(), 1, packet.size(), out) == packet.size();
+    if (fclose(out) != 0 || !written) {
+        remove(path);
+        return s_set_error(self, EXIF_ERROR_IO, "Failed to write sidecar", path);
+    }
+
+    return EXIF_OK;
+}
+
+int exif_metadata_add_gps_to_file(const char *in_path, const char *out_path, double lat, double lon, double alt) {
+    EXIF_STAT_SPAN(EXIF_STAT_ADD_GPS_TO_FILE);
+
+    exif_gps_t coord = { lat, lon, alt };
+    if (in_path == nullptr || out_path == nullptr || !s_gps_valid(coord)) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
+    }
+
+    exif_gps_rationals_t gps;
+    s_encode_gps(&coord, 1, &gps);
+
+    s_initialize();
+
+    int fd = s_open_readonly(in_path);
+    if (fd < 0) {
+        return EXIF_ERROR_IO;
+    }
+
+    // segment position in input, in order of appearance before SOS
+    struct segment_t {
+        uint64_t offset;
+        uint32_t len;       // with marker and length field
+    };
+
+    std::vector<segment_t> segments;
+    int exif_index = -1;
+    int xmp_index = -1;
+    int last_app0_index = -1;
+
+    std::vector<unsigned char> exif_raw;
+    std::vector<unsigned char> xmp_raw;
+
+    unsigned char marker[4];
+    uint64_t offset = 2;
+    uint64_t scan_offset = 0;
+
+    // HEIF: Exif item is rewritten where it is, or moved to the end of file
+    unsigned char magic[12];
+    if (s_read_at(fd, magic, sizeof(magic), 0) == sizeof(magic) && s_is_heif(magic)) {
+        int rc = s_add_gps_to_heif(fd, out_path, gps);
+        s_close(fd);
+        return rc;
+    }
+
+    if (s_read_at(fd, marker, 2, 0) != 2 || marker[0] != 0xff || marker[1] != 0xd8) {
+        s_close(fd);
+        return EXIF_ERROR_UNSUPPORTED;  // neither JPEG nor HEIF
+    }
+
+    // collect segments until start of scan
+    while (scan_offset == 0) {
+        if (s_read_at(fd, marker, 2, offset) != 2 || marker[0] != 0xff) {
+            s_close(fd);
+            return EXIF_ERROR_CORRUPTED;
+        }
+
+        if (marker[1] == 0xff) {
+            offset++;   // fill byte, dropped
+            continue;
+        }
+
+        if (marker[1] == 0xda) {
+            scan_offset = offset;
+            break;
+        }
+
+        if (marker[1] == 0xd9) {
+            s_close(fd);
+            return EXIF_ERROR_CORRUPTED;    // EOI without image data
+        }
+
+        if (marker[1] == 0x01 || (marker[1] >= 0xd0 && marker[1] <= 0xd7)) {
+            segments.push_back({offset, 2});
+            offset += 2;
+            continue;
+        }
+
+        if (s_read_at(fd, marker + 2, 2, offset + 2) != 2 || s_be16(marker + 2) < 2) {
+            s_close(fd);
+            return EXIF_ERROR_CORRUPTED;
+        }
+
+        uint32_t seg_len = 2 + s_be16(marker + 2);
+        size_t payload_len = seg_len - 4;
+
+        if (marker[1] == 0xe0) {
+            last_app0_index = (int) segments.size();
+
+        } else if (marker[1] == 0xe1 && (exif_index < 0 || xmp_index < 0)) {
+            std::vector<unsigned char> payload(payload_len);
+            if (s_read_at(fd, payload.data(), payload_len, offset + 4) != (long) payload_len) {
+                s_close(fd);
+                return EXIF_ERROR_CORRUPTED;
+            }
+
+            if (exif_index < 0 && payload_len > 6 && memcmp(payload.data(), JPEG_EXIF_ID, 6) == 0) {
+                exif_index = (int) segments.size();
+                exif_raw.assign(payload.begin() + 6, payload.end());
+
+            } else if (xmp_index < 0 && payload_len > sizeof(JPEG_XMP_ID) &&
+                       memcmp(payload.data(), JPEG_XMP_ID, sizeof(JPEG_XMP_ID)) == 0) {
+                xmp_index = (int) segments.size();
+                xmp_raw.assign(payload.begin() + sizeof(JPEG_XMP_ID), payload.end());
+            }
+        }
+
+        segments.push_back({offset, seg_len});
+        offset += seg_len;
+    }
+
+    // build new Exif and XMP payloads
+    Exiv2::Blob exif_blob;
+    std::string xmp_packet;
+    bool drop_xmp = false;
+
+    try {
+        Exiv2::ExifData exif_data;
+        Exiv2::XmpData xmp_data;
+        Exiv2::ByteOrder byte_order = Exiv2::littleEndian;
+
+        if (!exif_raw.empty()) {
+            byte_order = Exiv2::ExifParser::decode(exif_data, exif_raw.data(), (uint32_t) exif_raw.size());
+        }
+
+        if (!xmp_raw.empty()) {
+            std::string packet((const char*) xmp_raw.data(), xmp_raw.size());
+            Exiv2::XmpParser::decode(xmp_data, packet);
+        }
+
+        s_destroy_gps_info(exif_data, xmp_data);
+        s_update_gps_info(exif_data, gps);
+
+        if (!exif_raw.empty()) {
+            Exiv2::ExifParser::encode(exif_blob, exif_raw.data(), (uint32_t) exif_raw.size(), byte_order, exif_data);
+        } else {
+            Exiv2::ExifParser::encode(exif_blob, byte_order, exif_data);
+        }
+
+        if (xmp_index >= 0) {
+            if (xmp_data.empty()) {
+                drop_xmp = true;    // every property was GPS, drop the segment
+            } else if (Exiv2::XmpParser::encode(xmp_packet, xmp_data) != 0) {
+                s_close(fd);
+                return EXIF_ERROR_WRITE_METADATA;
+            }
+        }
+    } catch (Exiv2::Error &) {
+        s_close(fd);
+        return EXIF_ERROR_READ_METADATA;
+    }
+
+    if (exif_blob.size() + 6 > JPEG_MAX_SEGMENT || xmp_packet.size() + sizeof(JPEG_XMP_ID) > JPEG_MAX_SEGMENT) {
+        s_close(fd);
+        return EXIF_ERROR_TOO_LARGE;    // does not fit into APP1, caller should rewrite whole image
+    }
+
+    FILE *out = fopen(out_path, "wb");
+    if (out == nullptr) {
+        s_close(fd);
+        return EXIF_ERROR_IO;
+    }
+
+    int rc = EXIF_OK;
+    const unsigned char soi[2] = {0xff, 0xd8};
+    fwrite(soi, 1, 2, out);
+
+    // new Exif goes where the old one was, or after JFIF APP0 if there was none
+    if (exif_index < 0 && last_app0_index < 0) {
+        s_write_segment(out, 0xe1, (const unsigned char*) JPEG_EXIF_ID, 6, exif_blob.data(), exif_blob.size());
+    }
+
+    for (size_t i = 0; i < segments.size() && rc == 0; i++) {
+        int idx = (int) i;
+
+        if (idx == exif_index) {
+            s_write_segment(out, 0xe1, (const unsigned char*) JPEG_EXIF_ID, 6, exif_blob.data(), exif_blob.size());
+        } else if (idx == xmp_index) {
+            if (!drop_xmp) {
+                s_write_segment(out, 0xe1, (const unsigned char*) JPEG_XMP_ID, sizeof(JPEG_XMP_ID),
+                                (const unsigned char*) xmp_packet.data(), xmp_packet.size());
+            }
+        } else {
+            rc = s_copy_range(fd, out, segments[i].offset, segments[i].len) == 0 ? EXIF_OK : EXIF_ERROR_IO;
+        }
+
+        if (exif_index < 0 && idx == last_app0_index) {
+            s_write_segment(out, 0xe1, (const unsigned char*) JPEG_EXIF_ID, 6, exif_blob.data(), exif_blob.size());
+        }
+    }
+
+    // stream entropy-coded data byte-for-byte
+    if (rc == 0) {
+        rc = s_copy_range(fd, out, scan_offset, UINT64_MAX) == 0 ? EXIF_OK : EXIF_ERROR_IO;
+    }
+
+    if (ferror(out)) {
+        rc = EXIF_ERROR_IO;
+    }
+
+    if (fclose(out) != 0) {
+        rc = EXIF_ERROR_IO;
+    }
+
+    s_close(fd);
+
+    if (rc != 0) {
+        remove(out_path);
+    }
+
+    return rc;
+}
+
+void s_initialize() {
+    std::call_once(s_init_flag, []() {
+        // XMP toolkit is not thread-safe by itself, so serialize it with the lock
+        Exiv2::XmpParser::initialize(s_xmp_lock, &s_xmp_mutex);
+
+        // Exiv2 warnings are written to stderr from parsing threads; keep only errors
+        Exiv2::LogMsg::setLevel(Exiv2::LogMsg::error);
+
+        // parse keys of exif_tag_t once instead of per lookup; Xmp ones need the toolkit above
+        for (int tag = 0; tag < EXIF_TAG_COUNT; tag++) {
+            if (TAG_KEYS[tag].xmp) {
+                s_xmp_keys[tag] = new Exiv2::XmpKey(TAG_KEYS[tag].key);
+            } else {
+                s_exif_keys[tag] = new Exiv2::ExifKey(TAG_KEYS[tag].key);
+            }
+        }
+    });
+}
+
+void s_xmp_lock(void *data, bool lock) {
+    std::mutex *mutex = (std::mutex*) data;
+
+    if (lock) {
+        mutex->lock();
+    } else {
+        mutex->unlock();
+    }
+}
+
+int s_set_error(exif_metadata_t *self, int code, const char *what, const char *detail) {
+    self->priv->error_code = code;
+
+    // keep the message on the handle, callers decide whether and how to report it
+    if (detail != nullptr) {
+        snprintf(self->priv->error_message, ERROR_MESSAGE_SIZE, "%s: %s", what, detail);
+    } else {
+        snprintf(self->priv->error_message, ERROR_MESSAGE_SIZE, "%s", what);
+    }
+
+    return code;
+}
+
+void s_clear_error(exif_metadata_t *self) {
+    self->priv->error_code = EXIF_OK;
+    self->priv->error_message[0] = '\0';
+}
+
+int s_prepare_read(exif_metadata_t *self) {
+    if (self == nullptr || self->priv == nullptr) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
+    }
+
+    if (self->priv->image.get() == nullptr) {
+        return s_set_error(self, EXIF_ERROR_INVALID_ARGUMENT, "No image opened", nullptr);
+    }
+
+    return s_read_metadata(self);
+}
+
+// tag of key in TAG_KEYS, -1 for other keys
+int s_tag_of(const char *key) {
+    for (int tag = 0; tag < EXIF_TAG_COUNT; tag++) {
+        if (strcmp(key, TAG_KEYS[tag].key) == 0) {
+            return tag;
+        }
+    }
+
+    return -1;
+}
+
+// tag must be an Exif one of TAG_KEYS, and s_initialize called
+Exiv2::ExifData::iterator s_find_exif(Exiv2::ExifData &exif_data, int tag) {
+    return exif_data.findKey(*s_exif_keys[tag]);
+}
+
+Exiv2::XmpData::iterator s_find_xmp(Exiv2::XmpData &xmp_data, int tag) {
+    return xmp_data.findKey(*s_xmp_keys[tag]);
+}
+
+int s_int64_value(exif_metadata_t *self, const Exiv2::Value *value, const char *what, int64_t *out) {
+    if (value == nullptr) {
+        return s_set_error(self, EXIF_ERROR_NOT_FOUND, what, nullptr);
+    }
+
+    int64_t val = value->toLong(0);
+    if (!value->ok()) {
+        return s_set_error(self, EXIF_ERROR_UNSUPPORTED, what, "not an integer");
+    }
+
+    *out = val;
+    return EXIF_OK;
+}
+
+int s_exif_datetime(Exiv2::ExifData &exif_data, int tag, int64_t *epoch, int32_t *offset, int *has_offset) {
+    int offset_tag = TAG_KEYS[tag].offset_tag;
+    if (offset_tag < 0) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
+    }
+
+    Exiv2::ExifData::iterator it = s_find_exif(exif_data, tag);
+    if (it == exif_data.end()) {
+        return EXIF_ERROR_NOT_FOUND;
+    }
+
+    // copy raw ascii "YYYY:MM:DD HH:MM:SS" instead of formatting it with toString()
+    char buf[32];
+    if (it->typeId() != Exiv2::asciiString || it->size() < 19 || it->size() >= (long) sizeof(buf)) {
+        return EXIF_ERROR_CORRUPTED;
+    }
+
+    it->copy((Exiv2::byte*) buf, Exiv2::invalidByteOrder);
+
+    if (!s_parse_datetime(buf, (size_t) it->size(), epoch)) {
+        return EXIF_ERROR_CORRUPTED;
+    }
+
+    *offset = 0;
+    *has_offset = 0;
+
+    it = s_find_exif(exif_data, offset_tag);
+    if (it != exif_data.end() && it->typeId() == Exiv2::asciiString && it->size() < (long) sizeof(buf)) {
+        it->copy((Exiv2::byte*) buf, Exiv2::invalidByteOrder);
+        *has_offset = s_parse_offset(buf, (size_t) it->size(), offset) ? 1 : 0;
+    }
+
+    return EXIF_OK;
+}
+
+// degrees, minutes and seconds to signed decimal degrees
+bool s_gps_coordinate(Exiv2::ExifData &exif_data, int tag, int ref_tag, char negative_ref, double *out) {
+    Exiv2::ExifData::iterator it = s_find_exif(exif_data, tag);
+    if (it == exif_data.end()) {
+        return false;
+    }
+
+    double parts[3] = {0.0, 0.0, 0.0};
+    long count = it->count() < 3 ? it->count() : 3;
+    if (count < 1) {
+        return false;
+    }
+
+    for (long i = 0; i < count; i++) {
+        if (!s_rational_at(*it, (size_t) i, &parts[i])) {
+            return false;
+        }
+    }
+
+    *out = parts[0] + parts[1] / 60.0 + parts[2] / 3600.0;
+
+    Exiv2::ExifData::iterator ref = s_find_exif(exif_data, ref_tag);
+    if (ref != exif_data.end() && ref->typeId() == Exiv2::asciiString && ref->size() > 0) {
+        Exiv2::byte buf[8] = {0};
+        if (ref->size() <= (long) sizeof(buf)) {
+            ref->copy(buf, Exiv2::invalidByteOrder);
+            if (buf[0] == negative_ref) {
+                *out = -*out;
+            }
+        }
+    }
+
+    return true;
+}
+
+// i-th rational as double, read from decoded pairs; false for other types or zero denominator
+bool s_rational_at(const Exiv2::Exifdatum &datum, size_t i, double *out) {
+    if (datum.typeId() == Exiv2::unsignedRational) {
+        const std::vector<Exiv2::URational> &vals =
+                static_cast<const Exiv2::ValueType<Exiv2::URational>&>(datum.value()).value_;
+        if (i >= vals.size() || vals[i].second == 0) {
+            return false;
+        }
+        *out = (double) vals[i].first / vals[i].second;
+
+    } else if (datum.typeId() == Exiv2::signedRational) {
+        const std::vector<Exiv2::Rational> &vals =
+                static_cast<const Exiv2::ValueType<Exiv2::Rational>&>(datum.value()).value_;
+        if (i >= vals.size() || vals[i].second == 0) {
+            return false;
+        }
+        *out = (double) vals[i].first / vals[i].second;
+
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+bool s_parse_datetime(const char *buf, size_t len, int64_t *epoch) {
+    int year, month, day, hour, min, sec;
+    if (len < 19 ||
+        !s_parse_digits(buf, 4, &year) || !s_parse_digits(buf + 5, 2, &month) ||
+        !s_parse_digits(buf + 8, 2, &day) || !s_parse_digits(buf + 11, 2, &hour) ||
+        !s_parse_digits(buf + 14, 2, &min) || !s_parse_digits(buf + 17, 2, &sec) ||
+        month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || min > 59 || sec > 60) {
+        // also rejects blank "    :  :     :  :  " written by some cameras
+        return false;
+    }
+
+    *epoch = s_days_from_civil(year, month, day) * 86400 + hour * 3600 + min * 60 + sec;
+    return true;
+}
+
+// offset as "+HH:MM" or "-HH:MM"
+bool s_parse_offset(const char *buf, size_t len, int32_t *offset) {
+    int off_hour, off_min;
+    if (len < 6 || (buf[0] != '+' && buf[0] != '-') ||
+        !s_parse_digits(buf + 1, 2, &off_hour) || buf[3] != ':' || !s_parse_digits(buf + 4, 2, &off_min)) {
+        return false;
+    }
+
+    *offset = (off_hour * 3600 + off_min * 60) * (buf[0] == '-' ? -1 : 1);
+    return true;
+}
+
+bool s_parse_digits(const char *p, int n, int *out) {
+    int val = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (p[i] < '0' || p[i] > '9') {
+            return false;
+        }
+
+        val = val * 10 + (p[i] - '0');
+    }
+
+    *out = val;
+    return true;
+}
+
+// days since 1970-01-01 of proleptic Gregorian date
+int64_t s_days_from_civil(int y, int m, int d) {
+    y -= m <= 2;
+    const int64_t era = (y >= 0 ? y : y - 399) / 400;
+    const int64_t yoe = y - era * 400;
+    const int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    const int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+    return era * 146097 + doe - 719468;
+}
+
+const char* s_arena_strdup(exif_string_arena_t *arena, const std::string &str) {
+    size_t len = str.length() + 1;
+
+    if (len > ARENA_BLOCK_SIZE) {
+        arena->large.push_back(str);
+        return arena->large.back().c_str();
+    }
+
+    if (arena->blocks.empty() || arena->used + len > ARENA_BLOCK_SIZE) {
+        if (!arena->blocks.empty()) {
+            // move to next block, reuse it if it was allocated before reset
+            arena->current++;
+        }
+
+        if (arena->current >= arena->blocks.size()) {
+            arena->blocks.push_back(new char[ARENA_BLOCK_SIZE]);
+            arena->current = arena->blocks.size() - 1;
+        }
+
+        arena->used = 0;
+    }
+
+    char *dst = arena->blocks[arena->current] + arena->used;
+    memcpy(dst, str.c_str(), len);
+    arena->used += len;
+
+    return dst;
+}
+
+void s_arena_reset(exif_string_arena_t *arena) {
+    arena->current = 0;
+    arena->used = 0;
+    arena->large.clear();
+}
+
+void s_arena_destroy(exif_string_arena_t *arena) {
+    for (size_t i = 0; i < arena->blocks.size(); i++) {
+        delete[] arena->blocks[i];
+    }
+
+    arena->blocks.clear();
+    s_arena_reset(arena);
+}
+
+int s_map_file(const char *path, exif_mapping_t *mapping) {
+    memset(mapping, 0, sizeof(exif_mapping_t));
+
+    int fd = s_open_readonly(path);
+    if (fd < 0) {
+        return -1;
+    }
+
+#ifdef _WIN32
+    __int64 size = _filelengthi64(fd);
+    if (size <= 0) {
+        s_close(fd);
+        return -1;
+    }
+
+    HANDLE mapping_handle = CreateFileMappingA((HANDLE) _get_osfhandle(fd), NULL, PAGE_READONLY, 0, 0, NULL);
+    s_close(fd);
+    if (mapping_handle == NULL) {
+        return -1;
+    }
+
+    void *addr = MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
+    if (addr == NULL) {
+        CloseHandle(mapping_handle);
+        return -1;
+    }
+
+    mapping->mapping = mapping_handle;
+#else
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        s_close(fd);
+        return -1;
+    }
+
+    off_t size = st.st_size;
+
+    // the mapping stays valid after the descriptor is closed
+    void *addr = mmap(nullptr, (size_t) size, PROT_READ, MAP_PRIVATE, fd, 0);
+    s_close(fd);
+    if (addr == MAP_FAILED) {
+        return -1;
+    }
+#endif
+
+    mapping->data = (const unsigned char*) addr;
+    mapping->len = (size_t) size;
+
+    return 0;
+}
+
+void s_unmap_file(exif_mapping_t *mapping) {
+    if (mapping->data == nullptr) {
+        return;
+    }
+
+#ifdef _WIN32
+    UnmapViewOfFile(mapping->data);
+    CloseHandle(mapping->mapping);
+#else
+    munmap((void*) mapping->data, mapping->len);
+#endif
+
+    memset(mapping, 0, sizeof(exif_mapping_t));
+}
+
+int s_read_metadata(exif_metadata_t *self) {
+    if (self->priv->metadata_read) {
+        return EXIF_OK;
+    }
+
+    EXIF_STAT_SPAN(EXIF_STAT_READ_METADATA);
+
+    try {
+        self->priv->image->readMetadata();
+        self->priv->metadata_read = true;
+
+    } catch (Exiv2::Error &e) {
+        return s_set_error(self, EXIF_ERROR_READ_METADATA, "Failed to read metadata", e.what());
+    }
+
+    return EXIF_OK;
+}
+
+Exiv2::Image::AutoPtr s_write_metadata_to_blob(exif_metadata_t *self, const unsigned char *blob, size_t blob_len) {
+    // create MemIO class from blob; it is not copied until written
+    Exiv2::BasicIo::AutoPtr memBlock(new Exiv2::MemIo(blob, blob_len));
+
+    // make image from blob and read its metadata
+    Exiv2::Image::AutoPtr image = Exiv2::ImageFactory::open(memBlock);
+    image->readMetadata();
+
+    // write metadata from self
+    Exiv2::AccessMode mode = image->checkMode(Exiv2::mdExif);
+    if (mode == Exiv2::amWrite || mode == Exiv2::amReadWrite) {
+        image->setExifData(self->priv->image->exifData());
+    }
+
+    mode = image->checkMode(Exiv2::mdXmp);
+    if (mode == Exiv2::amWrite || mode == Exiv2::amReadWrite) {
+        image->setXmpData(self->priv->image->xmpData());
+    }
+
+    mode = image->checkMode(Exiv2::mdIptc);
+    if (mode == Exiv2::amWrite || mode == Exiv2::amReadWrite) {
+        image->setIptcData(self->priv->image->iptcData());
+    }
+
+    mode = image->checkMode(Exiv2::mdComment);
+    if (mode == Exiv2::amWrite || mode == Exiv2::amReadWrite) {
+        image->setComment(self->priv->image->comment());
+    }
+
+    image->writeMetadata();
+
+    return image;
+}
+
+const char* s_get_tag_string(exif_metadata_t *self, const char *tag) {
+    try {
+        int known = s_tag_of(tag);
+
+        if (strncmp("Xmp.", tag, 4) == 0) {
+            Exiv2::XmpData &xmpData = self->priv->image->xmpData();
+            if (xmpData.empty()) {
+                return nullptr;
+            }
+
+            // do not use operator[], it adds an empty datum when the key is missing
+            Exiv2::XmpData::iterator it = known >= 0 ? s_find_xmp(xmpData, known) : xmpData.findKey(Exiv2::XmpKey(tag));
+            if (it == xmpData.end()) {
+                return nullptr;
+            }
+
+            return s_arena_strdup(&self->priv->arena, it->toString());
+
+        } else {
+            Exiv2::ExifData &exifData = self->priv->image->exifData();
+            if (exifData.empty()) {
+                return nullptr;
+            }
+
+            Exiv2::ExifData::iterator it = known >= 0 ? s_find_exif(exifData, known) : exifData.findKey(Exiv2::ExifKey(tag));
+            if (it == exifData.end()) {
+                return nullptr;
+            }
+
+            return s_arena_strdup(&self->priv->arena, it->toString());
+        }
+    } catch (Exiv2::Error &e) {
+        // mostly an invalid key, which is a caller error and not worth aborting the other tags
+        s_set_error(self, EXIF_ERROR_INVALID_ARGUMENT, tag, e.what());
+    } catch (std::exception &e) {
+        // never let an exception cross the C boundary
+        s_set_error(self, EXIF_ERROR_UNKNOWN, tag, e.what());
+    }
+
+    return nullptr;
+}
+
+// both functions throw Exiv2::Error, callers record it
+void s_destroy_gps_info(Exiv2::ExifData &exif_data, Exiv2::XmpData &xmp_data) {
+    // decoded entries are grouped by IFD, so GPS ones come in a run; erase each run at once.
+    // ifdId() is a plain field, unlike groupName() which builds a string per entry
+    Exiv2::ExifData::iterator exif_iter = exif_data.begin();
+    while (exif_iter != exif_data.end()) {
+        if (exif_iter->ifdId() != Exiv2::gpsId) {
+            exif_iter++;
+            continue;
+        }
+
+        Exiv2::ExifData::iterator run_end = exif_iter;
+        while (run_end != exif_data.end() && run_end->ifdId() == Exiv2::gpsId) {
+            run_end++;
+        }
+
+        exif_iter = exif_data.erase(exif_iter, run_end);
+    }
+
+    Exiv2::XmpData::iterator xmp_iter = xmp_data.begin();
+    while (xmp_iter != xmp_data.end()) {
+        if (xmp_iter->tagName().compare(0, 3, "GPS") == 0) {
+            xmp_iter = xmp_data.erase(xmp_iter);
+        } else {
+            xmp_iter++;
+        }
+    }
+}
+
+// previous GPS info must have been erased by s_destroy_gps_info; entries are appended as typed values,
+// so neither a key lookup nor a string parse happens per photo
+void s_update_gps_info(Exiv2::ExifData &exif_data, const exif_gps_rationals_t &gps) {
+    static const Exiv2::ExifKey version_key(EXIF_KEY_GPS_VERSION);
+    static const Exiv2::ExifKey format_key(EXIF_KEY_GPS_FORMAT);
+    static const Exiv2::ExifKey alt_ref_key(EXIF_KEY_GPS_ALT_REF);
+    static const Exiv2::ExifKey alt_key(EXIF_KEY_GPS_ALT);
+    static const Exiv2::ExifKey lat_ref_key(EXIF_KEY_GPS_LAT_REF);
+    static const Exiv2::ExifKey lat_key(EXIF_KEY_GPS_LAT);
+    static const Exiv2::ExifKey lon_ref_key(EXIF_KEY_GPS_LON_REF);
+    static const Exiv2::ExifKey lon_key(EXIF_KEY_GPS_LON);
+
+    static const Exiv2::byte version[] = { 2, 0, 0, 0 };
+
+    // set GPS info version and format
+    Exiv2::DataValue version_value(version, sizeof(version), Exiv2::invalidByteOrder, Exiv2::unsignedByte);
+    exif_data.add(version_key, &version_value);
+
+    Exiv2::AsciiValue format_value("WGS-84");
+    exif_data.add(format_key, &format_value);
+
+    // set altitude
+    Exiv2::DataValue alt_ref_value(&gps.alt_ref, 1, Exiv2::invalidByteOrder, Exiv2::unsignedByte);
+    exif_data.add(alt_ref_key, &alt_ref_value);
+
+    Exiv2::URationalValue alt_value;
+    alt_value.value_.push_back(Exiv2::URational(gps.alt, GPS_ALT_DENOM));
+    exif_data.add(alt_key, &alt_value);
+
+    // set latitude
+    Exiv2::AsciiValue lat_ref_value(std::string(1, gps.lat_ref));
+    exif_data.add(lat_ref_key, &lat_ref_value);
+
+    Exiv2::URationalValue lat_value;
+    lat_value.value_.push_back(Exiv2::URational(gps.lat[0], 1));
+    lat_value.value_.push_back(Exiv2::URational(gps.lat[1], 1));
+    lat_value.value_.push_back(Exiv2::URational(gps.lat[2], GPS_SECOND_DENOM));
+    exif_data.add(lat_key, &lat_value);
+
+    // set longitude
+    Exiv2::AsciiValue lon_ref_value(std::string(1, gps.lon_ref));
+    exif_data.add(lon_ref_key, &lon_ref_value);
+
+    Exiv2::URationalValue lon_value;
+    lon_value.value_.push_back(Exiv2::URational(gps.lon[0], 1));
+    lon_value.value_.push_back(Exiv2::URational(gps.lon[1], 1));
+    lon_value.value_.push_back(Exiv2::URational(gps.lon[2], GPS_SECOND_DENOM));
+    exif_data.add(lon_key, &lon_value);
+}
+
+bool s_gps_valid(const exif_gps_t &coord) {
+    // comparisons are false for NaN
+    return fabs(coord.lat) <= 90.0 && fabs(coord.lon) <= 180.0 && fabs(coord.alt) <= GPS_MAX_ALT;
+}
+
+// branch-free over the arrays so the compiler can vectorize it; out of range values are clamped
+// to keep the integer conversion defined, they are rejected by s_gps_valid before being written
+void s_encode_gps(const exif_gps_t *coords, size_t n, exif_gps_rationals_t *out) {
+    for (size_t i = 0; i < n; i++) {
+        double lat = coords[i].lat;
+        double lon = coords[i].lon;
+        double alt = coords[i].alt;
+
+        out[i].lat_ref = lat < 0.0 ? 'S' : 'N';
+        out[i].lon_ref = lon < 0.0 ? 'W' : 'E';
+        out[i].alt_ref = alt < 0.0 ? 1 : 0;
+
+        // fmin returns the other operand for NaN
+        s_encode_dms(fmin(fabs(lat), 90.0), out[i].lat);
+        s_encode_dms(fmin(fabs(lon), 180.0), out[i].lon);
+        out[i].alt = (uint32_t) llround(fmin(fabs(alt), GPS_MAX_ALT) * GPS_ALT_DENOM);
+    }
+}
+
+// split in integer units of 1/GPS_SECOND_DENOM second, so rounding never yields 60 minutes or seconds
+void s_encode_dms(double degrees, uint32_t *dms) {
+    const uint64_t per_minute = 60ULL * GPS_SECOND_DENOM;
+    const uint64_t per_degree = 60ULL * per_minute;
+
+    uint64_t units = (uint64_t) llround(degrees * (double) per_degree);
+
+    dms[0] = (uint32_t) (units / per_degree);
+    dms[1] = (uint32_t) (units % per_degree / per_minute);
+    dms[2] = (uint32_t) (units % per_minute);
+}
+
+int s_apply_gps_info(exif_metadata_t *self, const exif_gps_t &coord, const exif_gps_rationals_t &gps) {
+    EXIF_STAT_SPAN(EXIF_STAT_ADD_GPS);
+
+    if (self == nullptr || self->priv == nullptr) {
+        return EXIF_ERROR_INVALID_ARGUMENT;
+    }
+
+    // batch callers tell failed handles by their error code
+    s_clear_error(self);
+
+    if (self->priv->image.get() == nullptr) {
+        return s_set_error(self, EXIF_ERROR_INVALID_ARGUMENT, "No image opened", nullptr);
+    }
+
+    if (!s_gps_valid(coord)) {
+        return s_set_error(self, EXIF_ERROR_INVALID_ARGUMENT, "Invalid gps coordinate", nullptr);
+    }
+
+    // read metadata
+    int rc = s_read_metadata(self);
+    if (rc != EXIF_OK) {
+        return rc;
+    }
+
+    try {
+        // delete previous gps info, then update it
+        s_destroy_gps_info(self->priv->image->exifData(), self->priv->image->xmpData());
+        s_update_gps_info(self->priv->image->exifData(), gps);
+
+    } catch (Exiv2::Error &e) {
+        return s_set_error(self, EXIF_ERROR_WRITE_METADATA, "Failed to update gps info", e.what());
+    }
+
+    return EXIF_OK;
+}
+
+int s_open_readonly(const char *path) {
+#ifdef _WIN32
+    return _open(path, _O_RDONLY | _O_BINARY);
+#else
+    return open(path, O_RDONLY);
+#endif
+}
+
+void s_close(int fd) {
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+}
+
+long s_read_at(int fd, unsigned char *buf, size_t len, uint64_t offset) {
+    size_t total = 0;
+
+    while (total < len) {
+#ifdef _WIN32
+        if (_lseeki64(fd, (__int64) (offset + total), SEEK_SET) < 0) {
+            return -1;
+        }
+        int n = _read(fd, buf + total, (unsigned int) (len - total));
+#else
+        ssize_t n = pread(fd, buf + total, len - total, (off_t) (offset + total));
+#endif
+        if (n < 0) {
+            return -1;
+        } else if (n == 0) {
+            break;  // EOF
+        }
+
+        total += n;
+    }
+
+    return (long) total;
+}
+
+uint16_t s_be16(const unsigned char *p) {
+    return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+uint32_t s_be32(const unsigned char *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+uint64_t s_be_n(const unsigned char *p, int n) {
+    uint64_t v = 0;
+    for (int i = 0; i < n; i++) {
+        v = (v << 8) | p[i];
+    }
+
+    return v;
+}
+
+int s_inspect_jpeg(int fd, std::vector<unsigned char> &tiff, Exiv2::XmpData &xmp_data) {
+    bool exif_found = false;
+    bool xmp_found = false;
+
+    uint64_t offset = 2;    // skip SOI
+    unsigned char marker[4];
+    std::vector<unsigned char> segment;
+
+    // walk segments until start of scan; entropy-coded data is never touched
+    while (!(exif_found && xmp_found)) {
+        if (s_read_at(fd, marker, 2, offset) != 2 || marker[0] != 0xff) {
+            return -1;
+        }
+
+        if (marker[1] == 0xff) {
+            offset++;   // fill byte
+            continue;
+        }
+
+        if (marker[1] == 0xda || marker[1] == 0xd9) {
+            break;      // SOS or EOI
+        }
+
+        if (marker[1] == 0x01 || (marker[1] >= 0xd0 && marker[1] <= 0xd7)) {
+            offset += 2;    // standalone markers
+            continue;
+        }
+
+        if (s_read_at(fd, marker + 2, 2, offset + 2) != 2) {
+            return -1;
+        }
+
+        uint16_t seg_len = s_be16(marker + 2);
+        if (seg_len < 2) {
+            return -1;
+        }
+
+        if (marker[1] == 0xe1) {
+            // APP1: Exif or XMP
+            size_t payload_len = seg_len - 2;
+            segment.resize(payload_len);
+
+            if (s_read_at(fd, segment.data(), payload_len, offset + 4) != (long) payload_len) {
+                return -1;
+            }
+
+            if (!exif_found && payload_len > 6 && memcmp(segment.data(), JPEG_EXIF_ID, 6) == 0) {
+                tiff.assign(segment.begin() + 6, segment.end());
+                exif_found = true;
+
+            } else if (!xmp_found && payload_len > sizeof(JPEG_XMP_ID) &&
+                       memcmp(segment.data(), JPEG_XMP_ID, sizeof(JPEG_XMP_ID)) == 0) {
+                std::string packet((const char*) segment.data() + sizeof(JPEG_XMP_ID), payload_len - sizeof(JPEG_XMP_ID));
+                if (Exiv2::XmpParser::decode(xmp_data, packet) == 0) {
+                    xmp_found = true;
+                }
+            }
+        }
+
+        offset += 2 + seg_len;
+    }
+
+    return 0;
+}
+
+int s_jpeg_sof(int fd, uint32_t *width, uint32_t *height) {
+    uint64_t offset = 2;    // skip SOI
+    unsigned char marker[9];
+
+    // same walk as s_inspect_jpeg, up to the first frame header
+    for (;;) {
+        if (s_read_at(fd, marker, 2, offset) != 2 || marker[0] != 0xff) {
+            return -1;
+        }
+
+        if (marker[1] == 0xff) {
+            offset++;   // fill byte
+            continue;
+        }
+
+        if (marker[1] == 0xda || marker[1] == 0xd9) {
+            return -1;  // SOS or EOI before any frame
+        }
+
+        if (marker[1] == 0x01 || (marker[1] >= 0xd0 && marker[1] <= 0xd7)) {
+            offset += 2;    // standalone markers
+            continue;
+        }
+
+        if (s_read_at(fd, marker + 2, 2, offset + 2) != 2) {
+            return -1;
+        }
+
+        uint16_t seg_len = s_be16(marker + 2);
+        if (seg_len < 2) {
+            return -1;
+        }
+
+        // SOF0-SOF15, except DHT (c4), JPG (c8) and DAC (cc)
+        if (marker[1] >= 0xc0 && marker[1] <= 0xcf &&
+            marker[1] != 0xc4 && marker[1] != 0xc8 && marker[1] != 0xcc) {
+            // precision (1), height (2), width (2)
+            if (seg_len < 7 || s_read_at(fd, marker + 4, 5, offset + 4) != 5) {
+                return -1;
+            }
+
+            *height = s_be16(marker + 5);
+            *width = s_be16(marker + 7);
+
+            return *width > 0 && *height > 0 ? 0 : -1;    // height 0 is defined later by DNL, never seen in practice
+        }
+
+        offset += 2 + seg_len;
+    }
+}
+
+int s_inspect_heif(int fd, std::vector<unsigned char> &tiff, Exiv2::XmpData &xmp_data, exif_heif_items_t *items) {
+    memset(items, 0, sizeof(exif_heif_items_t));
+
+    unsigned char header[16];
+    uint64_t offset = 0;
+
+    uint64_t meta_offset = 0;
+    uint64_t meta_len = 0;
+
+    // find top-level 'meta' box
+    while (meta_len == 0) {
+        if (s_read_at(fd, header, 8, offset) != 8) {
+            return -1;
+        }
+
+        uint64_t box_len = s_be32(header);
+        uint32_t header_len = 8;
+
+        if (box_len == 1) {
+            if (s_read_at(fd, header + 8, 8, offset + 8) != 8) {
+                return -1;
+            }
+            box_len = s_be_n(header + 8, 8);
+            header_len = 16;
+        } else if (box_len == 0) {
+            return -1;  // box extends to EOF, never a 'meta' box in practice
+        }
+
+        if (box_len < header_len) {
+            return -1;
+        }
+
+        if (memcmp(header + 4, "meta", 4) == 0) {
+            meta_offset = offset + header_len + 4;  // skip version and flags
+            meta_len = box_len - header_len - 4;
+        }
+
+        offset += box_len;
+    }
+
+    if (meta_len > INSPECT_MAX_META_BOX) {
+        return -1;
+    }
+
+    std::vector<unsigned char> meta(meta_len);
+    if (s_read_at(fd, meta.data(), meta_len, meta_offset) != (long) meta_len) {
+        return -1;
+    }
+
+    uint32_t exif_item_id = 0;
+    uint32_t xmp_item_id = 0;
+
+    const unsigned char *iloc = nullptr;
+    size_t iloc_len = 0;
+    const unsigned char *pitm = nullptr;
+    size_t pitm_len = 0;
+    const unsigned char *iprp = nullptr;
+    size_t iprp_len = 0;
+
+    // walk children of 'meta': we need 'iinf' (item types) and 'iloc' (item locations),
+    // and 'pitm' (primary item) with 'iprp' (item properties) for the image size
+    size_t pos = 0;
+    while (pos + 8 <= meta_len) {
+        size_t box_len = s_be32(&meta[pos]);
+        if (box_len < 8 || pos + box_len > meta_len) {
+            break;
+        }
+
+        const unsigned char *box = &meta[pos];
+
+        // entry_count is 16 bits in version 0, 32 bits after
+        if (memcmp(box + 4, "iinf", 4) == 0 && box_len >= 14 && (box[8] == 0 || box_len >= 16)) {
+            int version = box[8];
+            size_t p = 12;
+            uint32_t entry_count;
+
+            if (version == 0) {
+                entry_count = s_be16(box + p);
+                p += 2;
+            } else {
+                entry_count = s_be32(box + p);
+                p += 4;
+            }
+
+            for (uint32_t i = 0; i < entry_count && p + 12 <= box_len; i++) {
+                size_t infe_len = s_be32(box + p);
+                if (infe_len < 12 || p + infe_len > box_len || memcmp(box + p + 4, "infe", 4) != 0) {
+                    break;
+                }
+
+                const unsigned char *infe = box + p;
+                int infe_version = infe[8];
+                uint32_t item_id = 0;
+                size_t q = 12;
+
+                if (infe_version == 2 && infe_len >= q + 8) {
+                    item_id = s_be16(infe + q);
+                    q += 4;     // item_ID, item_protection_index
+                } else if (infe_version == 3 && infe_len >= q + 10) {
+                    item_id = s_be32(infe + q);
+                    q += 6;
+                } else {
+                    p += infe_len;
+                    continue;   // legacy entries without item_type
+                }
+
+                const unsigned char *item_type = infe + q;
+                q += 4;
+
+                if (memcmp(item_type, "Exif", 4) == 0) {
+                    exif_item_id = item_id;
+
+                } else if (memcmp(item_type, "mime", 4) == 0) {
+                    // item_name, then content_type
+                    while (q < infe_len && infe[q] != 0) q++;
+                    q++;
+
+                    static const char xmp_content_type[] = "application/rdf+xml";
+                    if (q + sizeof(xmp_content_type) <= infe_len &&
+                        memcmp(infe + q, xmp_content_type, sizeof(xmp_content_type)) == 0) {
+                        xmp_item_id = item_id;
+                    }
+                }
+
+                p += infe_len;
+            }
+
+        } else if (memcmp(box + 4, "iloc", 4) == 0) {
+            iloc = box;
+            iloc_len = box_len;
+
+        } else if (memcmp(box + 4, "pitm", 4) == 0) {
+            pitm = box;
+            pitm_len = box_len;
+
+        } else if (memcmp(box + 4, "iprp", 4) == 0) {
+            iprp = box;
+            iprp_len = box_len;
+        }
+
+        pos += box_len;
+    }
+
+    if (iloc == nullptr || iloc_len < 16) {
+        return -1;
+    }
+
+    // size is optional, left 0 when not found
+    if (!s_heif_primary_size(pitm, pitm_len, iprp, iprp_len, &items->width, &items->height)) {
+        items->width = items->height = 0;
+    }
+
+    // parse 'iloc' to read Exif and XMP items
+    int version = iloc[8];
+    int offset_size = iloc[12] >> 4;
+    int length_size = iloc[12] & 0x0f;
+    int base_offset_size = iloc[13] >> 4;
+    int index_size = (version == 1 || version == 2) ? (iloc[13] & 0x0f) : 0;
+
+    size_t p = 14;
+    uint32_t item_count;
+
+    if (version < 2) {
+        item_count = s_be16(iloc + p);
+        p += 2;
+    } else {
+        item_count = s_be32(iloc + p);
+        p += 4;
+    }
+
+    for (uint32_t i = 0; i < item_count; i++) {
+        size_t id_size = version < 2 ? 2 : 4;
+        if (p + id_size > iloc_len) {
+            return -1;
+        }
+
+        uint32_t item_id = (uint32_t) s_be_n(iloc + p, (int) id_size);
+        p += id_size;
+
+        int construction_method = 0;
+        if (version == 1 || version == 2) {
+            if (p + 2 > iloc_len) {
+                return -1;
+            }
+            construction_method = s_be16(iloc + p) & 0x0f;
+            p += 2;
+        }
+
+        if (p + 2 + base_offset_size + 2 > iloc_len) {
+            return -1;
+        }
+
+        p += 2; // data_reference_index
+        uint64_t base_offset = s_be_n(iloc + p, base_offset_size);
+        p += base_offset_size;
+
+        uint16_t extent_count = s_be16(iloc + p);
+        p += 2;
+
+        bool wanted = construction_method == 0 &&
+                      ((exif_item_id != 0 && item_id == exif_item_id) || (xmp_item_id != 0 && item_id == xmp_item_id));
+        std::vector<unsigned char> item;
+
+        for (uint16_t j = 0; j < extent_count; j++) {
+            if (p + index_size + offset_size + length_size > iloc_len) {
+                return -1;
+            }
+
+            p += index_size;
+            uint64_t extent_offset = s_be_n(iloc + p, offset_size);
+            p += offset_size;
+            uint64_t extent_len = s_be_n(iloc + p, length_size);
+            p += length_size;
+
+            if (!wanted) {
+                continue;
+            }
+
+            // where Exif could be rewritten, in place or by pointing 'iloc' elsewhere
+            if (item_id == exif_item_id && extent_count == 1 && extent_len > 0) {
+                size_t iloc_pos = (size_t) (iloc - meta.data());
+
+                items->exif_offset = base_offset + extent_offset;
+                items->exif_len = extent_len;
+                items->base_offset = base_offset;
+                items->offset_field = meta_offset + iloc_pos + p - length_size - offset_size;
+                items->length_field = meta_offset + iloc_pos + p - length_size;
+                items->offset_size = offset_size;
+                items->length_size = length_size;
+            }
+
+            if (item.size() + extent_len > INSPECT_MAX_ITEM) {
+                return -1;
+            }
+
+            size_t prev_len = item.size();
+            item.resize(prev_len + extent_len);
+            if (s_read_at(fd, item.data() + prev_len, extent_len, base_offset + extent_offset) != (long) extent_len) {
+                return -1;
+            }
+        }
+
+        if (!wanted) {
+            continue;
+        }
+
+        if (item_id == exif_item_id && item.size() > 4) {
+            // Exif item starts with the offset to TIFF header
+            uint32_t tiff_offset = s_be32(item.data());
+            if (4 + (size_t) tiff_offset < item.size()) {
+                tiff.assign(item.begin() + 4 + tiff_offset, item.end());
+            }
+
+        } else if (item_id == xmp_item_id && !item.empty()) {
+            std::string packet((const char*) item.data(), item.size());
+            Exiv2::XmpParser::decode(xmp_data, packet);
+        }
+    }
+
+    return 0;
+}
+
+bool s_is_heif(const unsigned char *magic) {
+    return memcmp(magic + 4, "ftyp", 4) == 0 &&
+           (memcmp(magic + 8, "heic", 4) == 0 || memcmp(magic + 8, "heix", 4) == 0 ||
+            memcmp(magic + 8, "mif1", 4) == 0 || memcmp(magic + 8, "msf1", 4) == 0);
+}
+
+int s_add_gps_to_heif(int fd, const char *out_path, const exif_gps_rationals_t &gps) {
+    std::vector<unsigned char> tiff;
+    Exiv2::XmpData xmp_data;
+    exif_heif_items_t items;
+    Exiv2::Blob exif_blob;
+
+    try {
+        if (s_inspect_heif(fd, tiff, xmp_data, &items) != 0) {
+            return EXIF_ERROR_CORRUPTED;
+        }
+
+        // a new Exif item needs entries in 'iinf', 'iloc' and 'iref', and every box after them would move
+        if (tiff.empty() || items.exif_len == 0) {
+            return EXIF_ERROR_UNSUPPORTED;
+        }
+
+        Exiv2::ExifData exif_data;
+        Exiv2::ByteOrder byte_order = Exiv2::ExifParser::decode(exif_data, tiff.data(), (uint32_t) tiff.size());
+
+        // XMP item is kept as it is, only Exif is rewritten
+        s_destroy_gps_info(exif_data, xmp_data);
+        s_update_gps_info(exif_data, gps);
+
+        Exiv2::ExifParser::encode(exif_blob, tiff.data(), (uint32_t) tiff.size(), byte_order, exif_data);
+    } catch (Exiv2::Error &) {
+        return EXIF_ERROR_READ_METADATA;
+    }
+
+    // Exif item: offset to TIFF header (4), bytes skipped by it (e.g., "Exif\0\0"), then TIFF
+    uint64_t prefix_len = items.exif_len - tiff.size();
+    uint64_t tiff_pos = items.exif_offset + prefix_len;
+
+    // bytes replaced in the copy of the input, in file order
+    struct patch_t {
+        uint64_t offset;
+        uint64_t replaced;
+        std::vector<unsigned char> data;
+    };
+
+    std::vector<patch_t> patches;
+    std::vector<unsigned char> appended;
+
+    if (exif_blob.size() <= tiff.size()) {
+        // in place; readers follow IFD offsets, zeros after the new TIFF are never read
+        std::vector<unsigned char> data(exif_blob.begin(), exif_blob.end());
+        data.resize(tiff.size(), 0);
+        patches.push_back({tiff_pos, tiff.size(), data});
+
+    } else {
+        // file length by walking top-level boxes; nothing can be appended after a box extending to EOF
+        unsigned char header[16];
+        uint64_t file_len = 0;
+        long n;
+
+        while ((n = s_read_at(fd, header, 8, file_len)) == 8) {
+            uint64_t box_len = s_be32(header);
+
+            if (box_len == 1) {
+                if (s_read_at(fd, header + 8, 8, file_len + 8) != 8) {
+                    return EXIF_ERROR_CORRUPTED;
+                }
+                box_len = s_be_n(header + 8, 8);
+            } else if (box_len == 0) {
+                return EXIF_ERROR_TOO_LARGE;
+            }
+
+            if (box_len < 8) {
+                return EXIF_ERROR_CORRUPTED;
+            }
+
+            file_len += box_len;
+        }
+
+        if (n != 0) {
+            return EXIF_ERROR_CORRUPTED;    // trailing bytes, or a box past EOF
+        }
+
+        // moved into a new 'mdat' at the end; its 'iloc' extent is pointed there, with the same field sizes
+        uint64_t new_len = prefix_len + exif_blob.size();
+        uint64_t new_pos = file_len + 8;
+
+        auto fits = [](uint64_t value, int size) {
+            return size >= 8 || value < (1ULL << (8 * size));
+        };
+
+        if (items.offset_size == 0 || items.length_size == 0 || new_pos < items.base_offset ||
+            !fits(new_pos - items.base_offset, items.offset_size) || !fits(new_len, items.length_size) ||
+            8 + new_len > UINT32_MAX) {
+            return EXIF_ERROR_TOO_LARGE;
+        }
+
+        std::vector<unsigned char> offset_field(items.offset_size);
+        std::vector<unsigned char> length_field(items.length_size);
+        s_put_be_n(offset_field.data(), new_pos - items.base_offset, items.offset_size);
+        s_put_be_n(length_field.data(), new_len, items.length_size);
+
+        patches.push_back({items.offset_field, (uint64_t) items.offset_size, offset_field});
+        patches.push_back({items.length_field, (uint64_t) items.length_size, length_field});
+
+        appended.resize(8 + prefix_len);
+        s_put_be_n(appended.data(), 8 + new_len, 4);
+        memcpy(appended.data() + 4, "mdat", 4);
+
+        if (s_read_at(fd, appended.data() + 8, prefix_len, items.exif_offset) != (long) prefix_len) {
+            return EXIF_ERROR_CORRUPTED;
+        }
+        appended.insert(appended.end(), exif_blob.begin(), exif_blob.end());
+    }
+
+    FILE *out = fopen(out_path, "wb");
+    if (out == nullptr) {
+        return EXIF_ERROR_IO;
+    }
+
+    // everything else, coded image data included, is copied byte-for-byte
+    int rc = EXIF_OK;
+    uint64_t pos = 0;
+
+    for (const patch_t &patch : patches) {
+        if (s_copy_range(fd, out, pos, patch.offset - pos) != 0) {
+            rc = EXIF_ERROR_IO;
+            break;
+        }
+
+        fwrite(patch.data.data(), 1, patch.data.size(), out);
+        pos = patch.offset + patch.replaced;
+    }
+
+    if (rc == 0) {
+        rc = s_copy_range(fd, out, pos, UINT64_MAX) == 0 ? EXIF_OK : EXIF_ERROR_IO;
+    }
+
+    if (rc == 0 && !appended.empty()) {
+        fwrite(appended.data(), 1, appended.size(), out);
+    }
+
+    if (ferror(out)) {
+        rc = EXIF_ERROR_IO;
+    }
+
+    if (fclose(out) != 0) {
+        rc = EXIF_ERROR_IO;
+    }
+
+    if (rc != 0) {
+        remove(out_path);
+    }
+
+    return rc;
+}
+
+void s_put_be_n(unsigned char *p, uint64_t value, int n) {
+    for (int i = n - 1; i >= 0; i--) {
+        p[i] = (unsigned char) (value & 0xff);
+        value >>= 8;
+    }
+}
+
+bool s_heif_primary_size(const unsigned char *pitm, size_t pitm_len, const unsigned char *iprp, size_t iprp_len,
+                         uint32_t *width, uint32_t *height) {
+    if (pitm == nullptr || iprp == nullptr || pitm_len < 14) {
+        return false;
+    }
+
+    uint32_t primary_id;
+    if (pitm[8] == 0) {
+        primary_id = s_be16(pitm + 12);
+    } else if (pitm_len >= 16) {
+        primary_id = s_be32(pitm + 12);
+    } else {
+        return false;
+    }
+
+    // children of 'iprp': 'ipco' (properties, indexed from 1) and 'ipma' (associations to items)
+    const unsigned char *ipco = nullptr;
+    size_t ipco_len = 0;
+    const unsigned char *ipma = nullptr;
+    size_t ipma_len = 0;
+
+    size_t pos = 8;
+    while (pos + 8 <= iprp_len) {
+        size_t box_len = s_be32(iprp + pos);
+        if (box_len < 8 || pos + box_len > iprp_len) {
+            break;
+        }
+
+        if (memcmp(iprp + pos + 4, "ipco", 4) == 0) {
+            ipco = iprp + pos;
+            ipco_len = box_len;
+        } else if (memcmp(iprp + pos + 4, "ipma", 4) == 0 && ipma == nullptr) {
+            ipma = iprp + pos;
+            ipma_len = box_len;
+        }
+
+        pos += box_len;
+    }
+
+    if (ipco == nullptr || ipma == nullptr || ipma_len < 16) {
+        return false;
+    }
+
+    int version = ipma[8];
+    bool large_index = (ipma[11] & 0x01) != 0;
+    uint32_t entry_count = s_be32(ipma + 12);
+
+    size_t id_size = version < 1 ? 2 : 4;
+    size_t assoc_size = large_index ? 2 : 1;
+    size_t p = 16;
+
+    for (uint32_t i = 0; i < entry_count; i++) {
+        if (p + id_size + 1 > ipma_len) {
+            return false;
+        }
+
+        uint32_t item_id = (uint32_t) s_be_n(ipma + p, (int) id_size);
+        size_t assoc_count = ipma[p + id_size];
+        p += id_size + 1;
+
+        if (p + assoc_count * assoc_size > ipma_len) {
+            return false;
+        }
+
+        if (item_id != primary_id) {
+            p += assoc_count * assoc_size;
+            continue;
+        }
+
+        // the essential bit is dropped from each index
+        for (size_t j = 0; j < assoc_count; j++, p += assoc_size) {
+            uint32_t index = large_index ? (s_be16(ipma + p) & 0x7fff) : (ipma[p] & 0x7f);
+            if (s_heif_ispe(ipco, ipco_len, index, width, height)) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    return false;
+}
+
+bool s_heif_ispe(const unsigned char *ipco, size_t ipco_len, uint32_t index, uint32_t *width, uint32_t *height) {
+    uint32_t i = 1;
+    size_t pos = 8;
+
+    while (pos + 8 <= ipco_len) {
+        size_t box_len = s_be32(ipco + pos);
+        if (box_len < 8 || pos + box_len > ipco_len) {
+            return false;
+        }
+
+        if (i == index) {
+            // version and flags, image_width, image_height
+            if (memcmp(ipco + pos + 4, "ispe", 4) != 0 || box_len < 20) {
+                return false;
+            }
+
+            *width = s_be32(ipco + pos + 12);
+            *height = s_be32(ipco + pos + 16);
+            return *width > 0 && *height > 0;
+        }
+
+        pos += box_len;
+        i++;
+    }
+
+    return false;
+}
+
+void s_fill_inspection(Exiv2::ExifData &exif_data, Exiv2::XmpData &xmp_data, exif_inspection_t *out) {
+    // prefer when the picture was taken over when the file was last changed
+    int datetime_tag = -1;
+    int subsec_tag = -1;
+
+    if (s_exif_datetime(exif_data, EXIF_TAG_DATETIME_ORIGINAL, &out->taken_at, &out->offset, &out->has_offset) == EXIF_OK) {
+        datetime_tag = EXIF_TAG_DATETIME_ORIGINAL;
+        subsec_tag = EXIF_TAG_SUBSEC_ORIGINAL;
+    } else if (s_exif_datetime(exif_data, EXIF_TAG_DATETIME, &out->taken_at, &out->offset, &out->has_offset) == EXIF_OK) {
+        datetime_tag = EXIF_TAG_DATETIME;
+        subsec_tag = EXIF_TAG_SUBSEC;
+    }
+
+    if (datetime_tag >= 0) {
+        out->has_datetime = 1;
+
+        // same strings as hashed by s_fill_inspection_tiff
+        if (out->fingerprint != 0) {
+            int tags[] = { datetime_tag, subsec_tag };
+            for (int tag : tags) {
+                Exiv2::ExifData::iterator datum = s_find_exif(exif_data, tag);
+                std::string str = datum != exif_data.end() ? datum->toString() : std::string();
+                out->fingerprint = s_fingerprint_ascii(out->fingerprint, str.c_str(), str.size());
+            }
+        }
+    }
+
+    Exiv2::ExifData::iterator lat = s_find_exif(exif_data, EXIF_TAG_GPS_LATITUDE);
+    Exiv2::ExifData::iterator lon = s_find_exif(exif_data, EXIF_TAG_GPS_LONGITUDE);
+    out->gps_recorded = (lat != exif_data.end() && lat->count() > 0 &&
+                         lon != exif_data.end() && lon->count() > 0) ? 1 : 0;
+
+    s_fill_rating(xmp_data, out);
+}
+
+void s_fill_inspection_tiff(const std::vector<unsigned char> &tiff_data, Exiv2::XmpData &xmp_data, exif_inspection_t *out) {
+    s_fill_rating(xmp_data, out);
+
+    exif_tiff_t tiff;
+    if (!s_tiff_open(&tiff, tiff_data.data(), tiff_data.size())) {
+        return;     // no Exif, or not a TIFF structure
+    }
+
+    uint32_t ifd0 = s_tiff_u32(&tiff, 4);
+    uint32_t exif_ifd = s_tiff_sub_ifd(&tiff, ifd0, TIFF_TAG_EXIF_IFD);
+    uint32_t gps_ifd = s_tiff_sub_ifd(&tiff, ifd0, TIFF_TAG_GPS_IFD);
+
+    const char *str;
+    size_t len;
+    uint16_t offset_tag = 0;
+    uint16_t subsec_tag = 0;
+
+    // same preference as s_fill_inspection
+    if (exif_ifd != 0 && s_tiff_ascii(&tiff, exif_ifd, TIFF_TAG_DATETIME_ORIG, &str, &len) &&
+        s_parse_datetime(str, len, &out->taken_at)) {
+        offset_tag = TIFF_TAG_OFFSET_ORIG;
+        subsec_tag = TIFF_TAG_SUBSEC_ORIG;
+    } else if (s_tiff_ascii(&tiff, ifd0, TIFF_TAG_DATETIME, &str, &len) &&
+               s_parse_datetime(str, len, &out->taken_at)) {
+        offset_tag = TIFF_TAG_OFFSET;
+        subsec_tag = TIFF_TAG_SUBSEC;
+    }
+
+    if (offset_tag != 0) {
+        out->has_datetime = 1;
+
+        // bursts share the second, the sub-second tells them apart
+        if (out->fingerprint != 0) {
+            out->fingerprint = s_fingerprint_ascii(out->fingerprint, str, len);
+
+            if (exif_ifd == 0 || !s_tiff_ascii(&tiff, exif_ifd, subsec_tag, &str, &len)) {
+                len = 0;
+            }
+            out->fingerprint = s_fingerprint_ascii(out->fingerprint, str, len);
+        }
+
+        if (exif_ifd != 0 && s_tiff_ascii(&tiff, exif_ifd, offset_tag, &str, &len) &&
+            s_parse_offset(str, len, &out->offset)) {
+            out->has_offset = 1;
+        }
+    }
+
+    out->gps_recorded = gps_ifd != 0 && s_tiff_has_gps(&tiff, gps_ifd) ? 1 : 0;
+
+    // recorded by the camera; the frame header of JPEG is preferred when found
+    uint32_t width, height;
+    if (out->width == 0 && exif_ifd != 0 &&
+        s_tiff_uint(&tiff, exif_ifd, TIFF_TAG_PIXEL_X, &width) &&
+        s_tiff_uint(&tiff, exif_ifd, TIFF_TAG_PIXEL_Y, &height)) {
+        out->width = width;
+        out->height = height;
+    }
+}
+
+void s_fill_rating(Exiv2::XmpData &xmp_data, exif_inspection_t *out) {
+    Exiv2::XmpData::iterator rating = s_find_xmp(xmp_data, EXIF_TAG_RATING);
+    if (rating != xmp_data.end() && rating->count() > 0) {
+        long val = rating->toLong();
+        if (rating->value().ok()) {
+            out->rating = (int) val;
+        }
+    }
+}
+
+bool s_tiff_open(exif_tiff_t *tiff, const unsigned char *data, size_t len) {
+    if (len < 8) {
+        return false;
+    }
+
+    if (data[0] == 'I' && data[1] == 'I' && data[2] == 42 && data[3] == 0) {
+        tiff->big_endian = false;
+    } else if (data[0] == 'M' && data[1] == 'M' && data[2] == 0 && data[3] == 42) {
+        tiff->big_endian = true;
+    } else {
+        return false;
+    }
+
+    tiff->data = data;
+    tiff->len = len;
+
+    return true;
+}
+
+uint32_t s_tiff_u16(const exif_tiff_t *tiff, size_t pos) {
+    const unsigned char *p = tiff->data + pos;
+    return tiff->big_endian ? (uint32_t) (p[0] << 8 | p[1]) : (uint32_t) (p[1] << 8 | p[0]);
+}
+
+uint32_t s_tiff_u32(const exif_tiff_t *tiff, size_t pos) {
+    const unsigned char *p = tiff->data + pos;
+    return tiff->big_endian ? s_be32(p) : ((uint32_t) p[3] << 24 | (uint32_t) p[2] << 16 | (uint32_t) p[1] << 8 | p[0]);
+}
+
+bool s_tiff_find(const exif_tiff_t *tiff, uint32_t ifd, uint16_t tag, uint16_t *type, uint32_t *count, size_t *value_pos) {
+    if ((size_t) ifd + 2 > tiff->len) {
+        return false;
+    }
+
+    uint32_t entries = s_tiff_u16(tiff, ifd);
+    if ((size_t) ifd + 2 + (size_t) entries * 12 > tiff->len) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < entries; i++) {
+        size_t entry = (size_t) ifd + 2 + (size_t) i * 12;
+        if (s_tiff_u16(tiff, entry) != tag) {
+            continue;
+        }
+
+        *type = (uint16_t) s_tiff_u16(tiff, entry + 2);
+        *count = s_tiff_u32(tiff, entry + 4);
+
+        // BYTE, ASCII, SHORT, LONG, RATIONAL, SBYTE, UNDEFINED, SSHORT, SLONG, SRATIONAL, FLOAT, DOUBLE, IFD
+        static const size_t type_sizes[] = {0, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8, 4};
+        size_t type_size = *type < sizeof(type_sizes) / sizeof(type_sizes[0]) ? type_sizes[*type] : 0;
+        if (type_size == 0) {
+            return false;
+        }
+
+        uint64_t size = (uint64_t) type_size * *count;
+        *value_pos = size <= 4 ? entry + 8 : s_tiff_u32(tiff, entry + 8);
+
+        return *value_pos + size <= tiff->len;
+    }
+
+    return false;
+}
+
+uint32_t s_tiff_sub_ifd(const exif_tiff_t *tiff, uint32_t ifd, uint16_t tag) {
+    uint16_t type;
+    uint32_t count;
+    size_t pos;
+
+    // pointer tags are LONG, some writers use IFD (13) which is stored the same way
+    if (!s_tiff_find(tiff, ifd, tag, &type, &count, &pos) || (type != 4 && type != 13) || count != 1) {
+        return 0;
+    }
+
+    return s_tiff_u32(tiff, pos);
+}
+
+bool s_tiff_ascii(const exif_tiff_t *tiff, uint32_t ifd, uint16_t tag, const char **str, size_t *len) {
+    uint16_t type;
+    uint32_t count;
+    size_t pos;
+
+    if (!s_tiff_find(tiff, ifd, tag, &type, &count, &pos) || type != 2) {
+        return false;
+    }
+
+    *str = (const char*) tiff->data + pos;
+    *len = count;
+
+    return true;
+}
+
+bool s_tiff_uint(const exif_tiff_t *tiff, uint32_t ifd, uint16_t tag, uint32_t *out) {
+    uint16_t type;
+    uint32_t count;
+    size_t pos;
+
+    // SHORT or LONG
+    if (!s_tiff_find(tiff, ifd, tag, &type, &count, &pos) || count != 1) {
+        return false;
+    }
+
+    if (type == 3) {
+        *out = s_tiff_u16(tiff, pos);
+    } else if (type == 4) {
+        *out = s_tiff_u32(tiff, pos);
+    } else {
+        return false;
+    }
+
+    return *out > 0;
+}
+
+bool s_tiff_has_gps(const exif_tiff_t *tiff, uint32_t gps_ifd) {
+    uint16_t type;
+    uint32_t count;
+    size_t pos;
+
+    return s_tiff_find(tiff, gps_ifd, TIFF_TAG_GPS_LAT, &type, &count, &pos) && count > 0 &&
+           s_tiff_find(tiff, gps_ifd, TIFF_TAG_GPS_LON, &type, &count, &pos) && count > 0;
+}
+
+int s_inspect_with_handle(exif_metadata_t *handle, const char *path, exif_inspection_t *out) {
+    EXIF_STAT_SPAN(EXIF_STAT_INSPECT_FALLBACK);
+
+    memset(out, 0, sizeof(exif_inspection_t));
+    out->rating = -1;
+
+    int rc = exif_metadata_reopen(handle, path);
+    if (rc == EXIF_OK) {
+        rc = s_read_metadata(handle);
+    }
+
+    if (rc == EXIF_OK) {
+        int fd = s_open_readonly(path);
+        if (fd >= 0) {
+            out->fingerprint = s_fingerprint_content(fd);
+            s_close(fd);
+        }
+
+        try {
+            Exiv2::Image *image = handle->priv->image.get();
+            strncpy(out->mime, image->mimeType().c_str(), sizeof(out->mime) - 1);
+            s_fill_inspection(image->exifData(), image->xmpData(), out);
+
+            // known once Exiv2 read the image structure
+            if (image->pixelWidth() > 0 && image->pixelHeight() > 0) {
+                out->width = (uint32_t) image->pixelWidth();
+                out->height = (uint32_t) image->pixelHeight();
+            }
+
+        } catch (Exiv2::Error &) {
+            rc = EXIF_ERROR_READ_METADATA;
+        }
+    }
+
+    // release the image, keep the handle's buffers for the next file
+    exif_metadata_reset(handle);
+    return rc;
+}
+
+exif_metadata_t* s_pool_acquire() {
+    std::lock_guard<std::mutex> guard(s_pool_mutex);
+
+    if (s_handle_pool.empty()) {
+        return exif_metadata_new();
+    }
+
+    exif_metadata_t *handle = s_handle_pool.back();
+    s_handle_pool.pop_back();
+
+    return handle;
+}
+
+void s_pool_release(exif_metadata_t *handle) {
+    std::lock_guard<std::mutex> guard(s_pool_mutex);
+    s_handle_pool.push_back(handle);
+}
+
+void s_prefetch(const char **paths, size_t n, std::atomic<size_t> &prefetched, size_t upto) {
+    if (upto > n) {
+        upto = n;
+    }
+
+    // each file is advised once, by whichever worker gets to it first
+    size_t p = prefetched.load();
+    while (p < upto) {
+        if (prefetched.compare_exchange_weak(p, p + 1)) {
+            s_readahead(paths[p]);
+            p++;
+        }
+    }
+}
+
+void s_readahead(const char *path) {
+    int fd = s_open_readonly(path);
+    if (fd < 0) {
+        return;
+    }
+
+    // pages stay in the cache after close; hints are best effort and errors are ignored
+#if defined(__linux__)
+    posix_fadvise(fd, 0, INSPECT_PREFETCH_SIZE, POSIX_FADV_WILLNEED);
+#elif defined(__APPLE__)
+    struct radvisory ra;
+    ra.ra_offset = 0;
+    ra.ra_count = INSPECT_PREFETCH_SIZE;
+    fcntl(fd, F_RDADVISE, &ra);
+#endif
+
+    s_close(fd);
+}
+
+int s_copy_range(int fd, FILE *out, uint64_t offset, uint64_t len) {
+    std::vector<unsigned char> buf(len < COPY_BUFFER_SIZE ? (size_t) len : COPY_BUFFER_SIZE);
+    uint64_t copied = 0;
+
+    while (copied < len) {
+        size_t chunk = len - copied < buf.size() ? (size_t) (len - copied) : buf.size();
+
+        long n = s_read_at(fd, buf.data(), chunk, offset + copied);
+        if (n < 0) {
+            return -1;
+        } else if (n == 0) {
+            // EOF is expected only while copying to the end
+            return len == UINT64_MAX ? 0 : -1;
+        }
+
+        if (fwrite(buf.data(), 1, n, out) != (size_t) n) {
+            return -1;
+        }
+
+        copied += n;
+    }
+
+    return 0;
+}
+
+void s_write_segment(FILE *out, unsigned char marker, const unsigned char *id, size_t id_len,
+                     const unsigned char *payload, size_t payload_len) {
+    size_t seg_len = 2 + id_len + payload_len;
+    unsigned char header[4] = {
+        0xff, marker, (unsigned char) (seg_len >> 8), (unsigned char) (seg_len & 0xff)
+    };
+
+    fwrite(header, 1, sizeof(header), out);
+    fwrite(id, 1, id_len, out);
+    fwrite(payload, 1, payload_len, out);
+}
+
+bool s_file_size(int fd, uint64_t *size) {
+#ifdef _WIN32
+    __int64 end = _lseeki64(fd, 0, SEEK_END);
+    if (end < 0) {
+        return false;
+    }
+    *size = (uint64_t) end;
+#else
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 0) {
+        return false;
+    }
+    *size = (uint64_t) st.st_size;
+#endif
+
+    return true;
+}
+
+uint64_t s_fnv1a(uint64_t hash, const unsigned char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+// neither end is rewritten by tools keeping pixels as they are, unlike the whole file's mtime
+uint64_t s_fingerprint_content(int fd) {
+    uint64_t size;
+    if (!s_file_size(fd, &size)) {
+        return 0;
+    }
+
+    unsigned char size_le[8];
+    for (int i = 0; i < 8; i++) {
+        size_le[i] = (unsigned char) (size >> (i * 8));
+    }
+    uint64_t hash = s_fnv1a(FNV_OFFSET_BASIS, size_le, sizeof(size_le));
+
+    // the head is still cached from inspection; the tail is one more read
+    std::vector<unsigned char> buf(FINGERPRINT_SPAN);
+    uint64_t offsets[] = { 0, size > FINGERPRINT_SPAN ? size - FINGERPRINT_SPAN : 0 };
+
+    for (uint64_t offset : offsets) {
+        long n = s_read_at(fd, buf.data(), buf.size(), offset);
+        if (n < 0) {
+            return 0;
+        }
+        hash = s_fnv1a(hash, buf.data(), (size_t) n);
+    }
+
+    return hash != 0 ? hash : 1;    // 0 is left for unknown
+}
+
+// ascii value up to its terminating NUL, followed by a separator
+uint64_t s_fingerprint_ascii(uint64_t hash, const char *str, size_t len) {
+    size_t n = 0;
+    while (n < len && str[n] != '\0') {
+        n++;
+    }
+
+    const unsigned char separator = 0;
+    hash = s_fnv1a(hash, (const unsigned char *) str, n);
+    hash = s_fnv1a(hash, &separator, 1);
+
+    return hash != 0 ? hash : 1;
 }
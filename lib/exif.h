@@ -1,6 +1,9 @@
 #ifndef __EXIF_H_
 #define __EXIF_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -8,22 +11,195 @@ extern "C"
 
 typedef struct _exif_metadata_t exif_metadata_t;
 typedef struct _exif_metadata_private_t exif_metadata_private_t;
+typedef struct _exif_blob_t exif_blob_t;
 
 struct _exif_metadata_t {
     exif_metadata_private_t *priv;
 };
 
+// error codes returned by int functions, 0 on success
+typedef enum _exif_error_t {
+    EXIF_OK = 0,
+    EXIF_ERROR_INVALID_ARGUMENT = -1,   // null handle or argument, or no image opened
+    EXIF_ERROR_IO = -2,                 // failed to open, read or write a file
+    EXIF_ERROR_UNSUPPORTED = -3,        // format not handled by the function
+    EXIF_ERROR_CORRUPTED = -4,          // malformed segments or boxes
+    EXIF_ERROR_OPEN = -5,               // Exiv2 failed to open the image
+    EXIF_ERROR_READ_METADATA = -6,
+    EXIF_ERROR_WRITE_METADATA = -7,
+    EXIF_ERROR_TOO_LARGE = -8,          // metadata does not fit into its segment
+    EXIF_ERROR_UNKNOWN = -9,
+    EXIF_ERROR_NOT_FOUND = -10,         // key is missing in the image
+} exif_error_t;
+
+typedef struct _exif_rational_t {
+    int64_t numerator;      // wide enough for both signed and unsigned rationals
+    int64_t denominator;
+} exif_rational_t;
+
+// fixed-size result of header-only inspection
+typedef struct _exif_inspection_t {
+    char mime[32];          // "image/jpeg" or "image/heic"
+    int64_t taken_at;       // DateTimeOriginal, or DateTime, as in exif_get_datetime
+    int32_t offset;         // matching OffsetTime* in seconds east of UTC
+    int has_datetime;       // 0 if neither datetime exists
+    int has_offset;
+    int rating;             // Xmp.xmp.Rating, -1 if missing
+    int gps_recorded;       // 1 if both GPSLatitude and GPSLongitude exist
+    int status;             // exif_error_t of this file, set by exif_inspect_batch only
+    uint32_t width;         // pixel dimensions from JPEG SOF or HEIF ispe, else Exif PixelX/YDimension; 0 if unknown
+    uint32_t height;
+    uint64_t fingerprint;   // of size, first and last 64 KiB, DateTime and SubSec; 0 if unknown
+} exif_inspection_t;
+
+typedef struct _exif_gps_t {
+    double lat;             // signed decimal degrees, negative for south
+    double lon;             // negative for west
+    double alt;             // meters, negative below sea level
+} exif_gps_t;
+
+// keys read by kapy, resolved once by exif_initialize; passed to exif_*_tag instead of key strings
+typedef enum _exif_tag_t {
+    EXIF_TAG_DATETIME = 0,              // Exif.Image.DateTime
+    EXIF_TAG_DATETIME_ORIGINAL,         // Exif.Photo.DateTimeOriginal
+    EXIF_TAG_DATETIME_DIGITIZED,        // Exif.Photo.DateTimeDigitized
+    EXIF_TAG_OFFSET,                    // Exif.Photo.OffsetTime*, of the matching datetime
+    EXIF_TAG_OFFSET_ORIGINAL,
+    EXIF_TAG_OFFSET_DIGITIZED,
+    EXIF_TAG_SUBSEC,                    // Exif.Photo.SubSecTime
+    EXIF_TAG_SUBSEC_ORIGINAL,           // Exif.Photo.SubSecTimeOriginal
+    EXIF_TAG_PIXEL_X,                   // Exif.Photo.PixelXDimension
+    EXIF_TAG_PIXEL_Y,
+    EXIF_TAG_GPS_LATITUDE,              // Exif.GPSInfo.GPS*
+    EXIF_TAG_GPS_LATITUDE_REF,
+    EXIF_TAG_GPS_LONGITUDE,
+    EXIF_TAG_GPS_LONGITUDE_REF,
+    EXIF_TAG_GPS_ALTITUDE,
+    EXIF_TAG_GPS_ALTITUDE_REF,
+    EXIF_TAG_RATING,                    // Xmp.xmp.Rating
+    EXIF_TAG_COUNT,
+} exif_tag_t;
+
+// libexif entry points timed when built with EXIF_ENABLE_STATS
+typedef enum _exif_stat_t {
+    EXIF_STAT_OPEN = 0,         // open, open_blob, open_mmap (and reopen through them)
+    EXIF_STAT_READ_METADATA,    // decoding metadata with Exiv2, on the first read of a handle
+    EXIF_STAT_GET_TAG,          // string lookups: get_tag_string, get_tags
+    EXIF_STAT_GET_VALUE,        // typed accessors
+    EXIF_STAT_SAVE_BLOB,
+    EXIF_STAT_ADD_GPS,          // per handle, also within exif_metadata_add_gps_info_batch
+    EXIF_STAT_ADD_GPS_TO_FILE,
+    EXIF_STAT_INSPECT,          // header-only inspection, per file
+    EXIF_STAT_INSPECT_FALLBACK, // files of exif_inspect_batch inspected through Exiv2
+    EXIF_STAT_WRITE_SIDECAR,
+    EXIF_STAT_COUNT,
+} exif_stat_t;
+
+typedef struct _exif_stat_counter_t {
+    uint64_t calls;
+    uint64_t nanos;         // monotonic wall time, nested calls are counted in both
+} exif_stat_counter_t;
+
+// Thread safety:
+// functions may be called concurrently from multiple threads as long as
+// each exif_metadata_t handle is used by one thread at a time.
+// Exiv2 global state (XMP toolkit) is initialized once by the first call,
+// exif_initialize may be called beforehand to do it explicitly.
+void exif_initialize();
+
+// static description of an error code
+const char* exif_error_string(int code);
+// copy up to n counters indexed by exif_stat_t into out, returns the number copied
+// EXIF_ERROR_UNSUPPORTED when libexif was built without EXIF_ENABLE_STATS
+int exif_stats_get(exif_stat_counter_t *out, size_t n);
+void exif_stats_reset();
+const char* exif_stat_name(int stat);
+
+// error of the last failed call on the handle, cleared by open, reopen and reset
+// nothing is written to stderr; the message stays valid until the next call on the handle
+int exif_metadata_last_error_code(exif_metadata_t *self);
+const char* exif_metadata_last_error(exif_metadata_t *self);
+
 exif_metadata_t* exif_metadata_new();
+// close opened image and release strings returned so far, keeping allocated buffers
+void exif_metadata_reset(exif_metadata_t *self);
 void exif_metadata_destroy(exif_metadata_t **self);
 
 int exif_metadata_open(exif_metadata_t *self, const char* path);
 int exif_metadata_open_blob(exif_metadata_t *self, const unsigned char *blob, size_t blob_len);
+// map the file read-only and open the image from the mapping without copying it
+// the mapping is kept by the handle until exif_metadata_reset, another open or exif_metadata_destroy
+int exif_metadata_open_mmap(exif_metadata_t *self, const char *path);
+// bytes mapped by exif_metadata_open_mmap, e.g. to pass to a decoder or exif_metadata_save_blob_view;
+// NULL when the image was not opened with it
+const unsigned char* exif_metadata_mapped_data(exif_metadata_t *self, size_t *len);
+// reuse a handle for another image; strings returned before are invalidated
+// the blob must outlive the opened image, as it is not copied
+int exif_metadata_reopen(exif_metadata_t *self, const char *path);
+int exif_metadata_reopen_blob(exif_metadata_t *self, const unsigned char *blob, size_t blob_len);
+// out_blob is allocated by malloc, release it with exif_blob_free
 size_t exif_metadata_save_blob(exif_metadata_t *self, unsigned char* blob, size_t blob_len, unsigned char **out_blob);
+void exif_blob_free(unsigned char *buf);
+// same as exif_metadata_save_blob, but returns the written buffer itself without copying
+// the view is valid until exif_blob_destroy
+exif_blob_t* exif_metadata_save_blob_view(exif_metadata_t *self, const unsigned char *blob, size_t blob_len);
+const unsigned char* exif_blob_data(const exif_blob_t *blob);
+size_t exif_blob_len(const exif_blob_t *blob);
+void exif_blob_destroy(exif_blob_t **blob);
+
+// returned strings are owned by the handle,
+// they stay valid until exif_metadata_reset or exif_metadata_destroy
+const char* exif_get_tag_string(exif_metadata_t *self, const char *path);
+// get n tags at once, metadata is parsed only once per opened image
+// out_values[i] is set to NULL when tags[i] is missing; returns the number of found tags or an error code
+int exif_get_tags(exif_metadata_t *self, const char **tags, size_t n, const char **out_values);
+const char* exif_get_mime(exif_metadata_t *self);
+
+// typed accessors read binary values without formatting them to strings
+// they return EXIF_OK, EXIF_ERROR_NOT_FOUND for missing keys or another error code
+// 1 if the key exists, 0 if not
+int exif_has_key(exif_metadata_t *self, const char *key);
+// integer value of Exif or Xmp key
+int exif_get_int64(exif_metadata_t *self, const char *key, int64_t *out);
+// up to cap rationals of Exif key; out_n is set to the full count, which may exceed cap
+int exif_get_rational_array(exif_metadata_t *self, const char *key, exif_rational_t *out, size_t cap, size_t *out_n);
+// Exif.Image.DateTime, Exif.Photo.DateTimeOriginal or Exif.Photo.DateTimeDigitized
+// epoch is the recorded wall-clock time counted as if it were UTC; when has_offset is set,
+// offset is taken from the matching OffsetTime* tag and epoch - offset is the actual UTC time
+int exif_get_datetime(exif_metadata_t *self, const char *key, int64_t *epoch, int32_t *offset, int *has_offset);
+// same as above for exif_tag_t, without parsing a key string per call
+// exif_get_tag_datetime takes EXIF_TAG_DATETIME* only
+int exif_has_tag(exif_metadata_t *self, int tag);
+int exif_get_tag_int64(exif_metadata_t *self, int tag, int64_t *out);
+int exif_get_tag_datetime(exif_metadata_t *self, int tag, int64_t *epoch, int32_t *offset, int *has_offset);
+// key string of tag, NULL if out of range
+const char* exif_tag_key(int tag);
+// GPS position in signed decimal degrees and meters, references applied; alt is 0 when not recorded
+int exif_get_gps(exif_metadata_t *self, double *lat, double *lon, double *alt);
 
-char* exif_get_tag_string(exif_metadata_t *self, const char *path);
-char* exif_get_mime(exif_metadata_t *self);
+// inspect image reading only metadata segments (JPEG APP1 / HEIF meta box) with bounded reads
+// returns EXIF_ERROR_UNSUPPORTED for unsupported formats, the caller may fallback to exif_metadata_open
+int exif_metadata_inspect(const char *path, exif_inspection_t *out);
+// inspect n files with up to threads workers (0 for the number of cores); out[i].status tells each result
+// header regions of the next files are read ahead while the current ones are parsed,
+// and files unsupported by the fast path are opened through a pool of reused handles
+// returns the number of inspected files or an error code
+int exif_inspect_batch(const char **paths, size_t n, exif_inspection_t *out, int threads);
+// pixel dimensions of JPEG on path, read from its SOF segment without decoding the image
+int exif_jpeg_dimensions(const char *path, uint32_t *width, uint32_t *height);
 
 int exif_metadata_add_gps_info(exif_metadata_t *self, double lat, double lon, double alt);
+// add coords[i] to handles[i] for n opened handles; coordinates are all converted before any handle is touched
+// returns the number of updated handles, a failed handle keeps its error (see exif_metadata_last_error_code)
+int exif_metadata_add_gps_info_batch(exif_metadata_t **handles, const exif_gps_t *coords, size_t n);
+// write JPEG on in_path to out_path with gps info, rewriting only APP1 segments
+// HEIF gets its Exif item rewritten in place, or moved into a new 'mdat' at the end when it grows
+// compressed image data is copied byte-for-byte; returns an error code (and removes out_path) on failure
+// EXIF_ERROR_UNSUPPORTED / EXIF_ERROR_TOO_LARGE mean the caller should rewrite the whole image
+int exif_metadata_add_gps_to_file(const char *in_path, const char *out_path, double lat, double lon, double alt);
+// write gps info of the opened image (e.g., added by exif_metadata_add_gps_info) and its rating
+// to an XMP sidecar on path, as Exiv2 converts Exif.GPSInfo to Xmp.exif; the image itself is untouched
+int exif_metadata_write_xmp_sidecar(exif_metadata_t *self, const char *path);
 
 #ifdef __cplusplus
 }
@@ -1,28 +1,45 @@
 use std::path::{Path, PathBuf};
 use std::{fs, process};
-use std::time::{SystemTime, UNIX_EPOCH};
+use std::time::{Instant, SystemTime, UNIX_EPOCH};
 use anyhow::{anyhow, Result};
 use core::time::Duration;
-use std::rc::Rc;
+use std::sync::{Arc, Mutex};
+use std::sync::mpsc;
+use std::thread;
 use chrono::{DateTime, Local, LocalResult, NaiveDateTime, TimeZone};
 use console::style;
 use regex::Regex;
-use walkdir::{WalkDir, DirEntry};
 
 use crate::processor::gps::{GpsSearch, GpxStorage, NoopGpsSearch};
 use crate::drive::GoogleDrive;
 use crate::drive::auth::{CredPath, GoogleAuthenticator, ListenPort};
 use crate::config::Config;
+use crate::index::{Entry, FileKey, Index};
+use crate::index::fingerprint::Fingerprints;
 use crate::processor;
+use crate::processor::budget::MemoryBudget;
 use crate::processor::{CloneStatistics, CloneState, image};
+use crate::processor::exif::GpsInfo;
 use crate::processor::image::Inspection;
+use crate::processor::stats::{Stage, StageTimes};
+use crate::processor::walk::{self, Destination, WalkedFile};
 use crate::progress::{PanelType, Progress, Update};
 
 const MAX_DEPTH: usize = 10;
 const DEFAULT_MAX_SEARCH_FILES_ON_GOOGLE_DRIVE: usize = 100;
 const DEFAULT_GPS_MATCH_WITHIN: Duration = Duration::from_secs(5 * 60); // match within 5 min
+const DEFAULT_GPS_INTERPOLATE: bool = true;     // between two fixes both within match_within
+const GPX_CACHE_DIR: &str = "gpx";              // next to credentials
+const DEFAULT_INSPECTION_QUEUE_DEPTH: usize = 8;    // concurrent inspections; enough for NVMe/UHS-II readers
+const INSPECTION_CHUNK_SIZE: usize = 64;            // files per call to libexif
+const SUPPORTED_EXTENSIONS: [&str; 3] = ["jpeg", "jpg", "heic"];
+const GPX_MARGIN: Duration = Duration::from_secs(3600);                 // around taken times, for more flexibility
+const GPX_ESTIMATE_MARGIN: Duration = Duration::from_secs(24 * 3600);   // around file times, which may be off by timezone
+
+pub fn do_clone(conf: Config, cred_path: &Path, ignore_geotag: bool, dry_run: bool, after: Option<String>, stats: bool) {
+    let started_at = Instant::now();
+    let mut stage_times = StageTimes::new();
 
-pub fn do_clone(conf: Config, cred_path: &Path, ignore_geotag: bool, dry_run: bool, after: Option<String>) {
     // print info
     let import_from = conf.import_from().to_str().unwrap();
     let import_to = conf.import_to().to_str().unwrap();
@@ -46,12 +63,15 @@ pub fn do_clone(conf: Config, cred_path: &Path, ignore_geotag: bool, dry_run: bo
         process::exit(1)
     }
 
+    // files inspected or cloned by previous runs
+    let mut index = Index::open(conf.import_to());
+
     // calculate when to copy started (since the last save to 'conf.to_path')
-    let to_be_import_after = match after {
+    let (to_be_import_after, unseen_after) = match after {
         Some(after) => {
             // valid: YYYY or YYYY-MM-DD or YYYY-MM
             match system_time_from_str(&after) {
-                Ok(t) => Some(t),
+                Ok(t) => (Some(t), None),
                 Err(_) => {
                     eprintln!("Invalid time format: YYYY-MM-DD or YYYY-MM or YYYY are valid");
                     process::exit(1);
@@ -59,8 +79,9 @@ pub fn do_clone(conf: Config, cred_path: &Path, ignore_geotag: bool, dry_run: bo
             }
         }
         None => {
+            // files in the index are told apart by it; the others only by time, as before
             match to_be_imported_after(conf.import_to()) {
-                Ok(t) => t,
+                Ok(t) => (None, t),
                 Err(e) => {
                     eprintln!("Failed to determine date and time to be imported after: {}", e);
                     process::exit(1);
@@ -75,53 +96,133 @@ pub fn do_clone(conf: Config, cred_path: &Path, ignore_geotag: bool, dry_run: bo
     // filter import files to retrieve
     let import_entries = match to_be_import_after {
         Some(t) => {
-            import_entries.into_iter().filter(|entry| {
-                let entry_created_at = entry.metadata().unwrap().created().unwrap();
-                entry_created_at > t
-            }).collect()
+            import_entries.into_iter()
+                .filter(|entry| entry.stat.created_or_modified() > t)
+                .collect()
         }
         None => import_entries
     };
 
-    // inspection for each images
+    // outputs already there, listed per directory as it is first looked at,
+    // and images cloned before by their fingerprints
+    let dest = Destination::with_fingerprints(conf.import_to(), Some(Fingerprints::open(conf.import_to())));
+
+    // look up the index: unchanged files are not inspected again, and cloned ones are left out
+    let mut keys = Vec::with_capacity(import_entries.len());
     let mut inspections = Vec::new();
+    let mut to_inspect = Vec::new();
+    let mut already_cloned = 0;
+
+    for (i, entry) in import_entries.iter().enumerate() {
+        let key = FileKey::new(&entry.path, &entry.stat).ok();
+        keys.push(key);
+
+        match key.as_ref().and_then(|key| index.get(key, &entry.path)) {
+            // even when its output was deleted since, e.g., while culling
+            Some(cached) if cached.out_path.is_some() => {
+                already_cloned += 1;
+            }
+            Some(cached) => {
+                match cached.to_inspection() {
+                    Some(mut inspection) => {
+                        inspection.stat = Some(entry.stat);
+                        inspections.push((i, inspection));
+                    }
+                    None => to_inspect.push(i),
+                }
+            }
+            None if unseen_after.map_or(false, |t| entry.stat.created_or_modified() <= t) => (),
+            None => to_inspect.push(i),
+        }
+    }
+
+    let indexed = inspections.len();
+
+    // gpx depends only on the time range: fetched while inspecting, from a range estimated by file times
+    let gpx_fetch = if ignore_geotag {
+        None
+    } else {
+        let file_times = inspections.iter().map(|(i, _)| *i).chain(to_inspect.iter().cloned())
+            .map(|i| import_entries[i].stat.created_or_modified());
+
+        match (file_times.clone().min(), file_times.max()) {
+            (Some(oldest), Some(most_recent)) => {
+                println!("{} from google drive in background", style("Preparing GPX").green().bold());
+                Some(GpxFetch::start(cred_path, oldest - GPX_ESTIMATE_MARGIN, most_recent + GPX_ESTIMATE_MARGIN))
+            }
+            _ => None,
+        }
+    };
+
+    // inspection for each images
     {
         println!("{} {}", style("Inspecting").green().bold(), import_from);
         let progress = Progress::new(vec![
-            PanelType::Bar("files_bar", import_entries.len() as u64),
+            PanelType::Bar("files_bar", to_inspect.len() as u64),
             PanelType::Message("state"),
         ]);
 
         let mut inspection_failed = 0;
 
-        for entry in import_entries.iter() {
-            progress.update("files_bar", Update::Incr(None));
+        // inspection is bound to blocking reads; libexif keeps several files in flight,
+        // chunks only let the progress move
+        for chunk in to_inspect.chunks(INSPECTION_CHUNK_SIZE) {
+            let files = chunk.iter()
+                .map(|i| &import_entries[*i])
+                .collect::<Vec<&WalkedFile>>();
 
-            let path = entry.path();
-            let path_str = path.to_str().unwrap();  // never failed
-            progress.update("state", Update::Incr(Some(format!("{}: inspecting...", style(path_str).bold()))));
+            let results = stage_times.time(Stage::Inspect, || {
+                image::inspect_walked_files(&files, DEFAULT_INSPECTION_QUEUE_DEPTH)
+            });
 
-            match image::inspect_image_from_path(path) {
-                Ok(inspection) => {
-                    inspections.push(inspection);
-                }
-                Err(e) => {
-                    eprintln!("Failed to inspection image '{}': {}", path_str, e);
-                    inspection_failed += 1;
-                }
-            };
+            for (i, result) in chunk.iter().cloned().zip(results.into_iter()) {
+                progress.update("files_bar", Update::Incr(None));
+
+                let path_str = import_entries[i].path.to_str().unwrap();  // never failed
+                progress.update("state", Update::Incr(Some(format!("{}: inspecting...", style(path_str).bold()))));
+
+                match result {
+                    Ok(inspection) => {
+                        if let Some(key) = keys[i] {
+                            index.insert(key, Entry::from_inspection(&inspection));
+                        }
+
+                        inspections.push((i, inspection));
+                    }
+                    Err(e) => {
+                        eprintln!("Failed to inspection image '{}': {}", path_str, e);
+                        inspection_failed += 1;
+                    }
+                };
+            }
         }
 
         progress.finish_all();
         progress.println(format!("{:>5} files are inspected ({} total / {} succeed / {} failed)",
-                                 style(inspections.len()).cyan().bold(),
-                                 style(import_entries.len()).green(),
-                                 style(inspections.len()).cyan(),
+                                 style(inspections.len() - indexed).cyan().bold(),
+                                 style(to_inspect.len()).green(),
+                                 style(inspections.len() - indexed).cyan(),
                                  if inspection_failed > 0 { style(inspection_failed).red() } else { style(0).dim() }
         ));
+        if indexed > 0 || already_cloned > 0 {
+            progress.println(format!("{:>5} files are found in the index ({} already cloned)",
+                                     style(indexed + already_cloned).cyan().bold(),
+                                     style(already_cloned).dim()));
+        }
         progress.clear();
     }
 
+    if inspections.is_empty() && already_cloned > 0 {
+        println!("Nothing to clone");
+        return;
+    }
+
+    // keep the order of walking, with index keys to record where images are cloned
+    inspections.sort_by_key(|(i, _)| *i);
+    let (inspection_keys, inspections): (Vec<Option<FileKey>>, Vec<Inspection>) = inspections.into_iter()
+        .map(|(i, inspection)| (keys[i], inspection))
+        .unzip();
+
     // calculate first date and end date among import files
     let (oldest_created_at, most_recent_created_at) = match oldest_and_most_recent_taken_at(&inspections) {
         Ok((oldest, most_recent)) => (oldest, most_recent),
@@ -132,44 +233,27 @@ pub fn do_clone(conf: Config, cred_path: &Path, ignore_geotag: bool, dry_run: bo
     };
 
     // make gps search trait object
-    let gps_search: Rc<Box<dyn GpsSearch>> = if ignore_geotag {
-        Rc::new(Box::new(NoopGpsSearch))
-    } else {
-        // adjust time to more flexibility (+ 1 hour)
-        let start = oldest_created_at - Duration::from_secs(3600);
-        let end = most_recent_created_at + Duration::from_secs(3600);
-
-        // make a progress
-        println!("{} from google drive: {} ~ {}",
-                 style("Preparing GPX").green().bold(),
-                 style(start.to_string()).cyan(), style(end.to_string()).cyan());
-        let progress = Progress::new(vec![
-            PanelType::Message("gpx_filename"),
-        ]);
-
-        // initialize google drive
-        let mut count = 0;
-
-        let auth = GoogleAuthenticator::new(ListenPort::DefaultPort, CredPath::Path(cred_path));
-        let drive = GoogleDrive::new(auth);
-
-        match GpxStorage::from_google_drive(&drive, start, end,
-                                            DEFAULT_MAX_SEARCH_FILES_ON_GOOGLE_DRIVE, DEFAULT_GPS_MATCH_WITHIN,
-                                            |filename| {
-                                                progress.update("gpx_filename",
-                                                                Update::Incr(Some(format!("{} is downloading and pouring...", style(filename).bold()))));
-                                                count += 1;
-                                            }) {
-            Ok(search) => {
-                progress.finish_all();
-                progress.println(format!("{:>5} gpx files are retrieved", style(count).cyan().bold()));
-                progress.clear();
-
-                Rc::new(Box::new(search))
-            }
-            Err(e) => {
-                eprintln!("Failed to initialize geotag search on your google drive: {}", e);
-                process::exit(1);
+    let gps_search: Arc<dyn GpsSearch> = match gpx_fetch {
+        None => Arc::new(NoopGpsSearch),
+        Some(gpx_fetch) => {
+            let start = oldest_created_at - GPX_MARGIN;
+            let end = most_recent_created_at + GPX_MARGIN;
+
+            println!("{} from google drive: {} ~ {}",
+                     style("Preparing GPX").green().bold(),
+                     style(start.to_string()).cyan(), style(end.to_string()).cyan());
+
+            let waiting_at = Instant::now();
+            match gpx_fetch.finish(start, end) {
+                Ok((search, count)) => {
+                    println!("{:>5} gpx files are retrieved ({:.1}s waited)", style(count).cyan().bold(),
+                             waiting_at.elapsed().as_secs_f64());
+                    Arc::new(search)
+                }
+                Err(e) => {
+                    eprintln!("Failed to initialize geotag search on your google drive: {}", e);
+                    process::exit(1);
+                }
             }
         }
     };
@@ -182,52 +266,218 @@ pub fn do_clone(conf: Config, cred_path: &Path, ignore_geotag: bool, dry_run: bo
     {
         println!("{} {}", style("Cloning").green().bold(), import_to);
         let progress = Progress::new(vec![
-            PanelType::Bar("files_bar", import_entries.len() as u64),
+            PanelType::Bar("files_bar", inspections.len() as u64),
             PanelType::Message("state"),
         ]);
 
-        for inspection in inspections.iter() {
-            progress.update("files_bar", Update::Incr(None));
-            let gps_search = Rc::clone(&gps_search);
-
-            match processor::clone_image(&conf, &inspection.path, conf.import_to(),
-                                         inspection,
-                                         gps_search, dry_run,
-                                         |state| {
-                                             match state {
-                                                 CloneState::AddGps(in_path) => {
-                                                     progress.update("state", Update::Incr(Some(format!("{}: adding gps info...", style(in_path).bold()))));
-                                                 }
-                                                 CloneState::Reading(in_path) => {
-                                                     progress.update("state", Update::Incr(Some(format!("{}: reading...", style(in_path).bold()))));
-                                                 }
-                                                 CloneState::Copying(in_path, out_path) => {
-                                                     progress.update("state", Update::Incr(Some(format!("{} {} {}: copying...", style(in_path).cyan(), style("→").bold(), style(out_path).green()))));
-                                                 }
-                                                 CloneState::Converting(in_path, out_path, cmd) => {
-                                                     progress.update("state", Update::Incr(Some(format!("{} {} {}: converting {}...", style(in_path).cyan(), style("→").bold(), style(out_path).green(), style(cmd).dim()))));
-                                                 }
-                                             }
-                                         }) {
-                Ok(stat) => {
-                    clone_statistics = clone_statistics + stat;
+        // pipeline: gps matching -> resize/encode/write on workers -> progress and statistics here
+        let workers = conf.workers().min(inspections.len()).max(1);
+
+        // conversions at once are bounded by memory as well
+        let budget = MemoryBudget::new(conf.memory_limit().unwrap_or_else(image::default_memory_limit));
+        image::set_resource_limits(budget.limit(), workers);
+        let (job_tx, job_rx) = mpsc::sync_channel::<(usize, Option<GpsInfo>)>(workers * 2);
+        let (event_tx, event_rx) = mpsc::sync_channel::<CloneEvent>(workers * 4);
+        let job_rx = Mutex::new(job_rx);
+
+        thread::scope(|scope| {
+            // gps matching stage
+            let inspections_ref = &inspections;
+            let gps_search = Arc::clone(&gps_search);
+
+            let gps_stage = scope.spawn(move || {
+                let mut stage_times = StageTimes::new();
+
+                for (i, inspection) in inspections_ref.iter().enumerate() {
+                    let gps_info = stage_times.time(Stage::GpsSearch, || {
+                        processor::search_gps(inspection, gps_search.as_ref())
+                    });
+                    if job_tx.send((i, gps_info)).is_err() {
+                        break;
+                    }
                 }
-                Err(e) => {
-                    errors.push((inspection, e));
+
+                stage_times
+            });
+
+            // resize/encode/write stage
+            for _ in 0..workers {
+                let job_rx = &job_rx;
+                let event_tx = event_tx.clone();
+                let conf = &conf;
+                let budget = &budget;
+                let dest = &dest;
+
+                scope.spawn(move || {
+                    loop {
+                        let job = job_rx.lock().unwrap().recv();
+                        let (i, gps_info) = match job {
+                            Ok(job) => job,
+                            Err(_) => break,    // no more jobs
+                        };
+
+                        let inspection = &inspections_ref[i];
+                        // dry run never decodes
+                        let cost = if dry_run {
+                            0
+                        } else {
+                            let file_len = inspection.stat.map_or(0, |stat| stat.len);
+                            image::memory_cost(conf, inspection, file_len, gps_info)
+                        };
+                        let admission = budget.admit(cost);
+
+                        let result = processor::clone_image(conf, &inspection.path, conf.import_to(),
+                                                            inspection, gps_info, Some(dest), dry_run,
+                                                            |state| {
+                                                                let _ = event_tx.send(CloneEvent::State(state));
+                                                            });
+                        drop(admission);
+
+                        if event_tx.send(CloneEvent::Done(i, result)).is_err() {
+                            break;
+                        }
+                    }
+                });
+            }
+
+            drop(event_tx);
+
+            for event in event_rx {
+                match event {
+                    CloneEvent::State(state) => {
+                        match state {
+                            CloneState::AddGps(in_path) => {
+                                progress.update("state", Update::Incr(Some(format!("{}: adding gps info...", style(in_path).bold()))));
+                            }
+                            CloneState::Reading(in_path) => {
+                                progress.update("state", Update::Incr(Some(format!("{}: reading...", style(in_path).bold()))));
+                            }
+                            CloneState::Copying(in_path, out_path) => {
+                                progress.update("state", Update::Incr(Some(format!("{} {} {}: copying...", style(in_path).cyan(), style("→").bold(), style(out_path).green()))));
+                            }
+                            CloneState::Converting(in_path, out_path, cmd) => {
+                                progress.update("state", Update::Incr(Some(format!("{} {} {}: converting {}...", style(in_path).cyan(), style("→").bold(), style(out_path).green(), style(cmd).dim()))));
+                            }
+                        }
+                    }
+                    CloneEvent::Done(i, result) => {
+                        progress.update("files_bar", Update::Incr(None));
+
+                        match result {
+                            Ok(stat) => {
+                                let out_path = stat.image.as_ref().and_then(|image_stat| image_stat.out_path.clone());
+                                if let (Some(key), Some(out_path)) = (inspection_keys[i], out_path) {
+                                    index.set_out_path(&key, out_path);
+                                }
+
+                                clone_statistics = clone_statistics + stat;
+                            }
+                            Err(e) => {
+                                dest.release(inspections[i].fingerprint);
+                                errors.push((&inspections[i], e));
+                            }
+                        }
+                    }
                 }
             }
-        }
+
+            if let Ok(gps_times) = gps_stage.join() {
+                stage_times = std::mem::take(&mut stage_times) + gps_times;
+            }
+        });
 
         progress.finish_all();
         progress.clear();
     }
 
+    // dry run leaves the destination untouched
+    if !dry_run {
+        if let Err(e) = index.save() {
+            eprintln!("Failed to save index: {}", e);
+        }
+        if let Err(e) = dest.save_fingerprints() {
+            eprintln!("Failed to save fingerprints: {}", e);
+        }
+    }
+
     // print-out clone statistics
+    clone_statistics.stage_times = stage_times;
     clone_statistics.print_with_error(&errors);
+
+    if dry_run {
+        clone_statistics.print_plan();
+    }
+
+    if stats {
+        clone_statistics.print_stats(started_at.elapsed());
+    }
+}
+
+// gpx tracks fetched from google drive on its own thread, the drive client is not shared
+struct GpxFetch {
+    range_tx: mpsc::Sender<(SystemTime, SystemTime)>,
+    handle: thread::JoinHandle<Result<(GpxStorage, usize)>>,
+}
+
+impl GpxFetch {
+    // started from an estimated range; the range of inspected images is given by finish
+    fn start(cred_path: &Path, start: SystemTime, end: SystemTime) -> Self {
+        let cred_path = cred_path.to_path_buf();
+        let (range_tx, range_rx) = mpsc::channel::<(SystemTime, SystemTime)>();
+
+        let handle = thread::spawn(move || {
+            // authentication is deferred to the first request, cached tracks may need none
+            let auth = GoogleAuthenticator::new(ListenPort::DefaultPort, CredPath::Path(&cred_path));
+            let drive = GoogleDrive::new(auth);
+            let cache_dir = cred_path.parent().unwrap_or(Path::new(".")).join(GPX_CACHE_DIR);
+
+            let estimated = fetch_gpx(&drive, &cache_dir, start, end);
+
+            let (inspected_start, inspected_end) = match range_rx.recv() {
+                Ok(range) => range,
+                Err(_) => return estimated,     // nothing left to match
+            };
+
+            match estimated {
+                Ok(fetched) if inspected_start >= start && inspected_end <= end => Ok(fetched),
+                // widened to what was inspected; tracks downloaded already are loaded from cache
+                _ => fetch_gpx(&drive, &cache_dir, inspected_start, inspected_end),
+            }
+        });
+
+        GpxFetch {
+            range_tx,
+            handle,
+        }
+    }
+
+    fn finish(self, start: SystemTime, end: SystemTime) -> Result<(GpxStorage, usize)> {
+        let _ = self.range_tx.send((start, end));
+
+        match self.handle.join() {
+            Ok(fetched) => fetched,
+            Err(_) => Err(anyhow!("Fetching GPX panicked")),
+        }
+    }
+}
+
+// storage and the number of tracks poured into it
+fn fetch_gpx(drive: &GoogleDrive, cache_dir: &Path, start: SystemTime, end: SystemTime) -> Result<(GpxStorage, usize)> {
+    let mut count = 0;
+    let storage = GpxStorage::from_google_drive(drive, start, end,
+                                                DEFAULT_MAX_SEARCH_FILES_ON_GOOGLE_DRIVE, DEFAULT_GPS_MATCH_WITHIN, DEFAULT_GPS_INTERPOLATE,
+                                                cache_dir, |_| count += 1)?;
+
+    Ok((storage, count))
 }
 
-fn import_entries(dir: &Path) -> Vec<DirEntry> {
-    walk_and_filter_only_supported_images(dir)
+enum CloneEvent {
+    State(CloneState),
+    Done(usize, Result<CloneStatistics>),
+}
+
+fn import_entries(dir: &Path) -> Vec<WalkedFile> {
+    walk::walk_files(dir, MAX_DEPTH, &SUPPORTED_EXTENSIONS)
 }
 
 fn oldest_and_most_recent_taken_at(entries: &Vec<Inspection>) -> Result<(SystemTime, SystemTime)> {
@@ -278,47 +528,6 @@ fn to_be_imported_after(out_dir: &Path) -> Result<Option<SystemTime>> {
     Ok(None)
 }
 
-fn walk_and_filter_only_supported_images(dir: &Path) -> Vec<DirEntry> {
-    let mut entries = Vec::new();
-
-    for entry in WalkDir::new(dir)
-        .max_depth(MAX_DEPTH)
-        .into_iter()
-        .filter_map(|entry| {
-            let entry = match entry {
-                Ok(v) => v,
-                Err(_) => return None,
-            };
-
-            let path = entry.path();
-            if !path.is_file() {
-                return None;
-            }
-
-            if let Some(filename) = path.file_stem() {
-                match filename.to_str() {
-                    Some(s) if String::from(s).starts_with(".") => return None, // filter if file is hidden
-                    _ => (),
-                }
-            } else {
-                return None;
-            }
-
-            if let Some(ext) = path.extension()?.to_str() {
-                return match ext.to_lowercase().as_str() {
-                    "jpeg" | "jpg" | "heic" => Some(entry),
-                    _ => None,
-                };
-            }
-
-            None
-        }) {
-        entries.push(entry);
-    }
-
-    entries
-}
-
 fn get_last_modified_dir(dir: &Path, re_pattern: Option<&str>) -> Result<Option<PathBuf>> {
     let mut last_modified: Option<PathBuf> = None;
 
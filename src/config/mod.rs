@@ -2,6 +2,7 @@ use std::collections::BTreeMap;
 use std::fs;
 use std::path::{Path, PathBuf};
 use std::rc::Rc;
+use std::thread;
 
 use regex::Regex;
 use serde::Deserialize;
@@ -11,8 +12,27 @@ pub struct Config {
     import: ImportPath,
     policies: Vec<Policy>,
 
+    // number of images processed at once; defaults to available cores
+    #[serde(default)]
+    workers: Option<usize>,
+
+    // checksum copied files against the source while copying
+    #[serde(default)]
+    verify: Option<bool>,
+
+    // memory for images in flight, e.g., 8g or 512m; defaults to half of physical memory
+    #[serde(default)]
+    memory: Option<String>,
+
+    // gps goes to an .xmp next to images copied as they are, instead of rewriting them
+    #[serde(default)]
+    sidecar: Option<bool>,
+
     #[serde(skip_deserializing)]
     commands: BTreeMap<i8, Command>,
+
+    #[serde(skip_deserializing)]
+    memory_limit: Option<u64>,
 }
 
 #[derive(Deserialize, Debug)]
@@ -145,6 +165,17 @@ pub enum Resize {
     Preserve,
 }
 
+impl Resize {
+    // whether the size is kept whatever the image is; MPixels depends on the image, so it is not
+    pub fn is_preserve(&self) -> bool {
+        match self {
+            Resize::Percentage(percent) => *percent >= 100,
+            Resize::MPixels(_) => false,
+            Resize::Preserve => true,
+        }
+    }
+}
+
 impl ToString for Resize {
     fn to_string(&self) -> String {
         match self {
@@ -237,6 +268,15 @@ impl Config {
                 }
 
                 conf.commands = m;
+
+                // memory: 8g or 512m
+                if let Some(ref opt) = conf.memory {
+                    match parse_memory(opt) {
+                        Some(limit) => conf.memory_limit = Some(limit),
+                        None => return Err(Error::Parse(format!("Invalid memory option from '{}'", opt))),
+                    }
+                }
+
                 Ok(conf)
             }
             Err(e) => {
@@ -264,6 +304,42 @@ impl Config {
     pub fn command(&self, rate: i8) -> &Command {
         self.commands.get(&rate).unwrap_or(&Command::ByPass)
     }
+
+    pub fn workers(&self) -> usize {
+        match self.workers {
+            Some(n) if n > 0 => n,
+            _ => thread::available_parallelism().map(|n| n.get()).unwrap_or(1),
+        }
+    }
+
+    pub fn verify(&self) -> bool {
+        self.verify.unwrap_or(false)
+    }
+
+    pub fn sidecar(&self) -> bool {
+        self.sidecar.unwrap_or(false)
+    }
+
+    // in bytes, None to let it be decided from physical memory
+    pub fn memory_limit(&self) -> Option<u64> {
+        self.memory_limit
+    }
+}
+
+fn parse_memory(opt: &str) -> Option<u64> {
+    let opt = opt.to_lowercase();
+
+    let re = Regex::new(r"^(?P<val>[0-9]+)(?P<postfix>[kmg])b?$").unwrap();
+    let captures = re.captures(&opt)?;
+
+    let val = captures.name("val").unwrap().as_str().parse::<u64>().ok()?;
+    let unit: u64 = match captures.name("postfix").unwrap().as_str() {
+        "k" => 1024,
+        "m" => 1024 * 1024,
+        _ => 1024 * 1024 * 1024,
+    };
+
+    val.checked_mul(unit).filter(|limit| *limit > 0)
 }
 
 fn deserialize(s: String) -> Result<Config, Error> {
@@ -375,4 +451,28 @@ policies:
             quality: Quality::Percentage(90),
         })
     }
-}
\ No newline at end of file
+
+    #[test]
+    fn get_workers() {
+        let yaml = r#"import:
+  from: /Volumes/Untitled/DCIM/108HASBL
+  to: ~/images
+policies:
+- rate: [4]
+workers: 3
+verify: true
+sidecar: true
+memory: 6G
+"#;
+
+        let conf = Config::build(String::from(yaml)).unwrap();
+        assert_eq!(conf.workers(), 3);
+        assert!(conf.verify());
+        assert!(conf.sidecar());
+        assert_eq!(conf.memory_limit(), Some(6 * 1024 * 1024 * 1024));
+
+        assert_eq!(parse_memory("512mb"), Some(512 * 1024 * 1024));
+        assert_eq!(parse_memory("0g"), None);
+        assert_eq!(parse_memory("lots"), None);
+    }
+}
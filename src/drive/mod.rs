@@ -2,20 +2,24 @@ pub mod auth;
 mod helper;
 
 use std::collections::HashMap;
+use std::sync::Mutex;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::thread;
 use anyhow::{anyhow, Result};
 use bytes::Bytes;
-use serde::Deserialize;
+use serde::{Deserialize, Serialize};
 use auth::GoogleAuthenticator;
 use url::Url;
 use reqwest;
 use reqwest::{header, StatusCode};
-use reqwest::blocking::Response;
+use reqwest::blocking::{Client, Response};
 
 pub struct GoogleDrive {
     authenticator: GoogleAuthenticator,
 }
 
 const GOOGLE_DRIVE_API_V3_FILES_URL: &str = "https://www.googleapis.com/drive/v3/files";
+const LIST_FIELDS: &str = "kind,incompleteSearch,nextPageToken,files(kind,id,name,mimeType,modifiedTime)";
 
 impl GoogleDrive {
     pub fn new(authenticator: GoogleAuthenticator) -> Self {
@@ -34,6 +38,9 @@ impl GoogleDrive {
             params.insert("pageToken", String::from(page_token));
         }
 
+        // modifiedTime is not returned by default
+        params.insert("fields", String::from(LIST_FIELDS));
+
         // request
         let u = format!("{}", GOOGLE_DRIVE_API_V3_FILES_URL);
         let res = self.request(u, params)?;
@@ -57,6 +64,7 @@ impl GoogleDrive {
         }
     }
 
+    #[allow(dead_code)]
     pub fn download_blob(&self, file_id: &str) -> Result<Bytes> {
         let u = format!("{}/{}?alt=media", GOOGLE_DRIVE_API_V3_FILES_URL, file_id);
         let res = self.request(u, HashMap::new())?;
@@ -68,6 +76,42 @@ impl GoogleDrive {
         }
     }
 
+    // download files with up to workers concurrent requests, results are in order of file_ids
+    pub fn download_blobs(&self, file_ids: &[&str], workers: usize) -> Result<Vec<Result<Bytes>>> {
+        // authenticator is not shareable across threads, take the token once for all requests
+        let access_token = self.authenticator.access_token()?;
+        let access_token = access_token.secret().as_str();
+
+        let next = AtomicUsize::new(0);
+        let results = Mutex::new((0..file_ids.len()).map(|_| None).collect::<Vec<Option<Result<Bytes>>>>());
+
+        thread::scope(|s| {
+            for _ in 0..workers.max(1).min(file_ids.len()) {
+                s.spawn(|| {
+                    let cli = Client::new();
+
+                    loop {
+                        let i = next.fetch_add(1, Ordering::Relaxed);
+                        if i >= file_ids.len() {
+                            break;
+                        }
+
+                        let u = format!("{}/{}?alt=media", GOOGLE_DRIVE_API_V3_FILES_URL, file_ids[i]);
+                        let blob = Url::parse(&u).map_err(anyhow::Error::from)
+                            .and_then(|u| send(&cli, access_token, u))
+                            .and_then(|res| Ok(res.bytes()?));
+
+                        results.lock().unwrap()[i] = Some(blob);
+                    }
+                });
+            }
+        });
+
+        Ok(results.into_inner().unwrap().into_iter()
+            .map(|blob| blob.unwrap_or_else(|| Err(anyhow!("Failed to download"))))   // never happened, every index is taken
+            .collect())
+    }
+
     fn request(&self, u: String, params: HashMap<&str, String>) -> Result<Response> {
         // get access token
         let access_token = self.authenticator.access_token()?;
@@ -76,17 +120,21 @@ impl GoogleDrive {
         let u = Url::parse_with_params(&u, params.iter())?;
 
         // request
-        let cli = reqwest::blocking::Client::new();
-        let res = cli.get(u)
-            .bearer_auth(access_token.secret())
-            .header(header::ACCEPT, "application/json")
-            .send()?;
+        let cli = Client::new();
+        send(&cli, access_token.secret(), u)
+    }
+}
 
-        if res.status() == StatusCode::OK {
-            Ok(res)
-        } else {
-            Err(anyhow!("Failed to request: {}", res.status()))
-        }
+fn send(cli: &Client, access_token: &str, u: Url) -> Result<Response> {
+    let res = cli.get(u)
+        .bearer_auth(access_token)
+        .header(header::ACCEPT, "application/json")
+        .send()?;
+
+    if res.status() == StatusCode::OK {
+        Ok(res)
+    } else {
+        Err(anyhow!("Failed to request: {}", res.status()))
     }
 }
 
@@ -103,7 +151,7 @@ pub struct ListResponse {
 #[allow(dead_code)]
 pub type GetResponse = FileMetadata;
 
-#[derive(Deserialize, Debug)]
+#[derive(Serialize, Deserialize, Debug, Clone)]
 #[serde(rename_all = "camelCase")]
 #[allow(dead_code)]
 pub struct FileMetadata {
@@ -111,6 +159,8 @@ pub struct FileMetadata {
     pub id: String,
     pub name: String,
     pub mime_type: String,
+    #[serde(default)]
+    pub modified_time: Option<String>,    // RFC 3339, requested by list
 }
 
 #[cfg(test)]
@@ -0,0 +1,179 @@
+use std::collections::{HashMap, HashSet};
+use std::fs;
+use std::path::{Path, PathBuf};
+
+use anyhow::{anyhow, Result};
+
+use super::{push_str, read_u32, read_u64, HEADER_SIZE, INDEX_DIR};
+
+// images cloned into the destination by content fingerprint, kept next to the index
+//
+// layout (little-endian):
+//   header:  magic (8) | record count (u32) | string pool length (u32)
+//   records: fingerprint (u64) | path offset (u32) | path length (u32), sorted by fingerprint
+//   pool:    utf-8 paths of outputs, relative to the destination root
+//
+// a fingerprint is found again whatever the source is named, e.g., after a camera reset its counter
+const FINGERPRINTS_FILE: &str = "fingerprints";
+const FINGERPRINTS_MAGIC: &[u8; 8] = b"KAPYFPR\x01";
+const RECORD_SIZE: usize = 16;
+
+pub struct Fingerprints {
+    path: PathBuf,
+    images: HashMap<u64, PathBuf>,
+    owned: HashSet<PathBuf>,    // outputs of known images
+    dirty: bool,
+}
+
+impl Fingerprints {
+    // missing or unreadable file is not an error, duplicates are just not found
+    pub fn open(root: &Path) -> Self {
+        let path = root.join(INDEX_DIR).join(FINGERPRINTS_FILE);
+
+        let images = match fs::read(&path) {
+            Ok(data) => decode(&data).unwrap_or_else(|_| HashMap::new()),
+            Err(_) => HashMap::new(),
+        };
+        let owned = images.values().cloned().collect();
+
+        Fingerprints {
+            path,
+            images,
+            owned,
+            dirty: false,
+        }
+    }
+
+    // output of the image, relative to the root
+    pub fn get(&self, fingerprint: u64) -> Option<&Path> {
+        self.images.get(&fingerprint).map(|path| path.as_path())
+    }
+
+    pub fn is_owned(&self, out_path: &Path) -> bool {
+        self.owned.contains(out_path)
+    }
+
+    pub fn insert(&mut self, fingerprint: u64, out_path: PathBuf) {
+        if let Some(prev) = self.images.insert(fingerprint, out_path.clone()) {
+            self.owned.remove(&prev);
+        }
+        self.owned.insert(out_path);
+        self.dirty = true;
+    }
+
+    pub fn remove(&mut self, fingerprint: u64) {
+        if let Some(prev) = self.images.remove(&fingerprint) {
+            self.owned.remove(&prev);
+            self.dirty = true;
+        }
+    }
+
+    pub fn save(&mut self) -> Result<()> {
+        if !self.dirty {
+            return Ok(());
+        }
+
+        if let Some(dir) = self.path.parent() {
+            fs::create_dir_all(dir)?;
+        }
+
+        // write aside and rename, as the index does
+        let tmp_path = self.path.with_extension("tmp");
+        fs::write(&tmp_path, encode(&self.images)?)?;
+        fs::rename(&tmp_path, &self.path)?;
+
+        self.dirty = false;
+        Ok(())
+    }
+}
+
+fn encode(images: &HashMap<u64, PathBuf>) -> Result<Vec<u8>> {
+    let mut sorted = images.iter().collect::<Vec<(&u64, &PathBuf)>>();
+    sorted.sort_by_key(|(fingerprint, _)| **fingerprint);
+
+    let mut records = Vec::with_capacity(sorted.len() * RECORD_SIZE);
+    let mut pool = Vec::new();
+
+    for (fingerprint, out_path) in sorted {
+        let out_str = match out_path.to_str() {
+            Some(s) => s,
+            None => continue,   // not representable, found by its name only
+        };
+
+        let (offset, len) = push_str(&mut pool, out_str)?;
+
+        records.extend_from_slice(&fingerprint.to_le_bytes());
+        records.extend_from_slice(&offset.to_le_bytes());
+        records.extend_from_slice(&len.to_le_bytes());
+    }
+
+    let count = u32::try_from(records.len() / RECORD_SIZE)?;
+
+    let mut data = Vec::with_capacity(HEADER_SIZE + records.len() + pool.len());
+    data.extend_from_slice(FINGERPRINTS_MAGIC);
+    data.extend_from_slice(&count.to_le_bytes());
+    data.extend_from_slice(&u32::try_from(pool.len())?.to_le_bytes());
+    data.extend_from_slice(&records);
+    data.extend_from_slice(&pool);
+
+    Ok(data)
+}
+
+fn decode(data: &[u8]) -> Result<HashMap<u64, PathBuf>> {
+    if data.len() < HEADER_SIZE || &data[0..8] != FINGERPRINTS_MAGIC {
+        return Err(anyhow!("Invalid fingerprints header"));
+    }
+
+    let count = read_u32(data, 8) as usize;
+    let pool_len = read_u32(data, 12) as usize;
+    let pool_start = HEADER_SIZE + count * RECORD_SIZE;
+
+    if data.len() != pool_start + pool_len {
+        return Err(anyhow!("Truncated fingerprints"));
+    }
+
+    let pool = &data[pool_start..];
+    let mut images = HashMap::with_capacity(count);
+
+    for i in 0..count {
+        let r = &data[HEADER_SIZE + i * RECORD_SIZE..HEADER_SIZE + (i + 1) * RECORD_SIZE];
+
+        let (offset, len) = (read_u32(r, 8) as usize, read_u32(r, 12) as usize);
+        let bytes = pool.get(offset..offset + len).ok_or(anyhow!("Invalid string in fingerprints"))?;
+
+        images.insert(read_u64(r, 0), PathBuf::from(std::str::from_utf8(bytes)?));
+    }
+
+    Ok(images)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn save_and_open_fingerprints() {
+        let root = std::env::temp_dir().join("kapy-fingerprints-test");
+        let _ = fs::remove_dir_all(&root);
+
+        let mut fingerprints = Fingerprints::open(&root);
+        fingerprints.insert(2, PathBuf::from("2023/2023-02-16/DSC_0001.JPG"));
+        fingerprints.insert(1, PathBuf::from("2023/2023-02-16/DSC_0001-1.JPG"));
+        fingerprints.insert(3, PathBuf::from("2023/2023-02-17/DSC_0002.JPG"));
+        fingerprints.remove(3);
+        fingerprints.save().unwrap();
+
+        let fingerprints = Fingerprints::open(&root);
+        assert_eq!(fingerprints.get(2), Some(Path::new("2023/2023-02-16/DSC_0001.JPG")));
+        assert!(fingerprints.get(3).is_none());
+        assert!(fingerprints.is_owned(Path::new("2023/2023-02-16/DSC_0001-1.JPG")));
+        assert!(!fingerprints.is_owned(Path::new("2023/2023-02-17/DSC_0002.JPG")));
+
+        // sorted, so the file does not depend on the order of hashing
+        let data = fs::read(root.join(INDEX_DIR).join(FINGERPRINTS_FILE)).unwrap();
+        assert_eq!(read_u64(&data, HEADER_SIZE), 1);
+        assert!(decode(&data[..data.len() - 1]).is_err());
+
+        let _ = fs::remove_dir_all(&root);
+    }
+}
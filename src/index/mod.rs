@@ -0,0 +1,358 @@
+pub mod fingerprint;
+
+use std::collections::BTreeMap;
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::time::UNIX_EPOCH;
+
+use anyhow::{anyhow, Result};
+use chrono::{Local, TimeZone};
+
+use crate::processor::image::{HEIC_FORMAT, Inspection, JPEG_FORMAT};
+use crate::processor::walk::FileStat;
+
+// index of inspected and cloned files, kept under the destination root
+//
+// layout (little-endian):
+//   header:  magic (8) | record count (u32) | string pool length (u32)
+//   records: fixed RECORD_SIZE bytes each, sorted by key
+//   pool:    utf-8 paths referred by records
+//
+// records are fixed-size and sorted, so the file can be searched in place
+const INDEX_DIR: &str = ".kapy";
+const INDEX_FILE: &str = "index";
+const INDEX_MAGIC: &[u8; 8] = b"KAPYIDX\x03";
+const HEADER_SIZE: usize = 16;
+const RECORD_SIZE: usize = 80;
+
+const FORMAT_JPEG: u8 = 0;
+const FORMAT_HEIC: u8 = 1;
+
+// identity of a source file; any change of it invalidates the record
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+pub struct FileKey {
+    path_hash: u64,
+    size: u64,
+    mtime_secs: i64,
+    mtime_nanos: u32,
+    inode: u64,
+}
+
+impl FileKey {
+    pub fn new(path: &Path, stat: &FileStat) -> Result<Self> {
+        let mtime = stat.modified.duration_since(UNIX_EPOCH)?;
+
+        Ok(FileKey {
+            path_hash: fnv1a(path.to_string_lossy().as_bytes()),
+            size: stat.len,
+            mtime_secs: mtime.as_secs() as i64,
+            mtime_nanos: mtime.subsec_nanos(),
+            inode: stat.inode,
+        })
+    }
+}
+
+#[derive(Debug, Clone, PartialEq)]
+pub struct Entry {
+    pub path: PathBuf,
+    pub taken_at: i64,
+    pub rating: i8,
+    pub gps_recorded: bool,
+    pub format: &'static str,
+    pub width: u32,     // 0 if unknown
+    pub height: u32,
+    pub fingerprint: u64,   // 0 if unknown
+    pub out_path: Option<PathBuf>,
+}
+
+impl Entry {
+    pub fn from_inspection(inspection: &Inspection) -> Self {
+        Entry {
+            path: inspection.path.clone(),
+            taken_at: inspection.taken_at.timestamp(),
+            rating: inspection.rating,
+            gps_recorded: inspection.gps_recorded,
+            format: if inspection.format == HEIC_FORMAT { HEIC_FORMAT } else { JPEG_FORMAT },
+            width: inspection.dimensions.map_or(0, |(width, _)| width as u32),
+            height: inspection.dimensions.map_or(0, |(_, height)| height as u32),
+            fingerprint: inspection.fingerprint.unwrap_or(0),
+            out_path: None,
+        }
+    }
+
+    pub fn to_inspection(&self) -> Option<Inspection> {
+        let taken_at = Local.timestamp_opt(self.taken_at, 0).single()?;
+
+        Some(Inspection {
+            path: self.path.clone(),
+            format: self.format.to_string(),
+            gps_recorded: self.gps_recorded,
+            taken_at,
+            rating: self.rating,
+            dimensions: if self.width > 0 && self.height > 0 {
+                Some((self.width as usize, self.height as usize))
+            } else {
+                None
+            },
+            stat: None,
+            fingerprint: if self.fingerprint != 0 { Some(self.fingerprint) } else { None },
+        })
+    }
+}
+
+pub struct Index {
+    path: PathBuf,
+    entries: BTreeMap<FileKey, Entry>,
+    dirty: bool,
+}
+
+impl Index {
+    // missing or unreadable index is not an error, files are just inspected again
+    pub fn open(root: &Path) -> Self {
+        let path = root.join(INDEX_DIR).join(INDEX_FILE);
+
+        let entries = match fs::read(&path) {
+            Ok(data) => decode(&data).unwrap_or_else(|_| BTreeMap::new()),
+            Err(_) => BTreeMap::new(),
+        };
+
+        Index {
+            path,
+            entries,
+            dirty: false,
+        }
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.entries.is_empty()
+    }
+
+    pub fn get(&self, key: &FileKey, path: &Path) -> Option<&Entry> {
+        // path is compared as well, in case of hash collision
+        self.entries.get(key).filter(|entry| entry.path == path)
+    }
+
+    pub fn insert(&mut self, key: FileKey, entry: Entry) {
+        self.entries.insert(key, entry);
+        self.dirty = true;
+    }
+
+    pub fn set_out_path(&mut self, key: &FileKey, out_path: PathBuf) {
+        if let Some(entry) = self.entries.get_mut(key) {
+            entry.out_path = Some(out_path);
+            self.dirty = true;
+        }
+    }
+
+    pub fn save(&mut self) -> Result<()> {
+        if !self.dirty {
+            return Ok(());
+        }
+
+        if let Some(dir) = self.path.parent() {
+            fs::create_dir_all(dir)?;
+        }
+
+        // write aside and rename, so an interrupted run leaves the previous index intact
+        let tmp_path = self.path.with_extension("tmp");
+        fs::write(&tmp_path, encode(&self.entries)?)?;
+        fs::rename(&tmp_path, &self.path)?;
+
+        self.dirty = false;
+        Ok(())
+    }
+}
+
+fn encode(entries: &BTreeMap<FileKey, Entry>) -> Result<Vec<u8>> {
+    let mut records = Vec::with_capacity(entries.len() * RECORD_SIZE);
+    let mut pool = Vec::new();
+
+    for (key, entry) in entries.iter() {
+        let path_str = match entry.path.to_str() {
+            Some(s) => s,
+            None => continue,   // not representable, inspect it every time
+        };
+
+        let (path_off, path_len) = push_str(&mut pool, path_str)?;
+        let (out_off, out_len) = match entry.out_path.as_ref().and_then(|p| p.to_str()) {
+            Some(s) => push_str(&mut pool, s)?,
+            None => (0, 0),
+        };
+
+        records.extend_from_slice(&key.path_hash.to_le_bytes());
+        records.extend_from_slice(&key.size.to_le_bytes());
+        records.extend_from_slice(&key.mtime_secs.to_le_bytes());
+        records.extend_from_slice(&key.inode.to_le_bytes());
+        records.extend_from_slice(&entry.taken_at.to_le_bytes());
+        records.extend_from_slice(&key.mtime_nanos.to_le_bytes());
+        records.push(entry.rating as u8);
+        records.push(entry.gps_recorded as u8);
+        records.push(if entry.format == HEIC_FORMAT { FORMAT_HEIC } else { FORMAT_JPEG });
+        records.push(0);    // reserved
+        records.extend_from_slice(&path_off.to_le_bytes());
+        records.extend_from_slice(&path_len.to_le_bytes());
+        records.extend_from_slice(&out_off.to_le_bytes());
+        records.extend_from_slice(&out_len.to_le_bytes());
+        records.extend_from_slice(&entry.width.to_le_bytes());
+        records.extend_from_slice(&entry.height.to_le_bytes());
+        records.extend_from_slice(&entry.fingerprint.to_le_bytes());
+    }
+
+    let count = u32::try_from(records.len() / RECORD_SIZE)?;
+
+    let mut data = Vec::with_capacity(HEADER_SIZE + records.len() + pool.len());
+    data.extend_from_slice(INDEX_MAGIC);
+    data.extend_from_slice(&count.to_le_bytes());
+    data.extend_from_slice(&u32::try_from(pool.len())?.to_le_bytes());
+    data.extend_from_slice(&records);
+    data.extend_from_slice(&pool);
+
+    Ok(data)
+}
+
+// append to the pool, returns (offset, length)
+fn push_str(pool: &mut Vec<u8>, s: &str) -> Result<(u32, u32)> {
+    let offset = u32::try_from(pool.len())?;
+    pool.extend_from_slice(s.as_bytes());
+
+    Ok((offset, u32::try_from(s.len())?))
+}
+
+fn decode(data: &[u8]) -> Result<BTreeMap<FileKey, Entry>> {
+    if data.len() < HEADER_SIZE || &data[0..8] != INDEX_MAGIC {
+        return Err(anyhow!("Invalid index header"));
+    }
+
+    let count = read_u32(data, 8) as usize;
+    let pool_len = read_u32(data, 12) as usize;
+    let pool_start = HEADER_SIZE + count * RECORD_SIZE;
+
+    if data.len() != pool_start + pool_len {
+        return Err(anyhow!("Truncated index"));
+    }
+
+    let pool = &data[pool_start..];
+    let get_str = |offset: u32, len: u32| -> Result<&str> {
+        let (offset, len) = (offset as usize, len as usize);
+        let bytes = pool.get(offset..offset + len).ok_or(anyhow!("Invalid string in index"))?;
+        Ok(std::str::from_utf8(bytes)?)
+    };
+
+    let mut entries = BTreeMap::new();
+
+    for i in 0..count {
+        let r = &data[HEADER_SIZE + i * RECORD_SIZE..HEADER_SIZE + (i + 1) * RECORD_SIZE];
+
+        let key = FileKey {
+            path_hash: read_u64(r, 0),
+            size: read_u64(r, 8),
+            mtime_secs: read_u64(r, 16) as i64,
+            inode: read_u64(r, 24),
+            mtime_nanos: read_u32(r, 40),
+        };
+
+        let out_len = read_u32(r, 60);
+        let out_path = if out_len > 0 {
+            Some(PathBuf::from(get_str(read_u32(r, 56), out_len)?))
+        } else {
+            None
+        };
+
+        entries.insert(key, Entry {
+            path: PathBuf::from(get_str(read_u32(r, 48), read_u32(r, 52))?),
+            taken_at: read_u64(r, 32) as i64,
+            rating: r[44] as i8,
+            gps_recorded: r[45] != 0,
+            format: if r[46] == FORMAT_HEIC { HEIC_FORMAT } else { JPEG_FORMAT },
+            width: read_u32(r, 64),
+            height: read_u32(r, 68),
+            fingerprint: read_u64(r, 72),
+            out_path,
+        });
+    }
+
+    Ok(entries)
+}
+
+fn read_u32(data: &[u8], offset: usize) -> u32 {
+    u32::from_le_bytes(data[offset..offset + 4].try_into().unwrap())  // never failed, bounds checked by caller
+}
+
+fn read_u64(data: &[u8], offset: usize) -> u64 {
+    u64::from_le_bytes(data[offset..offset + 8].try_into().unwrap())
+}
+
+fn fnv1a(bytes: &[u8]) -> u64 {
+    let mut hash: u64 = 0xcbf29ce484222325;
+
+    for b in bytes {
+        hash ^= *b as u64;
+        hash = hash.wrapping_mul(0x100000001b3);
+    }
+
+    hash
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn encode_and_decode() {
+        let path = Path::new("sample.jpg");
+        let key = FileKey::new(path, &FileStat::from_metadata(&path.metadata().unwrap()).unwrap()).unwrap();
+
+        let mut entries = BTreeMap::new();
+        entries.insert(key, Entry {
+            path: path.to_path_buf(),
+            taken_at: 1676505600,
+            rating: -1,
+            gps_recorded: false,
+            format: JPEG_FORMAT,
+            width: 1479,
+            height: 1479,
+            fingerprint: 0x0123456789abcdef,
+            out_path: Some(PathBuf::from("2023/2023-02-16/sample.jpg")),
+        });
+
+        let data = encode(&entries).unwrap();
+        assert_eq!(data.len(), HEADER_SIZE + RECORD_SIZE + "sample.jpg2023/2023-02-16/sample.jpg".len());
+
+        let decoded = decode(&data).unwrap();
+        assert_eq!(decoded, entries);
+
+        // truncated file is rejected, not misread
+        assert!(decode(&data[..data.len() - 1]).is_err());
+    }
+
+    #[test]
+    fn save_and_open() {
+        let root = std::env::temp_dir().join("kapy-index-test");
+        let _ = fs::remove_dir_all(&root);
+
+        let path = Path::new("sample.jpg");
+        let key = FileKey::new(path, &FileStat::from_metadata(&path.metadata().unwrap()).unwrap()).unwrap();
+
+        let mut index = Index::open(&root);
+        assert!(index.is_empty());
+
+        index.insert(key, Entry {
+            path: path.to_path_buf(),
+            taken_at: 0,
+            rating: 3,
+            gps_recorded: true,
+            format: HEIC_FORMAT,
+            width: 0,
+            height: 0,
+            fingerprint: 0,
+            out_path: None,
+        });
+        index.set_out_path(&key, PathBuf::from("out.heic"));
+        index.save().unwrap();
+
+        let index = Index::open(&root);
+        let entry = index.get(&key, path).unwrap();
+        assert_eq!(entry.out_path, Some(PathBuf::from("out.heic")));
+        assert!(index.get(&key, Path::new("other.jpg")).is_none());
+    }
+}
@@ -75,4 +75,8 @@ policies:
     format: heic
     resize: 36m
     quality: 92%
+# workers: 4  # images processed at once (default: number of cores)
+# verify: true  # checksum copied files, read back from the destination (default: false)
+# memory: 8g  # memory for images converted at once (default: half of physical memory)
+# sidecar: true  # write gps to an .xmp next to images that are just copied (default: false)
 "#;
\ No newline at end of file
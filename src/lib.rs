@@ -2,11 +2,15 @@ mod init;
 mod clean;
 mod clone;
 
-mod config;
-mod processor;
+// exposed for benches only
+#[doc(hidden)]
+pub mod config;
+#[doc(hidden)]
+pub mod processor;
 mod drive;
 mod progress;
 mod login;
+mod index;
 
 use std::path::PathBuf;
 use std::process;
@@ -54,6 +58,10 @@ enum Commands {
         /// Import after specific date (YYYY-MM-DD or YYYY-MM or YYYY)
         #[arg(long, value_name = "AFTER")]
         after: Option<String>,
+
+        /// Show time spent on each stage
+        #[arg(long, default_value_t = false)]
+        stats: bool,
     },
     /// Initialize to make configuration file
     Init {
@@ -99,7 +107,7 @@ pub fn run() {
     let cred_path = cli.cred.as_deref().unwrap_or(default_cred_path.as_ref());
 
     match &cli.command {
-        Commands::Clone { from, to, ignore_geotag, dry_run,after } => {
+        Commands::Clone { from, to, ignore_geotag, dry_run, after, stats } => {
             if let Some(from) = from {
                 conf.set_import_from(from.clone());
             }
@@ -108,7 +116,7 @@ pub fn run() {
                 conf.set_import_to(to.clone());
             }
 
-            return clone::do_clone(conf, cred_path, *ignore_geotag, *dry_run, after.clone());
+            return clone::do_clone(conf, cred_path, *ignore_geotag, *dry_run, after.clone(), *stats);
         }
         Commands::Clean => {
             return clean::do_clean(cred_path);
@@ -0,0 +1,108 @@
+use std::sync::{Condvar, Mutex};
+
+// bytes held by images in flight, bounded by a limit
+//
+// images are admitted in the order they asked, so a large one is never starved by smaller ones;
+// an image costing more than the whole limit is still admitted, alone
+pub struct MemoryBudget {
+    limit: u64,
+    state: Mutex<BudgetState>,
+    released: Condvar,
+}
+
+struct BudgetState {
+    used: u64,
+    next_ticket: u64,
+    serving: u64,
+}
+
+// memory held until dropped
+pub struct Admission<'a> {
+    budget: &'a MemoryBudget,
+    cost: u64,
+}
+
+impl MemoryBudget {
+    pub fn new(limit: u64) -> Self {
+        Self {
+            limit,
+            state: Mutex::new(BudgetState {
+                used: 0,
+                next_ticket: 0,
+                serving: 0,
+            }),
+            released: Condvar::new(),
+        }
+    }
+
+    pub fn limit(&self) -> u64 {
+        self.limit
+    }
+
+    // block until it is the turn of cost, and it fits into what is left
+    pub fn admit(&self, cost: u64) -> Admission<'_> {
+        let mut state = self.state.lock().unwrap();
+
+        let ticket = state.next_ticket;
+        state.next_ticket += 1;
+
+        while state.serving != ticket || (state.used > 0 && state.used + cost > self.limit) {
+            state = self.released.wait(state).unwrap();
+        }
+
+        state.used += cost;
+        state.serving += 1;
+        self.released.notify_all();     // let the next ticket check its turn
+
+        Admission {
+            budget: self,
+            cost,
+        }
+    }
+}
+
+impl Drop for Admission<'_> {
+    fn drop(&mut self) {
+        let mut state = self.budget.state.lock().unwrap();
+        state.used -= self.cost;
+
+        self.budget.released.notify_all();
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    use std::sync::atomic::{AtomicBool, Ordering};
+    use std::thread;
+    use std::time::Duration;
+
+    #[test]
+    fn admit_within_limit() {
+        let budget = MemoryBudget::new(100);
+        let admitted = AtomicBool::new(false);
+
+        let first = budget.admit(60);
+        let small = budget.admit(40);
+
+        thread::scope(|scope| {
+            scope.spawn(|| {
+                let _second = budget.admit(60);
+                admitted.store(true, Ordering::SeqCst);
+            });
+
+            // waits for the first to be released
+            thread::sleep(Duration::from_millis(50));
+            assert!(!admitted.load(Ordering::SeqCst));
+
+            drop(first);
+            drop(small);
+        });
+
+        assert!(admitted.load(Ordering::SeqCst));
+
+        // larger than the limit, admitted once nothing else is held
+        let _large = budget.admit(1000);
+    }
+}
@@ -0,0 +1,191 @@
+use std::ffi::c_int;
+use std::fs::{self, File};
+use std::io::{ErrorKind, Read, Write};
+use std::path::{Path, PathBuf};
+
+use anyhow::{anyhow, Result};
+use xxhash_rust::xxh3::Xxh3;
+
+const COPY_BUFFER_SIZE: usize = 1024 * 1024;
+const TMP_SUFFIX: &str = ".kapy-tmp";
+
+// copy in_path to out_path through a hidden file next to it, renamed once complete,
+// so an interrupted copy never leaves a partial image under its final name
+//
+// without verify, fs::copy is used: it clones or copies in kernel where the platform supports it
+// (copy_file_range on Linux, fclonefileat/fcopyfile on macOS).
+// with verify, data is hashed as it streams from the source and the written file is hashed
+// again, so the source (e.g., SD card) is read only once. the written file is kept out of the
+// page cache, so it is read back from the destination media rather than from memory
+pub fn copy_file(in_path: &Path, out_path: &Path, verify: bool) -> Result<u64> {
+    let tmp_path = tmp_path(out_path)?;
+
+    let copied = if verify {
+        copy_verified(in_path, &tmp_path)
+    } else {
+        fs::copy(in_path, &tmp_path).map_err(anyhow::Error::from)
+    };
+
+    match copied.and_then(|len| {
+        fs::rename(&tmp_path, out_path)?;
+        Ok(len)
+    }) {
+        Ok(len) => Ok(len),
+        Err(e) => {
+            let _ = fs::remove_file(&tmp_path);
+            Err(e)
+        }
+    }
+}
+
+fn copy_verified(in_path: &Path, out_path: &Path) -> Result<u64> {
+    let mut src = File::open(in_path)?;
+    let mut dst = File::create(out_path)?;
+    drop_cache(&dst)?;
+
+    let mut buf = vec![0u8; COPY_BUFFER_SIZE];
+    let mut hasher = Xxh3::new();
+    let mut len = 0u64;
+
+    loop {
+        let n = read_full(&mut src, &mut buf)?;
+        if n == 0 {
+            break;
+        }
+
+        hasher.update(&buf[..n]);
+        dst.write_all(&buf[..n])?;
+        len += n as u64;
+    }
+
+    // flushed before reading back, and before the rename makes it visible;
+    // pages are clean once synced, so they can be dropped
+    dst.sync_all()?;
+    drop_cache(&dst)?;
+    drop(dst);
+
+    let expected = hasher.digest();
+    let written = hash_file(out_path, &mut buf)?;
+
+    if expected != written {
+        return Err(anyhow!("Checksum mismatch on copying {}: {:016x} != {:016x}",
+            in_path.display(), expected, written));
+    }
+
+    Ok(len)
+}
+
+fn hash_file(path: &Path, buf: &mut [u8]) -> Result<u64> {
+    let mut file = File::open(path)?;
+    drop_cache(&file)?;
+
+    let mut hasher = Xxh3::new();
+
+    loop {
+        let n = read_full(&mut file, buf)?;
+        if n == 0 {
+            break;
+        }
+
+        hasher.update(&buf[..n]);
+    }
+
+    Ok(hasher.digest())
+}
+
+// keep file out of the page cache, called on creating, after syncing and on reading back:
+// Linux drops clean cached pages of the file, macOS caches nothing for the descriptor
+#[cfg(target_os = "linux")]
+fn drop_cache(file: &File) -> Result<()> {
+    use std::os::unix::io::AsRawFd;
+
+    extern "C" {
+        fn posix_fadvise(fd: c_int, offset: i64, len: i64, advice: c_int) -> c_int;
+    }
+    const POSIX_FADV_DONTNEED: c_int = 4;
+
+    // len 0 is up to the end of file
+    let rc = unsafe { posix_fadvise(file.as_raw_fd(), 0, 0, POSIX_FADV_DONTNEED) };
+    if rc != 0 {
+        return Err(anyhow!("Failed to drop cached pages: {}", std::io::Error::from_raw_os_error(rc)));
+    }
+
+    Ok(())
+}
+
+#[cfg(target_os = "macos")]
+fn drop_cache(file: &File) -> Result<()> {
+    use std::os::unix::io::AsRawFd;
+
+    extern "C" {
+        fn fcntl(fd: c_int, cmd: c_int, ...) -> c_int;
+    }
+    const F_NOCACHE: c_int = 48;
+
+    if unsafe { fcntl(file.as_raw_fd(), F_NOCACHE, 1 as c_int) } == -1 {
+        return Err(anyhow!("Failed to turn off caching: {}", std::io::Error::last_os_error()));
+    }
+
+    Ok(())
+}
+
+#[cfg(not(any(target_os = "linux", target_os = "macos")))]
+fn drop_cache(_file: &File) -> Result<()> {
+    Ok(())  // no way to bypass the cache here, the file is read back through it
+}
+
+// fill buf as much as possible, so every chunk but the last is a whole buffer
+fn read_full(file: &mut File, buf: &mut [u8]) -> Result<usize> {
+    let mut filled = 0;
+
+    while filled < buf.len() {
+        match file.read(&mut buf[filled..]) {
+            Ok(0) => break,
+            Ok(n) => filled += n,
+            Err(e) if e.kind() == ErrorKind::Interrupted => continue,
+            Err(e) => return Err(e.into()),
+        }
+    }
+
+    Ok(filled)
+}
+
+fn tmp_path(out_path: &Path) -> Result<PathBuf> {
+    let filename = out_path.file_name().ok_or(anyhow!("Invalid output path"))?;
+
+    let mut tmp_name = std::ffi::OsString::from(".");
+    tmp_name.push(filename);
+    tmp_name.push(TMP_SUFFIX);
+
+    Ok(out_path.with_file_name(tmp_name))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn copy_with_verify() {
+        let in_path = Path::new("sample.jpg");
+        let out_dir = std::env::temp_dir().join("kapy-copy-test");
+        fs::create_dir_all(&out_dir).unwrap();
+
+        for verify in [false, true] {
+            let out_path = out_dir.join(format!("sample-{}.jpg", verify));
+            let _ = fs::remove_file(&out_path);
+
+            let len = copy_file(in_path, &out_path, verify).unwrap();
+            assert_eq!(len, fs::metadata(in_path).unwrap().len());
+            assert_eq!(fs::read(&out_path).unwrap(), fs::read(in_path).unwrap());
+
+            // temporary file is renamed, not left behind
+            assert!(!tmp_path(&out_path).unwrap().exists());
+        }
+
+        // failed copy leaves neither file
+        let out_path = out_dir.join("missing.jpg");
+        assert!(copy_file(Path::new("not-exist.jpg"), &out_path, true).is_err());
+        assert!(!out_path.exists());
+        assert!(!tmp_path(&out_path).unwrap().exists());
+    }
+}
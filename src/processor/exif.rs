@@ -1,6 +1,8 @@
 use std::ffi::{c_char, c_int, CStr, CString};
+use std::fmt;
 use std::ops::Deref;
 use std::path::Path;
+use std::time::Duration;
 
 use anyhow::{anyhow, Result};
 
@@ -12,23 +14,173 @@ struct ExifMetadataT {
     core::marker::PhantomData<(*mut u8, core::marker::PhantomPinned)>,
 }
 
+#[repr(C)]
+struct ExifBlobT {
+    // opaque structure
+    _data: [u8; 0],
+    _marker:
+    core::marker::PhantomData<(*mut u8, core::marker::PhantomPinned)>,
+}
+
+#[repr(C)]
+struct ExifInspectionT {
+    mime: [c_char; 32],
+    taken_at: i64,
+    offset: i32,
+    has_datetime: c_int,
+    has_offset: c_int,
+    rating: c_int,
+    gps_recorded: c_int,
+    status: c_int,
+    width: u32,
+    height: u32,
+    fingerprint: u64,
+}
+
+#[repr(C)]
+#[derive(Clone, Copy, Default)]
+struct ExifStatCounterT {
+    calls: u64,
+    nanos: u64,
+}
+
+const EXIF_STAT_COUNT: usize = 10;   // see exif_stat_t
+
 #[link(name = "libexif")]
 extern "C" {
     fn exif_metadata_new() -> *mut ExifMetadataT;
-    fn exif_metadata_open(metadata: *mut ExifMetadataT, path: *const c_char) -> c_int;
-    fn exif_metadata_open_blob(metadata: *mut ExifMetadataT, blob: *const u8, blob_len: usize) -> c_int;
-    fn exif_metadata_save_blob(metadata: *mut ExifMetadataT, blob: *const u8, blob_len: usize, out_blob: *mut *mut u8) -> usize;
+    fn exif_error_string(code: c_int) -> *const c_char;
+    fn exif_metadata_last_error_code(metadata: *mut ExifMetadataT) -> c_int;
+    fn exif_metadata_last_error(metadata: *mut ExifMetadataT) -> *const c_char;
+    fn exif_metadata_reopen(metadata: *mut ExifMetadataT, path: *const c_char) -> c_int;
+    fn exif_metadata_reopen_blob(metadata: *mut ExifMetadataT, blob: *const u8, blob_len: usize) -> c_int;
+    fn exif_metadata_open_mmap(metadata: *mut ExifMetadataT, path: *const c_char) -> c_int;
+    fn exif_metadata_mapped_data(metadata: *mut ExifMetadataT, len: *mut usize) -> *const u8;
+    fn exif_metadata_save_blob_view(metadata: *mut ExifMetadataT, blob: *const u8, blob_len: usize) -> *mut ExifBlobT;
+    fn exif_blob_data(blob: *const ExifBlobT) -> *const u8;
+    fn exif_blob_len(blob: *const ExifBlobT) -> usize;
+    fn exif_blob_destroy(blob: *const *mut ExifBlobT);
     fn exif_metadata_add_gps_info(metadata: *mut ExifMetadataT, lat: f64, lon: f64, alt: f64) -> c_int;
-    fn exif_get_mime(metadata: *mut ExifMetadataT) -> *mut c_char;
-    fn exif_get_tag_string(metadata: *mut ExifMetadataT, tag: *const c_char) -> *mut c_char;
+    fn exif_metadata_write_xmp_sidecar(metadata: *mut ExifMetadataT, path: *const c_char) -> c_int;
+    fn exif_get_mime(metadata: *mut ExifMetadataT) -> *const c_char;
+    fn exif_get_tag_string(metadata: *mut ExifMetadataT, tag: *const c_char) -> *const c_char;
+    fn exif_get_tags(metadata: *mut ExifMetadataT, tags: *const *const c_char, n: usize, out_values: *mut *const c_char) -> c_int;
+    fn exif_get_gps(metadata: *mut ExifMetadataT, lat: *mut f64, lon: *mut f64, alt: *mut f64) -> c_int;
+    fn exif_has_tag(metadata: *mut ExifMetadataT, tag: c_int) -> c_int;
+    fn exif_get_tag_int64(metadata: *mut ExifMetadataT, tag: c_int, out: *mut i64) -> c_int;
+    fn exif_get_tag_datetime(metadata: *mut ExifMetadataT, tag: c_int, epoch: *mut i64, offset: *mut i32, has_offset: *mut c_int) -> c_int;
+    fn exif_tag_key(tag: c_int) -> *const c_char;
+    fn exif_metadata_add_gps_to_file(in_path: *const c_char, out_path: *const c_char, lat: f64, lon: f64, alt: f64) -> c_int;
+    fn exif_metadata_inspect(path: *const c_char, out: *mut ExifInspectionT) -> c_int;
+    fn exif_inspect_batch(paths: *const *const c_char, n: usize, out: *mut ExifInspectionT, threads: c_int) -> c_int;
+    fn exif_jpeg_dimensions(path: *const c_char, width: *mut u32, height: *mut u32) -> c_int;
+    fn exif_metadata_reset(metadata: *mut ExifMetadataT);
+    fn exif_stats_get(out: *mut ExifStatCounterT, n: usize) -> c_int;
+    fn exif_stat_name(stat: c_int) -> *const c_char;
     fn exif_metadata_destroy(metadata: *const *mut ExifMetadataT);
 }
 
+// keys resolved once by libexif, see exif_tag_t; looked up without a CString per call
+#[repr(C)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Tag {
+    DateTime = 0,
+    DateTimeOriginal,
+    DateTimeDigitized,
+    Offset,
+    OffsetOriginal,
+    OffsetDigitized,
+    SubSec,
+    SubSecOriginal,
+    PixelX,
+    PixelY,
+    GpsLatitude,
+    GpsLatitudeRef,
+    GpsLongitude,
+    GpsLongitudeRef,
+    GpsAltitude,
+    GpsAltitudeRef,
+    Rating,
+}
+
+impl Tag {
+    pub fn key(&self) -> &'static str {
+        unsafe {
+            // never failed, every tag has a static ascii key
+            CStr::from_ptr(exif_tag_key(*self as c_int)).to_str().unwrap()
+        }
+    }
+}
+
+// kind of failure reported by libexif, see exif_error_t
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+pub enum ExifErrorKind {
+    InvalidArgument,
+    Io,
+    Unsupported,
+    Corrupted,
+    Open,
+    ReadMetadata,
+    WriteMetadata,
+    TooLarge,
+    Unknown,
+    NotFound,
+}
+
+impl ExifErrorKind {
+    fn from_code(code: c_int) -> Self {
+        match code {
+            -1 => ExifErrorKind::InvalidArgument,
+            -2 => ExifErrorKind::Io,
+            -3 => ExifErrorKind::Unsupported,
+            -4 => ExifErrorKind::Corrupted,
+            -5 => ExifErrorKind::Open,
+            -6 => ExifErrorKind::ReadMetadata,
+            -7 => ExifErrorKind::WriteMetadata,
+            -8 => ExifErrorKind::TooLarge,
+            -10 => ExifErrorKind::NotFound,
+            _ => ExifErrorKind::Unknown,
+        }
+    }
+}
+
+// error from libexif; kept as is in anyhow chains so failures can be grouped by kind
+#[derive(Debug)]
+pub struct ExifError {
+    pub kind: ExifErrorKind,
+    pub message: String,
+}
+
+impl ExifError {
+    // for handle-less functions, only the code is available
+    fn from_code(code: c_int) -> Self {
+        let message = unsafe {
+            CStr::from_ptr(exif_error_string(code)).to_string_lossy().into_owned()
+        };
+
+        ExifError {
+            kind: ExifErrorKind::from_code(code),
+            message,
+        }
+    }
+}
+
+impl fmt::Display for ExifError {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "{}", self.message)
+    }
+}
+
+impl std::error::Error for ExifError {}
+
 // safe implementation
 pub struct Metadata {
     raw: *mut ExifMetadataT,
 }
 
+// libexif handles may move between threads, but must not be shared at once
+unsafe impl Send for Metadata {}
+
 impl Drop for Metadata {
     fn drop(&mut self) {
         unsafe {
@@ -38,50 +190,119 @@ impl Drop for Metadata {
 }
 
 impl Metadata {
+    pub fn new() -> Self {
+        unsafe {
+            Metadata {
+                raw: exif_metadata_new(),
+            }
+        }
+    }
+
     pub fn new_from_path(path: Box<dyn AsRef<Path>>) -> Result<Self> {
+        let mut meta = Metadata::new();
+        meta.reopen(path.deref().as_ref())?;
+
+        Ok(meta)
+    }
+
+    pub fn new_from_blob(blob: &Vec<u8>) -> Result<Self> {
+        let mut meta = Metadata::new();
+        meta.reopen_blob(blob)?;
+
+        Ok(meta)
+    }
+
+    // error recorded on the handle by the last failed call
+    fn last_error(&self) -> ExifError {
         unsafe {
-            let raw = exif_metadata_new();
-            let path = path.deref().as_ref();
+            let code = exif_metadata_last_error_code(self.raw);
+            let message = CStr::from_ptr(exif_metadata_last_error(self.raw)).to_string_lossy().into_owned();
+
+            if message.is_empty() {
+                ExifError::from_code(code)
+            } else {
+                ExifError { kind: ExifErrorKind::from_code(code), message }
+            }
+        }
+    }
 
-            let path = match path.to_str() {
-                Some(path) => CString::new(path)?,
-                None => return Err(anyhow!("Invalid path"))
-            };
+    // reuse handle for another image; strings got before are invalidated
+    pub fn reopen(&mut self, path: &Path) -> Result<()> {
+        let path = match path.to_str() {
+            Some(path) => CString::new(path)?,
+            None => return Err(anyhow!("Invalid path"))
+        };
 
-            let rc = exif_metadata_open(raw, path.as_ptr());
+        unsafe {
+            let rc = exif_metadata_reopen(self.raw, path.as_ptr());
             if rc == 0 {
-                Ok(Metadata {
-                    raw
-                })
+                Ok(())
             } else {
-                Err(anyhow!("Failed to read metadata"))
+                Err(self.last_error().into())
             }
         }
     }
 
-    pub fn new_from_blob(blob: &Vec<u8>) -> Result<Self> {
+    // blob is not copied, it must outlive the opened image
+    pub fn reopen_blob(&mut self, blob: &Vec<u8>) -> Result<()> {
         unsafe {
-            let raw = exif_metadata_new();
+            let rc = exif_metadata_reopen_blob(self.raw, blob.as_ptr(), blob.len());
+            if rc == 0 {
+                Ok(())
+            } else {
+                Err(self.last_error().into())
+            }
+        }
+    }
+
+    // map the file and read it from the mapping; see mapped()
+    pub fn reopen_mmap(&mut self, path: &Path) -> Result<()> {
+        let path = match path.to_str() {
+            Some(path) => CString::new(path)?,
+            None => return Err(anyhow!("Invalid path"))
+        };
 
-            let rc = exif_metadata_open_blob(raw, blob.as_ptr(), blob.len());
+        unsafe {
+            exif_metadata_reset(self.raw);
+
+            let rc = exif_metadata_open_mmap(self.raw, path.as_ptr());
             if rc == 0 {
-                Ok(Metadata {
-                    raw
-                })
+                Ok(())
             } else {
-                Err(anyhow!("Failed to read metadata"))
+                Err(self.last_error().into())
             }
         }
     }
 
+    // whole file mapped by reopen_mmap; borrowed, so the handle can not be reset while in use
+    pub fn mapped(&self) -> Option<&[u8]> {
+        unsafe {
+            let mut len = 0;
+            let data = exif_metadata_mapped_data(self.raw, &mut len);
+            if data.is_null() {
+                None
+            } else {
+                Some(std::slice::from_raw_parts(data, len))
+            }
+        }
+    }
+
+    // close the image and release strings kept by the handle
+    pub fn reset(&mut self) {
+        unsafe {
+            exif_metadata_reset(self.raw);
+        }
+    }
+
     pub fn get_mime(&self) -> Result<String> {
         unsafe {
             let val = exif_get_mime(self.raw);
             if val.is_null() {
-                return Err(anyhow!("Failed to get mime"));
+                return Err(self.last_error().into());
             }
 
-            let val = CStr::from_ptr(val as *const c_char);
+            // borrowed from the handle, copy it before the handle is reset
+            let val = CStr::from_ptr(val);
             let val = val.to_str()?.to_string();
 
             Ok(val)
@@ -99,41 +320,321 @@ impl Metadata {
                 return None;
             }
 
-            let val = CStr::from_ptr(val as *const c_char);
+            let val = CStr::from_ptr(val);
             let val = val.to_str().unwrap().to_string();
 
             Some(val)
         }
     }
 
+    pub fn get_tags<T>(&self, tags: &[T]) -> Result<Vec<Option<String>>>
+        where T: AsRef<str> {
+        let c_tags = tags.iter()
+            .map(|tag| CString::new(tag.as_ref()))
+            .collect::<Result<Vec<CString>, _>>()?;
+        let c_tag_ptrs = c_tags.iter()
+            .map(|tag| tag.as_ptr())
+            .collect::<Vec<*const c_char>>();
+
+        let mut out_values: Vec<*const c_char> = vec![std::ptr::null(); tags.len()];
+
+        unsafe {
+            let rc = exif_get_tags(self.raw, c_tag_ptrs.as_ptr(), c_tag_ptrs.len(), out_values.as_mut_ptr());
+            if rc < 0 {
+                return Err(self.last_error().into());
+            }
+
+            let vals = out_values.into_iter().map(|val| {
+                if val.is_null() {
+                    None
+                } else {
+                    let val = CStr::from_ptr(val);
+                    Some(val.to_string_lossy().into_owned())
+                }
+            }).collect();
+
+            Ok(vals)
+        }
+    }
+
+    pub fn has_tag(&self, tag: Tag) -> Result<bool> {
+        unsafe {
+            let rc = exif_has_tag(self.raw, tag as c_int);
+            if rc < 0 {
+                return Err(self.last_error().into());
+            }
+
+            Ok(rc == 1)
+        }
+    }
+
+    pub fn get_tag_int64(&self, tag: Tag) -> Result<Option<i64>> {
+        let mut val = 0;
+
+        unsafe {
+            let rc = exif_get_tag_int64(self.raw, tag as c_int, &mut val);
+            self.optional(rc, val)
+        }
+    }
+
+    // tag is one of DateTime*
+    pub fn get_tag_datetime(&self, tag: Tag) -> Result<Option<ExifDateTime>> {
+        let (mut epoch, mut offset, mut has_offset) = (0, 0, 0);
+
+        unsafe {
+            let rc = exif_get_tag_datetime(self.raw, tag as c_int, &mut epoch, &mut offset, &mut has_offset);
+            self.optional(rc, ExifDateTime {
+                epoch,
+                offset: if has_offset != 0 { Some(offset) } else { None },
+            })
+        }
+    }
+
+    pub fn get_gps(&self) -> Result<Option<GpsInfo>> {
+        let (mut lat, mut lon, mut alt) = (0.0, 0.0, 0.0);
+
+        unsafe {
+            let rc = exif_get_gps(self.raw, &mut lat, &mut lon, &mut alt);
+            self.optional(rc, GpsInfo { lat, lon, alt })
+        }
+    }
+
+    // missing key is not an error for typed accessors
+    fn optional<V>(&self, rc: c_int, val: V) -> Result<Option<V>> {
+        if rc == 0 {
+            Ok(Some(val))
+        } else if ExifErrorKind::from_code(rc) == ExifErrorKind::NotFound {
+            Ok(None)
+        } else {
+            Err(self.last_error().into())
+        }
+    }
+
     pub fn add_gps_info(&self, gps_info: GpsInfo) -> Result<()> {
         unsafe {
-            let rc = exif_metadata_add_gps_info(self.raw, gps_info.lat, gps_info.lon, gps_info.lon);
+            let rc = exif_metadata_add_gps_info(self.raw, gps_info.lat, gps_info.lon, gps_info.alt);
 
             if rc != 0 {
-                Err(anyhow!("Failed to add gps info"))
+                Err(self.last_error().into())
             }  else {
                 Ok(())
             }
         }
     }
 
-    pub fn paste_to_blob(&self, blob: &Vec<u8>) -> Result<Vec<u8>> {
+    // gps info and rating as an XMP sidecar, the image is left as it is
+    pub fn write_xmp_sidecar(&self, path: &Path) -> Result<()> {
+        let path = match path.to_str() {
+            Some(path) => CString::new(path)?,
+            None => return Err(anyhow!("Invalid path"))
+        };
+
         unsafe {
-            let mut out_blob: *mut u8 = std::ptr::null_mut();
+            let rc = exif_metadata_write_xmp_sidecar(self.raw, path.as_ptr());
 
-            let new_len = exif_metadata_save_blob(self.raw,
-                                                  blob.as_ptr(), blob.len(),
-                                                  &mut out_blob);
-            if new_len < 1 {
-                Err(anyhow!("Failed to paste metadata to blob"))
+            if rc != 0 {
+                Err(self.last_error().into())
             } else {
-                Ok(Vec::from_raw_parts(out_blob, new_len, new_len))
+                Ok(())
+            }
+        }
+    }
+
+    pub fn paste_to_blob(&self, blob: &[u8]) -> Result<MetadataBlob> {
+        unsafe {
+            let raw = exif_metadata_save_blob_view(self.raw, blob.as_ptr(), blob.len());
+            if raw.is_null() {
+                Err(self.last_error().into())
+            } else {
+                Ok(MetadataBlob { raw })
             }
         }
     }
 }
 
+// image blob written by libexif, released by libexif
+pub struct MetadataBlob {
+    raw: *mut ExifBlobT,
+}
+
+unsafe impl Send for MetadataBlob {}
+
+impl Drop for MetadataBlob {
+    fn drop(&mut self) {
+        unsafe {
+            exif_blob_destroy(&self.raw);
+        }
+    }
+}
+
+impl Deref for MetadataBlob {
+    type Target = [u8];
+
+    fn deref(&self) -> &Self::Target {
+        unsafe {
+            std::slice::from_raw_parts(exif_blob_data(self.raw), exif_blob_len(self.raw))
+        }
+    }
+}
+
+impl AsRef<[u8]> for MetadataBlob {
+    fn as_ref(&self) -> &[u8] {
+        self.deref()
+    }
+}
+
+// recorded wall-clock time counted as UTC, and its offset if recorded
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct ExifDateTime {
+    pub epoch: i64,
+    pub offset: Option<i32>,
+}
+
+// result of header-only inspection
+pub struct Inspected {
+    pub mime: String,
+    pub datetime: Option<ExifDateTime>,
+    pub rating: Option<i8>,
+    pub gps_recorded: bool,
+    pub dimensions: Option<(usize, usize)>,     // width and height, if known without decoding
+    pub fingerprint: Option<u64>,               // of content ends and capture time, see exif_inspection_t
+}
+
+// inspect image by reading only its metadata segments, without opening it with Exiv2
+pub fn inspect_from_path(path: &Path) -> Result<Inspected> {
+    let path = match path.to_str() {
+        Some(path) => CString::new(path)?,
+        None => return Err(anyhow!("Invalid path"))
+    };
+
+    unsafe {
+        let mut out: ExifInspectionT = std::mem::zeroed();
+
+        let rc = exif_metadata_inspect(path.as_ptr(), &mut out);
+        if rc != 0 {
+            return Err(ExifError::from_code(rc).into());
+        }
+
+        Ok(Inspected::from_raw(&out))
+    }
+}
+
+// width and height of JPEG from its frame header, without decoding it
+pub fn jpeg_dimensions(path: &Path) -> Result<(usize, usize)> {
+    let path = match path.to_str() {
+        Some(path) => CString::new(path)?,
+        None => return Err(anyhow!("Invalid path"))
+    };
+
+    let mut width = 0u32;
+    let mut height = 0u32;
+
+    let rc = unsafe { exif_jpeg_dimensions(path.as_ptr(), &mut width, &mut height) };
+    if rc != 0 {
+        return Err(ExifError::from_code(rc).into());
+    }
+
+    Ok((width as usize, height as usize))
+}
+
+// inspect files in one call; libexif reads ahead and parses them on its own threads
+pub fn inspect_batch_from_paths<P>(paths: &[P], threads: usize) -> Vec<Result<Inspected>>
+    where P: AsRef<Path> {
+    let c_paths = paths.iter()
+        .map(|path| path.as_ref().to_str().and_then(|path| CString::new(path).ok()))
+        .collect::<Vec<Option<CString>>>();
+
+    // invalid paths are passed as null, libexif reports them as invalid argument
+    let c_path_ptrs = c_paths.iter()
+        .map(|path| path.as_ref().map_or(std::ptr::null(), |path| path.as_ptr()))
+        .collect::<Vec<*const c_char>>();
+
+    unsafe {
+        let mut out: Vec<ExifInspectionT> = (0..paths.len()).map(|_| std::mem::zeroed()).collect();
+
+        let rc = exif_inspect_batch(c_path_ptrs.as_ptr(), c_path_ptrs.len(), out.as_mut_ptr(), threads as c_int);
+        if rc < 0 {
+            return (0..paths.len()).map(|_| Err(ExifError::from_code(rc).into())).collect();
+        }
+
+        out.iter().map(|raw| {
+            if raw.status != 0 {
+                Err(ExifError::from_code(raw.status).into())
+            } else {
+                Ok(Inspected::from_raw(raw))
+            }
+        }).collect()
+    }
+}
+
+impl Inspected {
+    unsafe fn from_raw(out: &ExifInspectionT) -> Self {
+        let mime = CStr::from_ptr(out.mime.as_ptr()).to_string_lossy().into_owned();
+        let datetime = if out.has_datetime != 0 {
+            Some(ExifDateTime {
+                epoch: out.taken_at,
+                offset: if out.has_offset != 0 { Some(out.offset) } else { None },
+            })
+        } else {
+            None
+        };
+
+        Inspected {
+            mime,
+            datetime,
+            rating: if out.rating < 0 { None } else { Some(out.rating as i8) },
+            gps_recorded: out.gps_recorded != 0,
+            dimensions: if out.width > 0 && out.height > 0 {
+                Some((out.width as usize, out.height as usize))
+            } else {
+                None
+            },
+            fingerprint: if out.fingerprint != 0 { Some(out.fingerprint) } else { None },
+        }
+    }
+}
+
+// write image with gps info, rewriting only its metadata: APP1 segments of JPEG, or Exif item of HEIC
+pub fn add_gps_info_to_file(in_path: &Path, out_path: &Path, gps_info: &GpsInfo) -> Result<()> {
+    let (in_path, out_path) = match (in_path.to_str(), out_path.to_str()) {
+        (Some(in_path), Some(out_path)) => (CString::new(in_path)?, CString::new(out_path)?),
+        _ => return Err(anyhow!("Invalid path"))
+    };
+
+    unsafe {
+        let rc = exif_metadata_add_gps_to_file(in_path.as_ptr(), out_path.as_ptr(),
+                                               gps_info.lat, gps_info.lon, gps_info.alt);
+        if rc != 0 {
+            Err(ExifError::from_code(rc).into())
+        } else {
+            Ok(())
+        }
+    }
+}
+
+// time spent in libexif per entry point; None unless built with the 'stats' feature
+pub fn libexif_stats() -> Option<Vec<(String, u64, Duration)>> {
+    let mut counters = [ExifStatCounterT::default(); EXIF_STAT_COUNT];
+
+    unsafe {
+        let n = exif_stats_get(counters.as_mut_ptr(), counters.len());
+        if n < 0 {
+            return None;
+        }
+
+        Some(counters[..n as usize].iter().enumerate()
+            .filter(|(_, counter)| counter.calls > 0)
+            .map(|(i, counter)| {
+                let name = CStr::from_ptr(exif_stat_name(i as c_int)).to_string_lossy().into_owned();
+                (name, counter.calls, Duration::from_nanos(counter.nanos))
+            })
+            .collect())
+    }
+}
+
+// same layout as exif_gps_t
+#[repr(C)]
+#[derive(Clone, Copy)]
 pub struct GpsInfo {
     pub lat: f64,
     pub lon: f64,
@@ -1,20 +1,25 @@
-use std::collections::BTreeMap;
+use std::fs;
 use std::io::BufReader;
-use std::time::{Duration, SystemTime};
-use anyhow::Result;
+use std::path::{Path, PathBuf};
+use std::time::{Duration, SystemTime, UNIX_EPOCH};
+use anyhow::{anyhow, Result};
 use bytes::Bytes;
 use chrono::{DateTime, FixedOffset, Utc};
 use gpx::{Gpx, Waypoint};
-use crate::drive::GoogleDrive;
-
-pub trait GpsSearch {
-    fn search(&self, t: &DateTime<FixedOffset>) -> Option<Waypoint>;
+use serde::{Deserialize, Serialize};
+use xxhash_rust::xxh3::xxh3_64;
+use crate::drive::{FileMetadata, GoogleDrive};
+use crate::processor::exif::GpsInfo;
+
+// shared across clone workers
+pub trait GpsSearch: Send + Sync {
+    fn search(&self, t: &DateTime<FixedOffset>) -> Option<GpsInfo>;
 }
 
 pub struct NoopGpsSearch;
 
 impl GpsSearch for NoopGpsSearch {
-    fn search(&self, _t: &DateTime<FixedOffset>) -> Option<Waypoint> {
+    fn search(&self, _t: &DateTime<FixedOffset>) -> Option<GpsInfo> {
         None
     }
 }
@@ -27,7 +32,7 @@ impl UnixTime for Waypoint {
     fn unix_at(&self) -> Option<i64> {
         match self.time {
             Some(t) => {
-                let dt = DateTime::parse_from_rfc3339(&t.format().unwrap()).unwrap();
+                let dt = DateTime::parse_from_rfc3339(&t.format().ok()?).ok()?;
                 Some(dt.timestamp())
             }
             None => None
@@ -35,75 +40,65 @@ impl UnixTime for Waypoint {
     }
 }
 
-trait TimestampKey {
-    fn make_key(&self, t: i64) -> i64;
-    fn make_prev_key(&self, t: i64) -> i64;
-    fn make_next_key(&self, t: i64) -> i64;
-}
-
-impl TimestampKey for Duration {
-    fn make_key(&self, t: i64) -> i64 {
-        t - (t % self.as_secs() as i64)
-    }
-
-    fn make_prev_key(&self, t: i64) -> i64 {
-        let curr = self.make_key(t);
-        curr - self.as_secs() as i64
-    }
-
-    fn make_next_key(&self, t: i64) -> i64 {
-        let curr = self.make_key(t);
-        curr + self.as_secs() as i64
-    }
-}
-
-trait SearchWaypoint {
-    fn closest(&self, t: i64) -> Option<Waypoint>;
+const DOWNLOAD_WORKERS: usize = 4;
+
+// parsed tracks are cached as <cache_dir>/<file id>
+//
+// layout (little-endian):
+//   magic (8) | modifiedTime length (u32) | modifiedTime (utf-8) | fix count (u32)
+//   times (i64 * count) | lats (f64 * count) | lons (f64 * count) | alts (f64 * count)
+//
+// columns are stored as GpxStorage keeps them, so a cached track is appended without parsing
+const TRACK_MAGIC: &[u8; 8] = b"KAPYGPX\x01";
+const LIST_CACHE_PREFIX: &str = "list-";
+
+// result of a list query, cached as <cache_dir>/list-<hash of query>.json;
+// a run may list twice (estimated range, then inspected one), each is found again next time
+#[derive(Serialize, Deserialize)]
+struct ListCache {
+    query: String,
+    listed_at: u64,     // unix time
+    files: Vec<FileMetadata>,
 }
 
-impl SearchWaypoint for Vec<Waypoint> {
-    fn closest(&self, t: i64) -> Option<Waypoint> {
-        // find nearest waypoint
-        match self.into_iter().min_by(|a, b| {
-            let t_a = a.unix_at().unwrap(); // never failed, we already examined it
-            let t_b = b.unix_at().unwrap();
-
-            let diff_a = (t_a - t).abs();
-            let diff_b = (t_b - t).abs();
-
-            diff_a.cmp(&diff_b)
-        }) {
-            Some(found) => Some(found.clone()),
-            None => None
-        }
-    }
-}
-
-trait Pour<T> {
+pub trait Pour<T> {
     fn pour_into(&mut self, data: T) -> Result<i32>;
 }
 
+// waypoints of all tracks as columns sorted by time, so a search is a binary search over times
 #[derive(Debug)]
 pub struct GpxStorage {
-    cache: BTreeMap<i64, Vec<Waypoint>>,
+    times: Vec<i64>,
+    lats: Vec<f64>,
+    lons: Vec<f64>,
+    alts: Vec<f64>,
     match_within: Duration,
+    interpolate: bool,
 }
 
 impl GpxStorage {
-    pub fn new(match_within: Duration) -> Self {
+    pub fn new(match_within: Duration, interpolate: bool) -> Self {
         Self {
-            cache: BTreeMap::new(),
+            times: Vec::new(),
+            lats: Vec::new(),
+            lons: Vec::new(),
+            alts: Vec::new(),
             match_within,
+            interpolate,
         }
     }
 
+    // tracks already cached under cache_dir are loaded without network;
+    // the list of files is reused as well when the range had ended before it was listed
     pub fn from_google_drive<F>(drive: &GoogleDrive, start: SystemTime, end: SystemTime,
-                                max_gpx_files: usize, match_within: Duration, mut when_update: F) -> Result<Self>
+                                max_gpx_files: usize, match_within: Duration, interpolate: bool,
+                                cache_dir: &Path, mut when_update: F) -> Result<Self>
         where
             F: FnMut(String),
     {
         // make new storage
-        let mut storage = GpxStorage::new(match_within);
+        let mut storage = GpxStorage::new(match_within, interpolate);
+        let end_secs = end.duration_since(UNIX_EPOCH)?.as_secs();
 
         // make query to find gpx files on google drive
         let start: DateTime<Utc> = DateTime::from(start);
@@ -115,43 +110,216 @@ impl GpxStorage {
         let q = format!("modifiedTime >= '{}' and createdTime <= '{}' and mimeType='application/gpx+xml'",
                         start, end);
 
-        // query to google drive
-        let list = drive.list(&q, max_gpx_files, None)?;
+        // files created after the listing can not match createdTime <= end once the range had ended
+        let list_cache_path = list_cache_path(cache_dir, &q);
+        let files = match read_list_cache(&list_cache_path) {
+            Some(cache) if cache.query == q && cache.listed_at > end_secs => cache.files,
+            _ => {
+                // query to google drive
+                let list = drive.list(&q, max_gpx_files, None)?;
+
+                let cache = ListCache {
+                    query: q,
+                    listed_at: SystemTime::now().duration_since(UNIX_EPOCH)?.as_secs(),
+                    files: list.files,
+                };
+                let _ = write_atomic(&list_cache_path, serde_json::to_string(&cache)?.as_bytes());
+
+                cache.files
+            }
+        };
+
+        // load cached tracks, the others are downloaded at once
+        let mut to_download = Vec::new();
+
+        for gpx in files.iter() {
+            let modified_time = gpx.modified_time.as_deref().unwrap_or("");
+
+            match fs::read(cache_dir.join(&gpx.id)).ok().and_then(|data| storage.load_track(&data, modified_time).ok()) {
+                Some(_) => when_update(gpx.name.clone()),
+                None => to_download.push(gpx),
+            }
+        }
+
+        if !to_download.is_empty() {
+            let ids: Vec<&str> = to_download.iter().map(|gpx| gpx.id.as_str()).collect();
+            let blobs = drive.download_blobs(&ids, DOWNLOAD_WORKERS)?;
+
+            for (gpx, blob) in to_download.iter().zip(blobs) {
+                when_update(gpx.name.clone());
+
+                // pour into its own storage to cache the track alone
+                let mut track = GpxStorage::new(match_within, interpolate);
+                track.pour_into(blob?)?;
 
-        for gpx in list.files.iter() {
-            when_update(gpx.name.clone());
+                // missing cache only costs a download next time
+                let modified_time = gpx.modified_time.as_deref().unwrap_or("");
+                let _ = write_atomic(&cache_dir.join(&gpx.id), &track.encode_track(modified_time)?);
 
-            // download content
-            let blob = drive.download_blob(&gpx.id)?;
-            storage.pour_into(blob)?;
+                storage.append(&track);
+            }
         }
 
+        storage.sort();
+
         Ok(storage)
     }
+
+    pub fn len(&self) -> usize {
+        self.times.len()
+    }
+
+    fn push(&mut self, t: i64, waypoint: &Waypoint) {
+        self.times.push(t);
+        self.lats.push(waypoint.point().y());
+        self.lons.push(waypoint.point().x());
+        self.alts.push(waypoint.elevation.unwrap_or(0.0));
+    }
+
+    // sort columns by time; stable, so fixes of the same time keep the order they were poured
+    fn sort(&mut self) {
+        if self.times.windows(2).all(|w| w[0] <= w[1]) {
+            return;     // tracks are usually recorded in order
+        }
+
+        let mut order: Vec<usize> = (0..self.times.len()).collect();
+        order.sort_by_key(|&i| self.times[i]);
+
+        self.times = order.iter().map(|&i| self.times[i]).collect();
+        self.lats = order.iter().map(|&i| self.lats[i]).collect();
+        self.lons = order.iter().map(|&i| self.lons[i]).collect();
+        self.alts = order.iter().map(|&i| self.alts[i]).collect();
+    }
+
+    fn append(&mut self, other: &GpxStorage) {
+        self.times.extend_from_slice(&other.times);
+        self.lats.extend_from_slice(&other.lats);
+        self.lons.extend_from_slice(&other.lons);
+        self.alts.extend_from_slice(&other.alts);
+    }
+
+    fn encode_track(&self, modified_time: &str) -> Result<Vec<u8>> {
+        let count = u32::try_from(self.times.len())?;
+
+        let mut data = Vec::with_capacity(16 + modified_time.len() + self.times.len() * 32);
+        data.extend_from_slice(TRACK_MAGIC);
+        data.extend_from_slice(&u32::try_from(modified_time.len())?.to_le_bytes());
+        data.extend_from_slice(modified_time.as_bytes());
+        data.extend_from_slice(&count.to_le_bytes());
+
+        for t in self.times.iter() {
+            data.extend_from_slice(&t.to_le_bytes());
+        }
+        for column in [&self.lats, &self.lons, &self.alts] {
+            for v in column.iter() {
+                data.extend_from_slice(&v.to_le_bytes());
+            }
+        }
+
+        Ok(data)
+    }
+
+    // append cached track, it is rejected when the file on drive has been modified since
+    fn load_track(&mut self, data: &[u8], modified_time: &str) -> Result<()> {
+        let read_u32 = |offset: usize| -> Result<usize> {
+            let bytes = data.get(offset..offset + 4).ok_or(anyhow!("Truncated track"))?;
+            Ok(u32::from_le_bytes(bytes.try_into()?) as usize)
+        };
+
+        if data.len() < 12 || &data[0..8] != TRACK_MAGIC {
+            return Err(anyhow!("Invalid track header"));
+        }
+
+        let time_len = read_u32(8)?;
+        if data.get(12..12 + time_len) != Some(modified_time.as_bytes()) {
+            return Err(anyhow!("Outdated track"));
+        }
+
+        let count = read_u32(12 + time_len)?;
+        let columns = &data[16 + time_len..];
+        if columns.len() != count * 32 {
+            return Err(anyhow!("Truncated track"));
+        }
+
+        let column = |n: usize| columns[n * count * 8..(n + 1) * count * 8].chunks_exact(8)
+            .map(|b| <[u8; 8]>::try_from(b).unwrap());    // never failed, chunks are exact
+
+        self.times.extend(column(0).map(i64::from_le_bytes));
+        self.lats.extend(column(1).map(f64::from_le_bytes));
+        self.lons.extend(column(2).map(f64::from_le_bytes));
+        self.alts.extend(column(3).map(f64::from_le_bytes));
+
+        Ok(())
+    }
+
+    fn at(&self, i: usize) -> GpsInfo {
+        GpsInfo {
+            lat: self.lats[i],
+            lon: self.lons[i],
+            alt: self.alts[i],
+        }
+    }
 }
 
-impl GpsSearch for GpxStorage {
-    fn search(&self, t: &DateTime<FixedOffset>) -> Option<Waypoint> {
-        let t = t.timestamp();
+fn list_cache_path(cache_dir: &Path, query: &str) -> PathBuf {
+    cache_dir.join(format!("{}{:016x}.json", LIST_CACHE_PREFIX, xxh3_64(query.as_bytes())))
+}
+
+fn read_list_cache(path: &Path) -> Option<ListCache> {
+    let data = fs::read(path).ok()?;
+    serde_json::from_slice(&data).ok()
+}
+
+// write aside and rename, so readers never see a partial file
+fn write_atomic(path: &Path, data: &[u8]) -> Result<()> {
+    if let Some(dir) = path.parent() {
+        fs::create_dir_all(dir)?;
+    }
+
+    let mut tmp_path = PathBuf::from(path);
+    tmp_path.set_extension("tmp");
 
-        let keys = vec![
-            self.match_within.make_prev_key(t),
-            self.match_within.make_key(t),
-            self.match_within.make_next_key(t),
-        ];
+    fs::write(&tmp_path, data)?;
+    fs::rename(&tmp_path, path)?;
 
-        let mut target = Vec::new();
+    Ok(())
+}
 
-        for key in keys {
-            match self.cache.get(&key) {
-                Some(l) => {
-                    target.extend(l.to_vec());
+impl GpsSearch for GpxStorage {
+    fn search(&self, t: &DateTime<FixedOffset>) -> Option<GpsInfo> {
+        let t = t.timestamp();
+        let within = self.match_within.as_secs() as i64;
+
+        // first fix at or after t, and the one before it
+        let next = self.times.partition_point(|&fix| fix < t);
+        let prev = next.checked_sub(1);
+
+        let next_diff = self.times.get(next).map(|&fix| fix - t).filter(|&d| d <= within);
+        let prev_diff = prev.map(|i| t - self.times[i]).filter(|&d| d <= within);
+
+        match (prev_diff, next_diff) {
+            (Some(prev_diff), Some(next_diff)) => {
+                let prev = next - 1;
+
+                if next_diff == 0 || !self.interpolate {
+                    // nearest one, the earlier on a tie
+                    Some(self.at(if next_diff < prev_diff { next } else { prev }))
+                } else {
+                    // t lies strictly between two fixes
+                    let ratio = prev_diff as f64 / (prev_diff + next_diff) as f64;
+                    let lerp = |a: f64, b: f64| a + (b - a) * ratio;
+
+                    Some(GpsInfo {
+                        lat: lerp(self.lats[prev], self.lats[next]),
+                        lon: lerp(self.lons[prev], self.lons[next]),
+                        alt: lerp(self.alts[prev], self.alts[next]),
+                    })
                 }
-                None => ()
             }
+            (Some(_), None) => prev.map(|i| self.at(i)),
+            (None, Some(_)) => Some(self.at(next)),
+            (None, None) => None,
         }
-
-        target.closest(t)
     }
 }
 
@@ -164,20 +332,8 @@ impl Pour<Gpx> for GpxStorage {
                 for waypoint in segment.points.iter() {
                     match waypoint.unix_at() {
                         Some(t) => {
-                            let key = self.match_within.make_key(t);
-                            match self.cache.get_mut(&key) {
-                                Some(l) => {
-                                    // insert into existed list
-                                    l.push(waypoint.clone());
-                                    counts += 1;
-                                }
-                                None => {
-                                    // make new list
-                                    let l = vec![waypoint.clone()];
-                                    self.cache.insert(key, l);
-                                    counts += 1;
-                                }
-                            }
+                            self.push(t, waypoint);
+                            counts += 1;
                         }
                         None => continue,
                     }
@@ -185,6 +341,8 @@ impl Pour<Gpx> for GpxStorage {
             }
         }
 
+        self.sort();
+
         Ok(counts)
     }
 }
@@ -204,30 +362,99 @@ mod tests {
     use std::io::BufReader;
     use super::*;
 
-    #[test]
-    fn parse_gpx() {
+    fn storage(interpolate: bool) -> GpxStorage {
         let gpx_content = String::from(TEST_GPX_CONTENT);
         let reader = BufReader::new(gpx_content.as_bytes());
 
         let g = gpx::read(reader).unwrap();
 
         // pouring
-        let mut storage = GpxStorage::new(Duration::from_secs(300));
+        let mut storage = GpxStorage::new(Duration::from_secs(300), interpolate);
         let counts = storage.pour_into(g).unwrap();
         println!("{} waypoints were poured", counts);
 
+        assert_eq!(counts as usize, storage.len());
+        storage
+    }
+
+    #[test]
+    fn parse_gpx() {
+        let storage = storage(false);
+
         // search
         let qs = "2023-02-03T05:29:36Z";
         let qdt = DateTime::parse_from_rfc3339(qs).unwrap();
-        let qts = qdt.timestamp();
 
-        let waypoint = storage.search(&qdt).unwrap();
+        let found = storage.search(&qdt).unwrap();
+        assert_eq!(found.lat, 37.287075);
+        assert_eq!(found.lon, 126.574463);
+        assert_eq!(found.alt, 7.853204);
+
+        // nearest fix is 05:21:34
+        let qdt = DateTime::parse_from_rfc3339("2023-02-03T05:22:00Z").unwrap();
+        let found = storage.search(&qdt).unwrap();
+        assert_eq!(found.lat, 37.297585);
+
+        // gap between segments is wider than match_within
+        let qdt = DateTime::parse_from_rfc3339("2023-02-03T06:25:00Z").unwrap();
+        assert!(storage.search(&qdt).is_none());
+
+        // before the first fix and after the last one
+        let qdt = DateTime::parse_from_rfc3339("2023-02-03T04:50:00Z").unwrap();
+        assert_eq!(storage.search(&qdt).unwrap().lat, 37.311695);
+        let qdt = DateTime::parse_from_rfc3339("2023-02-03T10:10:00Z").unwrap();
+        assert!(storage.search(&qdt).is_none());
+    }
+
+    #[test]
+    fn interpolate_gpx() {
+        let storage = storage(true);
+
+        // exact fix is not interpolated
+        let qdt = DateTime::parse_from_rfc3339("2023-02-03T05:21:34Z").unwrap();
+        assert_eq!(storage.search(&qdt).unwrap().lat, 37.297585);
+
+        // halfway between 05:21:34 and 05:23:34
+        let qdt = DateTime::parse_from_rfc3339("2023-02-03T05:22:34Z").unwrap();
+        let found = storage.search(&qdt).unwrap();
+        assert!((found.lat - (37.297585 + 37.288368) / 2.0).abs() < 1e-9);
+        assert!((found.lon - (126.585625 + 126.576439) / 2.0).abs() < 1e-9);
+        assert!((found.alt - (11.262866 + 13.387933) / 2.0).abs() < 1e-9);
+    }
 
-        assert_eq!(qts, waypoint.unix_at().unwrap());
+    #[test]
+    fn cache_track() {
+        let track = storage(false);
+        let data = track.encode_track("2023-02-03T10:00:00.000Z").unwrap();
+
+        let mut loaded = GpxStorage::new(Duration::from_secs(300), false);
+        loaded.load_track(&data, "2023-02-03T10:00:00.000Z").unwrap();
+        assert_eq!(loaded.times, track.times);
+        assert_eq!(loaded.alts, track.alts);
+
+        // modified on drive, or truncated
+        assert!(loaded.load_track(&data, "2023-02-04T10:00:00.000Z").is_err());
+        assert!(loaded.load_track(&data[..data.len() - 8], "2023-02-03T10:00:00.000Z").is_err());
+        assert_eq!(loaded.len(), track.len());
+    }
+
+    #[test]
+    fn cache_list_per_query() {
+        let cache_dir = std::env::temp_dir().join("kapy-list-cache-test");
+        let _ = fs::remove_dir_all(&cache_dir);
+
+        // both queries of a run are kept, neither overwrites the other
+        for q in ["estimated", "inspected"] {
+            let cache = ListCache { query: q.to_string(), listed_at: 0, files: Vec::new() };
+            write_atomic(&list_cache_path(&cache_dir, q), serde_json::to_string(&cache).unwrap().as_bytes()).unwrap();
+        }
+
+        for q in ["estimated", "inspected"] {
+            assert_eq!(read_list_cache(&list_cache_path(&cache_dir, q)).unwrap().query, q);
+        }
+        assert_eq!(list_cache_path(&cache_dir, "estimated"), list_cache_path(&cache_dir, "estimated"));
 
-        let qdt = qdt + chrono::Duration::seconds(1);
-        let waypoint = storage.search(&qdt).unwrap();
-        assert_eq!(qts, waypoint.unix_at().unwrap());
+        let _ = fs::remove_dir_all(&cache_dir);
     }
 
     const TEST_GPX_CONTENT: &str = r#"<?xml version="1.0" encoding="UTF-8"?>
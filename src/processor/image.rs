@@ -1,18 +1,21 @@
-use std::collections::HashMap;
-use std::ffi::{CStr, CString, c_void};
+use std::cell::RefCell;
+use std::ffi::{CStr, CString, OsString, c_void};
 use std::fs;
-use std::mem::swap;
 use std::ops::Add;
 use std::path::{Path, PathBuf};
 use std::sync::Once;
 
 use regex::Regex;
-use anyhow::{Result, anyhow};
-use chrono::{Datelike, DateTime, Local, NaiveDateTime, TimeZone};
+use anyhow::{Error, Result, anyhow};
+use chrono::{Datelike, DateTime, FixedOffset, Local, NaiveDateTime, TimeZone};
 use magick_rust::{MagickWand, bindings, magick_wand_genesis};
 
 use crate::config::{Command, Config, Format, Quality, Resize};
-use crate::processor::exif::{GpsInfo, Metadata};
+use crate::processor::copy;
+use crate::processor::exif;
+use crate::processor::exif::{ExifDateTime, GpsInfo, Inspected, Metadata, MetadataBlob, Tag};
+use crate::processor::stats::{Stage, StageTimes};
+use crate::processor::walk::{Claim, Destination, FileStat, WalkedFile};
 
 static START: Once = Once::new();
 
@@ -24,15 +27,21 @@ fn prelude() {
 
 pub struct Statistics {
     pub skipped: usize,
+    pub duplicates: usize,          // skipped as cloned before under another name
     pub copying: usize,
     pub converted: usize,
     pub converted_statistics: ConvertedStatistics,
+    pub out_path: Option<PathBuf>,  // where the image is, once cloned; not kept when added up
+    pub stage_times: StageTimes,
+    pub plan: Plan,                 // sizes of dry run, counted in the same fields as if done
+    pub warnings: Vec<(PathBuf, Error)>,    // cloned anyway, e.g., without the gps it should have got
 }
 
 impl Statistics {
     fn new() -> Self {
         Self {
             skipped: 0,
+            duplicates: 0,
             copying: 0,
             converted: 0,
             converted_statistics: ConvertedStatistics {
@@ -42,6 +51,10 @@ impl Statistics {
                 converted_to_heic: 0,
                 gps_added: 0,
             },
+            out_path: None,
+            stage_times: StageTimes::new(),
+            plan: Plan::default(),
+            warnings: Vec::new(),
         }
     }
 }
@@ -52,9 +65,32 @@ impl Add for Statistics {
     fn add(self, rhs: Self) -> Self::Output {
         Self {
             skipped: self.skipped + rhs.skipped,
+            duplicates: self.duplicates + rhs.duplicates,
             copying: self.copying + rhs.copying,
             converted: self.converted + rhs.converted,
             converted_statistics: self.converted_statistics + rhs.converted_statistics,
+            out_path: None,
+            stage_times: self.stage_times + rhs.stage_times,
+            plan: self.plan + rhs.plan,
+            warnings: self.warnings.into_iter().chain(rhs.warnings).collect(),
+        }
+    }
+}
+
+// bytes of planned copies and conversions; output is estimated from inspection
+#[derive(Debug, Clone, Copy, Default, PartialEq)]
+pub struct Plan {
+    pub in_len: u64,
+    pub out_len: u64,
+}
+
+impl Add for Plan {
+    type Output = Plan;
+
+    fn add(self, rhs: Self) -> Self::Output {
+        Self {
+            in_len: self.in_len + rhs.in_len,
+            out_len: self.out_len + rhs.out_len,
         }
     }
 }
@@ -90,7 +126,7 @@ pub enum ProcessState {
 
 pub fn process<F>(conf: &Config, in_file: &Path, out_dir: &Path,
                   inspection: &Inspection, gps_info: Option<GpsInfo>,
-                  dry_run: bool, when_update: F) -> Result<Statistics>
+                  dest: Option<&Destination>, dry_run: bool, when_update: F) -> Result<Statistics>
     where
         F: Fn(ProcessState)
 {
@@ -104,7 +140,13 @@ pub fn process<F>(conf: &Config, in_file: &Path, out_dir: &Path,
         .join(taken_at.year().to_string())
         .join(format!("{:04}-{:02}-{:02}", taken_at.year(), taken_at.month(), taken_at.day()));
 
-    fs::create_dir_all(&out_dir)?;
+    // dry run leaves the destination untouched
+    if !dry_run {
+        match dest {
+            Some(dest) => dest.create_dir(&out_dir)?,
+            None => fs::create_dir_all(&out_dir)?,
+        }
+    }
 
     let cmd = conf.command(inspection.rating);
     let in_path_str = in_file.file_name().unwrap().to_str().unwrap();
@@ -115,47 +157,144 @@ pub fn process<F>(conf: &Config, in_file: &Path, out_dir: &Path,
         loop {
             // determine file path according to rewrite info
             let out_path_string = out_path(in_file, &out_dir, rewrite_info.target_format.clone())?;
-            let out_path = Path::new(&out_path_string);
+            let out_path_buf = match claim_out_path(dest, Path::new(&out_path_string), inspection.fingerprint) {
+                Claim::Taken(out_path) => out_path,
+                claim => {
+                    skip(&mut statistics, claim);
+                    break;
+                }
+            };
+
+            // may be numbered, when another image has the name
+            let out_path = out_path_buf.as_path();
             let out_filename_str = out_path.file_name().unwrap().to_str().unwrap();
 
-            if out_path.exists() {
-                statistics.skipped += 1;
+            // only gps should be added, and it goes to a sidecar: the image is copied as it is
+            let sidecar = match rewrite_info.gps_info {
+                Some(gps_info) if conf.sidecar() && rewrite_info.is_metadata_only() => Some(gps_info),
+                _ => None,
+            };
+
+            // planned from inspection only, no pixel is read
+            if dry_run {
+                let file_len = file_len(in_file, inspection)?;
+                if sidecar.is_some() {
+                    statistics.copying += 1;
+                    statistics.converted_statistics.gps_added += 1;
+                    statistics.plan = statistics.plan + Plan { in_len: file_len, out_len: file_len };
+                } else {
+                    plan_convert(&mut statistics, inspection, &rewrite_info, file_len);
+                }
                 break;
             }
 
+            if let Some(ref gps_info) = sidecar {
+                when_update(ProcessState::JustCopying(
+                    String::from(in_path_str),
+                    String::from(out_filename_str)));
+
+                // sidecar first: a copy without it would be skipped by the next run
+                let sidecar_path = claim_sidecar_path(dest, out_path)?;
+                statistics.stage_times.time(Stage::AddGps, || {
+                    write_gps_sidecar(in_file, &sidecar_path, gps_info)
+                })?;
+                statistics.stage_times.time(Stage::Copy, || copy::copy_file(in_file, out_path, conf.verify()))?;
+
+                statistics.copying += 1;
+                statistics.converted_statistics.gps_added += 1;
+                statistics.out_path = Some(out_path.to_path_buf());
+                break;
+            }
+
+            // only gps should be added: rewrite metadata without decoding the image
+            if rewrite_info.is_metadata_only() {
+                if let Some(ref gps_info) = rewrite_info.gps_info {
+                    when_update(ProcessState::AddingGps(String::from(in_path_str)));
+
+                    // fallback to rewrite through ImageMagick when failed (e.g., too large APP1)
+                    let added = statistics.stage_times.time(Stage::AddGps, || {
+                        exif::add_gps_info_to_file(in_file, out_path, gps_info)
+                    });
+
+                    match added {
+                        Ok(_) => {
+                            statistics.converted += 1;
+                            statistics.converted_statistics.gps_added += 1;
+                            statistics.out_path = Some(out_path.to_path_buf());
+                            break;
+                        }
+                        // HEIC is never re-encoded just for gps (e.g., no Exif item, Exif in 'idat'):
+                        // ImageMagick would recompress it and still leave it without gps
+                        Err(e) if inspection.format == HEIC_FORMAT => {
+                            when_update(ProcessState::JustCopying(
+                                String::from(in_path_str),
+                                String::from(out_filename_str)));
+
+                            statistics.stage_times.time(Stage::Copy, || copy::copy_file(in_file, out_path, conf.verify()))?;
+                            statistics.copying += 1;
+                            statistics.out_path = Some(out_path.to_path_buf());
+                            statistics.warnings.push((in_file.to_path_buf(), e.context("Copied without gps")));
+                            break;
+                        }
+                        Err(_) => (),
+                    }
+                }
+            }
+
             let mut wand = MagickWand::new();
 
-            if let Some(gps_info) = rewrite_info.gps_info {
-                // read image fom file to blob
-                when_update(ProcessState::Reading(String::from(in_path_str)));
-                let mut blob = read_image_to_blob(in_file)?;
+            // JPEG is sized from its frame header, so the decoder can already scale it down
+            let jpeg_target = if inspection.format == JPEG_FORMAT {
+                jpeg_resize_target(&mut wand, in_file, inspection.dimensions, &rewrite_info.resize)?
+            } else {
+                None
+            };
+
+            // Exiv2 writes JPEG only; HEIC gets gps into its output once written
+            let gps_after_write = match rewrite_info.gps_info {
+                Some(gps_info) if inspection.format == HEIC_FORMAT => Some(gps_info),
+                _ => None,
+            };
 
-                // adding gps
+            if let (Some(gps_info), None) = (rewrite_info.gps_info, gps_after_write) {
+                // file is mapped once to build a copy with gps, which is decoded instead of the file
                 when_update(ProcessState::AddingGps(String::from(in_path_str)));
-                let mut other_blob = add_gps_info_to_blob(&blob, gps_info)?;
-                swap(&mut blob, &mut other_blob);
-                drop(other_blob);
+                let blob_with_gps = statistics.stage_times.time(Stage::AddGps, || {
+                    add_gps_info_to_mapped_file(in_file, gps_info)
+                })?;
 
                 statistics.converted_statistics.gps_added += 1;
 
+                when_update(ProcessState::Reading(String::from(in_path_str)));
+
                 // re-read from blob
-                wand.read_image_blob(&blob)?;
+                statistics.stage_times.time(Stage::Read, || wand.read_image_blob(&blob_with_gps))?;
+                drop(blob_with_gps);
             } else {
                 when_update(ProcessState::Reading(String::from(in_path_str)));
-                wand.read_image(in_file.to_str().unwrap())?;
+                statistics.stage_times.time(Stage::Read, || wand.read_image(in_file.to_str().unwrap()))?;
             }
 
             // determine resize
             let img_width = wand.get_image_width();
             let img_height = wand.get_image_height();
 
-            if let Some((width, height)) = determine_resize(img_width, img_height, &rewrite_info.resize) {
-                if width >= img_width || height >= img_height {
+            // scaled decode is never smaller than the target, and may already be of it
+            let scaled = jpeg_target.is_some();
+            let target = jpeg_target.or_else(|| determine_resize(img_width, img_height, &rewrite_info.resize));
+
+            if let Some((width, height)) = target {
+                if width > img_width || height > img_height ||
+                    (!scaled && (width == img_width || height == img_height)) {
                     return Err(anyhow!("Invalid target image size ({}, {}) from ({}, {})",
                             width, height, img_width, img_height));
                 }
 
-                wand.resize_image(width, height, bindings::FilterType_LanczosFilter);
+                if width < img_width || height < img_height {
+                    statistics.stage_times.time(Stage::Resize, || {
+                        wand.resize_image(width, height, bindings::FilterType_LanczosFilter)
+                    });
+                }
                 statistics.converted_statistics.resized += 1;
             }
 
@@ -168,65 +307,137 @@ pub fn process<F>(conf: &Config, in_file: &Path, out_dir: &Path,
             }
 
             // rewrite
-            if dry_run {
-                statistics.skipped += 1;
-            } else {
-                // actually rewrite
-                when_update(ProcessState::Rewriting(
-                    String::from(in_path_str),
-                    String::from(out_filename_str),
-                    cmd.to_string(),
-                ));
-
-                if let Some(ref target_format) = rewrite_info.target_format {
-                    if target_format.as_str() == HEIC_FORMAT {
-                        wand.auto_orient();
-                    }
+            when_update(ProcessState::Rewriting(
+                String::from(in_path_str),
+                String::from(out_filename_str),
+                cmd.to_string(),
+            ));
+
+            if let Some(ref target_format) = rewrite_info.target_format {
+                if target_format.as_str() == HEIC_FORMAT {
+                    wand.auto_orient();
                 }
+            }
 
-                wand.write_image(&out_path_string)?;
-                statistics.converted += 1;
+            // written aside and renamed once gps is in, as copy::copy_file does: an interrupted run
+            // or a failed gps leaves nothing under the final name, and the next run clones it again
+            let tmp_path = tmp_out_path(out_path)?;
+            let placed = (|| -> Result<()> {
+                let tmp_path_str = tmp_path.to_str().unwrap();  // never failed, made from str
+                statistics.stage_times.time(Stage::Write, || wand.write_image(tmp_path_str))?;
 
-                match rewrite_info.target_format {
-                    Some(ref format) => {
-                        match format.as_str() {
-                            JPEG_FORMAT => statistics.converted_statistics.converted_to_jpeg += 1,
-                            HEIC_FORMAT => statistics.converted_statistics.converted_to_heic += 1,
-                            _ => ()
-                        }
-                    }
-                    None => ()
+                if let Some(ref gps_info) = gps_after_write {
+                    when_update(ProcessState::AddingGps(String::from(in_path_str)));
+
+                    statistics.stage_times.time(Stage::AddGps, || {
+                        add_gps_info_after_write(&tmp_path, gps_info)
+                    })?;
+                    statistics.converted_statistics.gps_added += 1;
                 }
+
+                fs::rename(&tmp_path, out_path)?;
+                Ok(())
+            })();
+
+            if let Err(e) = placed {
+                let _ = fs::remove_file(&tmp_path);
+                return Err(e);
             }
 
+            statistics.converted += 1;
+            statistics.out_path = Some(out_path.to_path_buf());
+            count_target_format(&mut statistics, &rewrite_info);
+
             break;
         }
     } else {
         // just copying
-        if !dry_run {
-            // just copying
-            let out_path = out_path(in_file, &out_dir, None)?;
-            let out_path = Path::new(&out_path);
-            let out_path_str = out_path.file_name().unwrap().to_str().unwrap();
-
-            if !out_path.exists() {
-                when_update(ProcessState::JustCopying(
-                    String::from(in_path_str),
-                    String::from(out_path_str)));
-
-                fs::copy(in_file, out_path)?;
-                statistics.copying += 1;
-            } else {
-                statistics.skipped += 1;
+        let out_path = out_path(in_file, &out_dir, None)?;
+        let out_path_buf = match claim_out_path(dest, Path::new(&out_path), inspection.fingerprint) {
+            Claim::Taken(out_path) => out_path,
+            claim => {
+                skip(&mut statistics, claim);
+                return Ok(statistics);
             }
+        };
+        let out_path = out_path_buf.as_path();
+        let out_path_str = out_path.file_name().unwrap().to_str().unwrap();
+
+        if dry_run {
+            let file_len = file_len(in_file, inspection)?;
+            statistics.copying += 1;
+            statistics.plan = statistics.plan + Plan { in_len: file_len, out_len: file_len };
         } else {
-            statistics.skipped += 1;
+            when_update(ProcessState::JustCopying(
+                String::from(in_path_str),
+                String::from(out_path_str)));
+
+            statistics.stage_times.time(Stage::Copy, || copy::copy_file(in_file, out_path, conf.verify()))?;
+            statistics.copying += 1;
+            statistics.out_path = Some(out_path.to_path_buf());
         }
     }
 
     Ok(statistics)
 }
 
+// next to the image, with its extension replaced as most photo managers look for it;
+// when the name is taken (e.g., by IMG_0001.JPG next to IMG_0001.HEIC), by its whole name
+// as IMG_0001.HEIC.xmp. existing sidecars are never written over
+fn claim_sidecar_path(dest: Option<&Destination>, out_path: &Path) -> Result<PathBuf> {
+    let mut full_name = out_path.as_os_str().to_os_string();
+    full_name.push(".xmp");
+
+    for candidate in [out_path.with_extension("xmp"), PathBuf::from(full_name)] {
+        if let Claim::Taken(path) = claim_out_path(dest, &candidate, None) {
+            return Ok(path);
+        }
+    }
+
+    Err(anyhow!("Sidecar of '{}' already exists", out_path.display()))
+}
+
+fn write_gps_sidecar(in_file: &Path, sidecar_path: &Path, gps_info: &GpsInfo) -> Result<()> {
+    SIDECAR_METADATA.with(|meta| -> Result<()> {
+        let mut meta = meta.borrow_mut();
+        meta.reopen(in_file)?;
+
+        let written = meta.add_gps_info(*gps_info)
+            .and_then(|_| meta.write_xmp_sidecar(sidecar_path));
+
+        meta.reset();
+        written
+    })
+}
+
+// existing outputs are skipped; without a destination listing, it is asked to the file system
+fn claim_out_path(dest: Option<&Destination>, out_path: &Path, fingerprint: Option<u64>) -> Claim {
+    match dest {
+        Some(dest) => dest.claim(out_path, fingerprint),
+        None if out_path.exists() => Claim::Exists(out_path.to_path_buf()),
+        None => Claim::Taken(out_path.to_path_buf()),
+    }
+}
+
+fn skip(statistics: &mut Statistics, claim: Claim) {
+    statistics.skipped += 1;
+
+    statistics.out_path = match claim {
+        Claim::Duplicate(out_path) => {
+            statistics.duplicates += 1;
+            Some(out_path)
+        }
+        Claim::Exists(out_path) | Claim::Taken(out_path) => Some(out_path),
+    };
+}
+
+fn file_len(in_file: &Path, inspection: &Inspection) -> Result<u64> {
+    match inspection.stat {
+        Some(stat) => Ok(stat.len),
+        None => Ok(fs::metadata(in_file)?.len()),
+    }
+}
+
 fn out_path(in_file: &Path, out_dir: &Path, format: Option<String>) -> Result<String> {
     let filename = match in_file.file_stem() {
         Some(stem) => stem.to_str().unwrap(),   // never failed
@@ -269,10 +480,10 @@ fn out_path(in_file: &Path, out_dir: &Path, format: Option<String>) -> Result<St
 pub const JPEG_FORMAT: &str = "jpeg";
 pub const HEIC_FORMAT: &str = "heic";
 
-const META_DATETIME: &str = "Exif.Image.DateTime";
-const META_RATING: &str = "Xmp.xmp.Rating";
-const META_GPS_LAT: &str = "Exif.GPSInfo.GPSLatitude";
-const META_GPS_LON: &str = "Exif.GPSInfo.GPSLongitude";
+thread_local! {
+    static INSPECT_METADATA: RefCell<Metadata> = RefCell::new(Metadata::new());
+    static SIDECAR_METADATA: RefCell<Metadata> = RefCell::new(Metadata::new());
+}
 
 pub struct Inspection {
     pub path: PathBuf,
@@ -280,106 +491,111 @@ pub struct Inspection {
     pub gps_recorded: bool,
     pub taken_at: DateTime<Local>,
     pub rating: i8,
+    pub dimensions: Option<(usize, usize)>,
+    pub stat: Option<FileStat>,     // taken while walking, if walked
+    pub fingerprint: Option<u64>,   // tells duplicates apart from other images of the same name
 }
 
+#[allow(dead_code)]
 pub fn inspect_image_from_path(path: &Path) -> Result<Inspection> {
-    let tag_keys = vec![
-        META_DATETIME,
-        META_RATING,
-        META_GPS_LAT,
-        META_GPS_LON,
-    ];
-
-    // get metadata from path
-    let meta = Metadata::new_from_path(Box::new(path.to_path_buf()))?;
-
-    // get mime
-    let mime = meta.get_mime()?;
-
-    // get tags
-    let mut tags = HashMap::new();
-
-    for key in tag_keys.into_iter() {
-        match meta.get_tag(key) {
-            Some(tag) => { tags.insert(key.to_string(), tag); }
-            None => ()
-        }
-    }
-
-    // get format
-    let format = match mime.as_str() {
-        "image/jpeg" => JPEG_FORMAT,
-        "video/quicktime" => HEIC_FORMAT,
-        _ => return Err(anyhow!("Unsupported mime: {}", mime))
+    // try header-only inspection first, fallback to read metadata through Exiv2
+    let inspected = match exif::inspect_from_path(path) {
+        Ok(inspected) => inspected,
+        Err(_) => inspect_metadata_from_path(path)?,
     };
 
-    // get gps recorded
-    let lat_recorded = match tags.get(META_GPS_LAT) {
-        Some(s) => s.len() > 0,
-        None => false,
-    };
+    to_inspection(path, inspected, None)
+}
 
-    let lon_recorded = match tags.get(META_GPS_LON) {
-        Some(s) => s.len() > 0,
-        None => false,
-    };
+// inspect many files at once, with the same fallback done inside libexif;
+// what was stat'ed while walking is kept in the inspection
+pub fn inspect_walked_files(files: &[&WalkedFile], threads: usize) -> Vec<Result<Inspection>> {
+    let paths = files.iter().map(|file| file.path.as_path()).collect::<Vec<&Path>>();
 
-    let gps_recorded = lat_recorded && lon_recorded;
+    exif::inspect_batch_from_paths(&paths, threads).into_iter()
+        .zip(files.iter())
+        .map(|(inspected, file)| to_inspection(&file.path, inspected?, Some(file.stat)))
+        .collect()
+}
+
+fn to_inspection(path: &Path, inspected: Inspected, stat: Option<FileStat>) -> Result<Inspection> {
+    // get format
+    let format = match inspected.mime.as_str() {
+        "image/jpeg" => JPEG_FORMAT,
+        "image/heic" | "video/quicktime" => HEIC_FORMAT,
+        _ => return Err(anyhow!("Unsupported mime: {}", inspected.mime))
+    };
 
     // get taken at
     let taken_at;
 
-    match tags.get(META_DATETIME) {
-        Some(dt) if dt.len() > 0 => {
-            let naive_date = NaiveDateTime::parse_from_str(&dt, "%Y:%m:%d %H:%M:%S")?;
-            taken_at = Local.from_local_datetime(&naive_date).unwrap();   // never failed
+    match inspected.datetime.and_then(|dt| to_local_datetime(&dt)) {
+        Some(dt) => {
+            taken_at = dt;
         }
-        _ => {
-            let created_at = path.metadata()?.created()?;
+        None => {
+            let created_at = match stat {
+                Some(stat) => stat.created_or_modified(),
+                None => path.metadata()?.created()?,
+            };
             taken_at = DateTime::from(created_at);
         }
     }
 
-    // get rating
-    let mut rating = -1;
-
-    if let Some(rating_str) = tags.get(META_RATING) {
-        match rating_str.parse::<i8>() {
-            Ok(n) => rating = n,
-            _ => ()
-        }
-    }
-
     Ok(Inspection {
         path: path.to_path_buf(),
         format: format.to_string(),
-        gps_recorded,
+        gps_recorded: inspected.gps_recorded,
         taken_at,
-        rating,
+        rating: inspected.rating.unwrap_or(-1),
+        dimensions: inspected.dimensions,
+        stat,
+        fingerprint: inspected.fingerprint,
     })
 }
 
-fn read_image_to_blob(path: &Path) -> Result<Vec<u8>> {
-    let wand = MagickWand::new();
-    let path_str = match path.to_str() {
-        Some(p) => p,
-        None => {
-            // never reached
-            return Err(anyhow!("Invalid path to have incompatible UTF-8"));
-        }
-    };
-
-    // read image from file
-    wand.read_image(path_str)?;
-
-    // get file format
-    let format = wand.get_image_format()?;
+fn inspect_metadata_from_path(path: &Path) -> Result<Inspected> {
+    // get metadata from path, reusing a handle per thread
+    INSPECT_METADATA.with(|meta| -> Result<Inspected> {
+        let mut meta = meta.borrow_mut();
+        meta.reopen(path)?;
+
+        let mime = meta.get_mime()?;
+
+        // typed values by tag, nothing is formatted to string and parsed back
+        let datetime = match meta.get_tag_datetime(Tag::DateTimeOriginal)? {
+            Some(dt) => Some(dt),
+            None => meta.get_tag_datetime(Tag::DateTime)?,
+        };
+        let rating = meta.get_tag_int64(Tag::Rating)?.map(|rating| rating as i8);
+        let gps_recorded = meta.has_tag(Tag::GpsLatitude)? && meta.has_tag(Tag::GpsLongitude)?;
+        let dimensions = if mime == "image/jpeg" { exif::jpeg_dimensions(path).ok() } else { None };
+
+        // release image and strings, keep buffers for next file
+        meta.reset();
+
+        Ok(Inspected {
+            mime,
+            datetime,
+            rating,
+            gps_recorded,
+            dimensions,
+            fingerprint: None,  // only taken by libexif
+        })
+    })
+}
 
-    // write image to blob
-    match wand.write_image_blob(&format) {
-        Ok(blob) => Ok(blob),
-        Err(e) => {
-            Err(anyhow!("Failed to write image to blob: {}", e))
+// offset recorded with the datetime wins over the local timezone
+fn to_local_datetime(dt: &ExifDateTime) -> Option<DateTime<Local>> {
+    match dt.offset {
+        Some(offset) => {
+            let offset = FixedOffset::east_opt(offset)?;
+            let utc = NaiveDateTime::from_timestamp_opt(dt.epoch - offset.local_minus_utc() as i64, 0)?;
+            Some(Local.from_utc_datetime(&utc))
+        }
+        None => {
+            let naive = NaiveDateTime::from_timestamp_opt(dt.epoch, 0)?;
+            Local.from_local_datetime(&naive).earliest()
         }
     }
 }
@@ -391,6 +607,13 @@ pub struct ConvertInfo {
     pub gps_info: Option<GpsInfo>,
 }
 
+impl ConvertInfo {
+    // whether pixels are untouched, so only metadata could be changed
+    fn is_metadata_only(&self) -> bool {
+        self.resize.is_preserve() && self.quality.is_none() && self.target_format.is_none()
+    }
+}
+
 fn save_option_by_command(cmd: &Command, inspection: &Inspection, gps_info: Option<GpsInfo>) -> Result<Option<ConvertInfo>> {
     let (resize, format, quality) = match cmd {
         Command::Convert { resize, format, quality } => {
@@ -428,12 +651,19 @@ fn save_option_by_command(cmd: &Command, inspection: &Inspection, gps_info: Opti
         _ => None
     };
 
-    Ok(Some(ConvertInfo {
+    let convert_info = ConvertInfo {
         resize,
         quality,
         target_format: convert,
         gps_info,
-    }))
+    };
+
+    // nothing would change: copy it as it is, rather than decoding and encoding it again
+    if convert_info.is_metadata_only() && convert_info.gps_info.is_none() {
+        return Ok(None);
+    }
+
+    Ok(Some(convert_info))
 }
 
 fn determine_resize(img_width: usize, img_height: usize, resize: &Resize) -> Option<(usize, usize)> {
@@ -469,10 +699,212 @@ fn determine_resize(img_width: usize, img_height: usize, resize: &Resize) -> Opt
     }
 }
 
-fn add_gps_info_to_blob(blob: &Vec<u8>, gps_info: GpsInfo) -> Result<Vec<u8>> {
-    let meta = Metadata::new_from_blob(blob)?;
+// HEIC is about half the size of JPEG at a similar quality
+const HEIC_SIZE_RATIO: f64 = 0.5;
+
+fn count_target_format(statistics: &mut Statistics, info: &ConvertInfo) {
+    match info.target_format.as_deref() {
+        Some(JPEG_FORMAT) => statistics.converted_statistics.converted_to_jpeg += 1,
+        Some(HEIC_FORMAT) => statistics.converted_statistics.converted_to_heic += 1,
+        _ => ()
+    }
+}
+
+// count a conversion as if done, from inspected dimensions rather than decoded pixels
+fn plan_convert(statistics: &mut Statistics, inspection: &Inspection, info: &ConvertInfo, file_len: u64) {
+    statistics.converted += 1;
+
+    if info.gps_info.is_some() {
+        statistics.converted_statistics.gps_added += 1;
+    }
+
+    // fraction of pixels kept
+    let pixel_ratio = match inspection.dimensions {
+        Some((width, height)) => match determine_resize(width, height, &info.resize) {
+            Some((target_width, target_height)) => {
+                statistics.converted_statistics.resized += 1;
+                (target_width * target_height) as f64 / (width * height) as f64
+            }
+            None => 1.0,
+        },
+        None => match info.resize {
+            // unknown until decoded; megapixels are assumed to be within the target
+            Resize::Percentage(percentage) if percentage < 100 => {
+                statistics.converted_statistics.resized += 1;
+                percentage as f64 / 100.0
+            }
+            _ => 1.0,
+        },
+    };
+
+    if info.quality.is_some() {
+        statistics.converted_statistics.adjust_quality += 1;
+    }
+
+    count_target_format(statistics, info);
+
+    let format_ratio = match info.target_format.as_deref() {
+        Some(HEIC_FORMAT) => HEIC_SIZE_RATIO,
+        Some(JPEG_FORMAT) => 1.0 / HEIC_SIZE_RATIO,
+        _ => 1.0,
+    };
+
+    statistics.plan = statistics.plan + Plan {
+        in_len: file_len,
+        out_len: (file_len as f64 * pixel_ratio * format_ratio) as u64,
+    };
+}
+
+// bytes per pixel of the ImageMagick pixel cache (Q16 HDRI keeps RGBA as floats)
+const PIXEL_CACHE_BYTES: u64 = 16;
+// for files of unknown dimensions, as compressed at about 3 bits per pixel
+const UNKNOWN_PIXELS_PER_BYTE: u64 = 3;
+// copied by kernel, or through the verify buffer
+const COPY_COST: u64 = 2 * 1024 * 1024;
+
+// peak memory of processing an image, estimated before touching its pixels
+pub fn memory_cost(conf: &Config, inspection: &Inspection, file_len: u64, gps_info: Option<GpsInfo>) -> u64 {
+    let info = match save_option_by_command(conf.command(inspection.rating), inspection, gps_info) {
+        Ok(Some(info)) => info,
+        _ => return COPY_COST,
+    };
+
+    // rewritten without decoding: the mapped file and the rewritten blob
+    if info.is_metadata_only() && inspection.format == JPEG_FORMAT {
+        return file_len * 2;
+    }
+
+    // decoded (maybe already scaled down) and resized pixels are held at once while resizing
+    let (decoded, resized) = match inspection.dimensions {
+        Some((width, height)) => {
+            let pixels = (width * height) as u64;
+
+            match determine_resize(width, height, &info.resize) {
+                Some((target_width, target_height)) => {
+                    let denom = if inspection.format == JPEG_FORMAT {
+                        jpeg_scale_denom(width, height, target_width, target_height) as u64
+                    } else {
+                        1
+                    };
+
+                    (pixels / (denom * denom), (target_width * target_height) as u64)
+                }
+                None => (pixels, 0),
+            }
+        }
+        None => {
+            let pixels = file_len * UNKNOWN_PIXELS_PER_BYTE;
+            (pixels, if info.resize.is_preserve() { 0 } else { pixels })
+        }
+    };
+
+    // blob with gps and the encoded output are about the size of the file
+    let blobs = if info.gps_info.is_some() { file_len * 2 } else { file_len };
+
+    (decoded + resized) * PIXEL_CACHE_BYTES + blobs
+}
+
+// ImageMagick detects physical memory for its default memory limit; half of it is used for images in flight
+pub fn default_memory_limit() -> u64 {
+    prelude();
+
+    unsafe { bindings::MagickGetResourceLimit(bindings::ResourceType_MemoryResource) / 2 }
+}
+
+// set ImageMagick limits to the budget shared by workers, so its pixel cache is not spilled to disk
+// while it fits, and workers do not oversubscribe cores with their own threads
+pub fn set_resource_limits(memory: u64, workers: usize) {
+    prelude();
+
+    let cores = std::thread::available_parallelism().map(|n| n.get()).unwrap_or(1);
+    let threads = (cores / workers.max(1)).max(1) as u64;
+
+    unsafe {
+        bindings::MagickSetResourceLimit(bindings::ResourceType_MemoryResource, memory);
+        bindings::MagickSetResourceLimit(bindings::ResourceType_MapResource, memory * 2);
+        bindings::MagickSetResourceLimit(bindings::ResourceType_ThreadResource, threads);
+    }
+}
+
+// resize target of JPEG computed from its original size; when it is at most half of it,
+// the decoder is hinted to scale by 1/2, 1/4 or 1/8 (libjpeg scale_denom) on reading,
+// so only the remainder is resampled and the full-resolution pixels are never held
+fn jpeg_resize_target(wand: &mut MagickWand, path: &Path, dimensions: Option<(usize, usize)>,
+                      resize: &Resize) -> Result<Option<(usize, usize)>> {
+    if resize.is_preserve() {
+        return Ok(None);
+    }
+
+    // inspected already, or read from the frame header; fallback to size after decoding
+    let (img_width, img_height) = match dimensions.map_or_else(|| exif::jpeg_dimensions(path), Ok) {
+        Ok(dimensions) => dimensions,
+        Err(_) => return Ok(None),
+    };
+
+    let (width, height) = match determine_resize(img_width, img_height, resize) {
+        Some(target) => target,
+        None => return Ok(None),
+    };
+
+    let denom = jpeg_scale_denom(img_width, img_height, width, height);
+    if denom > 1 {
+        // ImageMagick picks the largest scale keeping the image at least of this size
+        let key = CString::new("jpeg:size").unwrap();
+        let value = CString::new(format!("{}x{}", img_width / denom, img_height / denom)).unwrap();
+
+        match unsafe { bindings::MagickSetOption(wand.wand, key.as_ptr(), value.as_ptr()) } {
+            bindings::MagickBooleanType_MagickTrue => (),
+            _ => return Err(anyhow!("Failed to set jpeg:size option")),
+        }
+    }
+
+    Ok(Some((width, height)))
+}
+
+// largest power of two (up to 8) dividing the image while keeping it at least of the target
+fn jpeg_scale_denom(img_width: usize, img_height: usize, width: usize, height: usize) -> usize {
+    let mut denom = 1;
+    while denom < 8 && img_width / (denom * 2) >= width && img_height / (denom * 2) >= height {
+        denom *= 2;
+    }
+
+    denom
+}
+
+// hidden next to out_path until complete; the extension is kept, ImageMagick writes the format by it
+fn tmp_out_path(out_path: &Path) -> Result<PathBuf> {
+    match (out_path.file_stem(), out_path.extension()) {
+        (Some(stem), Some(ext)) => {
+            let mut tmp_name = OsString::from(".");
+            tmp_name.push(stem);
+            tmp_name.push(".kapy-tmp.");
+            tmp_name.push(ext);
+
+            Ok(out_path.with_file_name(tmp_name))
+        }
+        _ => Err(anyhow!("Invalid output path")),
+    }
+}
+
+// rewrite metadata of the written image aside, and replace it
+fn add_gps_info_after_write(path: &Path, gps_info: &GpsInfo) -> Result<()> {
+    let tmp_path = path.with_extension("kapy-gps");
+    exif::add_gps_info_to_file(path, &tmp_path, gps_info)?;    // removed on failure
+
+    fs::rename(&tmp_path, path)?;
+    Ok(())
+}
+
+// Exiv2 reads metadata from the mapped pages, without reading the file into memory first;
+// the image with gps is written into a new buffer owned by the returned blob, a copy of the
+// file that is what gets decoded. the mapping itself is released once the blob is built
+fn add_gps_info_to_mapped_file(path: &Path, gps_info: GpsInfo) -> Result<MetadataBlob> {
+    let mut meta = Metadata::new();
+    meta.reopen_mmap(path)?;
     meta.add_gps_info(gps_info)?;
-    meta.paste_to_blob(blob)
+
+    let mapped = meta.mapped().ok_or(anyhow!("File is not mapped"))?;
+    meta.paste_to_blob(mapped)
 }
 
 #[allow(dead_code)]
@@ -561,19 +993,371 @@ mod tests {
     #[test]
     fn get_core_metadata() {
         let tags = vec![
-            String::from(META_DATETIME),
-            String::from(META_RATING),
-            String::from(META_GPS_LAT),
-            String::from(META_GPS_LON),
+            Tag::DateTime.key(),
+            Tag::Rating.key(),
+            Tag::GpsLatitude.key(),
+            Tag::GpsLongitude.key(),
         ];
 
-        let path = Path::new("/Users/scryner/geota/IMGP2798.heic");
-        let (mime, vals) = tags_from_path(path, tags).unwrap();
+        let meta = Metadata::new_from_path(Box::new(Path::new("sample.jpg"))).unwrap();
+        let vals = meta.get_tags(&tags).unwrap();
 
-        println!("mime: {}", mime);
+        println!("mime: {}", meta.get_mime().unwrap());
 
-        for (k, v) in vals.iter() {
-            println!("{}: {}", k, v);
+        assert_eq!(vals.len(), tags.len());
+        for (k, v) in tags.iter().zip(vals.iter()) {
+            println!("{}: {:?}", k, v);
+        }
+    }
+
+    #[test]
+    fn inspect_header_only() {
+        let path = Path::new("sample.jpg");
+
+        let inspected = exif::inspect_from_path(path).unwrap();
+        let from_metadata = inspect_metadata_from_path(path).unwrap();
+
+        assert_eq!(inspected.mime, from_metadata.mime);
+        assert_eq!(inspected.datetime, from_metadata.datetime);
+        assert_eq!(inspected.rating, from_metadata.rating);
+        assert_eq!(inspected.gps_recorded, from_metadata.gps_recorded);
+        assert_eq!(inspected.dimensions, Some((1479, 1479)));
+        assert_eq!(inspected.dimensions, from_metadata.dimensions);
+    }
+
+    #[test]
+    fn typed_metadata() {
+        let meta = Metadata::new_from_path(Box::new(Path::new("sample.jpg"))).unwrap();
+
+        // binary value agrees with the formatted one
+        if let Some(dt) = meta.get_tag_datetime(Tag::DateTime).unwrap() {
+            let s = meta.get_tag(Tag::DateTime.key()).unwrap();
+            let naive = NaiveDateTime::parse_from_str(&s, "%Y:%m:%d %H:%M:%S").unwrap();
+            assert_eq!(dt.epoch, naive.timestamp());
+        }
+
+        assert_eq!(meta.has_tag(Tag::GpsLatitude).unwrap(), meta.get_tag(Tag::GpsLatitude.key()).is_some());
+        assert_eq!(meta.get_tag_int64(Tag::Rating).unwrap(),
+                   meta.get_tag(Tag::Rating.key()).and_then(|s| s.parse::<i64>().ok()));
+
+        // tags and their keys are looked up the same
+        assert_eq!(Tag::DateTimeOriginal.key(), "Exif.Photo.DateTimeOriginal");
+        assert_eq!(meta.has_tag(Tag::PixelX).unwrap(), meta.get_tag(Tag::PixelX.key()).is_some());
+        assert!(meta.get_tag_datetime(Tag::Rating).is_err());
+    }
+
+    #[test]
+    fn inspect_batch() {
+        // the missing one stands for a file removed after walking
+        let stat = FileStat::from_metadata(&fs::metadata("sample.jpg").unwrap()).unwrap();
+        let files = ["sample.jpg", "not-exist.jpg", "sample.jpg"].iter()
+            .map(|path| WalkedFile { path: PathBuf::from(path), stat })
+            .collect::<Vec<WalkedFile>>();
+        let results = inspect_walked_files(&files.iter().collect::<Vec<&WalkedFile>>(), 2);
+
+        assert_eq!(results.len(), files.len());
+        assert!(results[1].is_err());
+
+        let single = inspect_image_from_path(&files[0].path).unwrap();
+        for result in [&results[0], &results[2]] {
+            let inspection = result.as_ref().unwrap();
+            assert_eq!(inspection.stat, Some(stat));
+            assert_eq!(inspection.format, single.format);
+            assert_eq!(inspection.taken_at, single.taken_at);
+            assert_eq!(inspection.rating, single.rating);
+
+            // same content, same fingerprint
+            assert!(inspection.fingerprint.is_some());
+            assert_eq!(inspection.fingerprint, single.fingerprint);
         }
     }
+
+    #[test]
+    fn reopen_metadata() {
+        let path = Path::new("sample.jpg");
+        let mut meta = Metadata::new();
+
+        meta.reopen(path).unwrap();
+        let first = meta.get_tags(&[Tag::DateTime.key()]).unwrap();
+
+        meta.reopen(path).unwrap();
+        let second = meta.get_tags(&[Tag::DateTime.key()]).unwrap();
+
+        assert_eq!(first, second);
+    }
+
+    #[test]
+    fn error_kept_on_handle() {
+        let mut meta = Metadata::new();
+
+        let e = meta.reopen(Path::new("not-exist.jpg")).unwrap_err();
+        let e = e.downcast_ref::<exif::ExifError>().unwrap();
+        assert_eq!(e.kind, exif::ExifErrorKind::Open);
+        assert!(!e.message.is_empty());
+
+        let e = exif::inspect_from_path(Path::new("Cargo.toml")).unwrap_err();
+        let e = e.downcast_ref::<exif::ExifError>().unwrap();
+        assert_eq!(e.kind, exif::ExifErrorKind::Unsupported);
+    }
+
+    #[test]
+    fn add_gps_without_decoding() {
+        let in_path = Path::new("sample.jpg");
+        let out_path = std::env::temp_dir().join("kapy_add_gps_without_decoding.jpg");
+
+        let gps_info = GpsInfo {
+            lat: 37.287075,
+            lon: 126.574463,
+            alt: 7.853204,
+        };
+
+        exif::add_gps_info_to_file(in_path, &out_path, &gps_info).unwrap();
+
+        let inspected = exif::inspect_from_path(&out_path).unwrap();
+        let recorded = Metadata::new_from_path(Box::new(out_path.clone())).unwrap()
+            .get_gps().unwrap().unwrap();
+        fs::remove_file(&out_path).unwrap();
+
+        assert!(inspected.gps_recorded);
+        assert!((recorded.lat - gps_info.lat).abs() < 1e-6);
+        assert!((recorded.lon - gps_info.lon).abs() < 1e-6);
+        assert!((recorded.alt - gps_info.alt).abs() < 1e-3);
+    }
+
+    #[test]
+    fn write_gps_to_sidecar() {
+        let in_path = Path::new("sample.jpg");
+        let out_dir = std::env::temp_dir().join("kapy-sidecar-test");
+        let _ = fs::remove_dir_all(&out_dir);
+        fs::create_dir_all(&out_dir).unwrap();
+
+        // images of the same stem get sidecars of their own
+        let dest = Destination::new();
+        let sidecar = claim_sidecar_path(Some(&dest), &out_dir.join("IMG_0001.JPG")).unwrap();
+        assert_eq!(sidecar, out_dir.join("IMG_0001.xmp"));
+        assert_eq!(claim_sidecar_path(Some(&dest), &out_dir.join("IMG_0001.HEIC")).unwrap(),
+                   out_dir.join("IMG_0001.HEIC.xmp"));
+        assert!(claim_sidecar_path(Some(&dest), &out_dir.join("IMG_0001.HEIC")).is_err());
+
+        let gps_info = GpsInfo { lat: 37.287075, lon: 126.574463, alt: 7.853204 };
+        write_gps_sidecar(in_path, &sidecar, &gps_info).unwrap();
+
+        let packet = fs::read_to_string(&sidecar).unwrap();
+        assert!(packet.contains("GPSLatitude"));
+        assert!(packet.contains("GPSLongitude"));
+
+        let _ = fs::remove_dir_all(&out_dir);
+    }
+
+    #[test]
+    fn add_gps_to_heic_without_decoding() {
+        prelude();
+
+        // HEIC written by ImageMagick carries Exif of the source
+        let heic_path = std::env::temp_dir().join("kapy_add_gps_to_heic.heic");
+        let out_path = std::env::temp_dir().join("kapy_add_gps_to_heic_out.heic");
+
+        let wand = MagickWand::new();
+        wand.read_image("sample.jpg").unwrap();
+        wand.write_image(heic_path.to_str().unwrap()).unwrap();
+
+        let gps_info = GpsInfo {
+            lat: 37.287075,
+            lon: 126.574463,
+            alt: 7.853204,
+        };
+
+        exif::add_gps_info_to_file(&heic_path, &out_path, &gps_info).unwrap();
+
+        let before = exif::inspect_from_path(&heic_path).unwrap();
+        let after = exif::inspect_from_path(&out_path).unwrap();
+
+        // still decodable, pixels untouched
+        let decoded = MagickWand::new();
+        decoded.read_image(out_path.to_str().unwrap()).unwrap();
+
+        fs::remove_file(&heic_path).unwrap();
+        fs::remove_file(&out_path).unwrap();
+
+        assert_eq!(after.mime, "image/heic");
+        assert!(!before.gps_recorded);
+        assert!(after.gps_recorded);
+        assert_eq!(after.datetime, before.datetime);
+        assert_eq!(after.dimensions, before.dimensions);
+        assert_eq!(decoded.get_image_width(), 1479);
+    }
+
+    #[test]
+    fn tmp_out_path_keeps_extension() {
+        let tmp_path = tmp_out_path(Path::new("out/2023/IMG_0001.HEIC")).unwrap();
+        assert_eq!(tmp_path, Path::new("out/2023/.IMG_0001.kapy-tmp.HEIC"));
+
+        assert!(tmp_out_path(Path::new("out/2023/IMG_0001")).is_err());
+    }
+
+    #[test]
+    fn add_gps_from_mapping() {
+        let in_path = Path::new("sample.jpg");
+
+        let gps_info = GpsInfo {
+            lat: 37.287075,
+            lon: 126.574463,
+            alt: 7.853204,
+        };
+
+        let blob = add_gps_info_to_mapped_file(in_path, gps_info).unwrap();
+
+        let mut meta = Metadata::new();
+        meta.reopen_mmap(in_path).unwrap();
+        assert_eq!(meta.mapped().unwrap().len(), fs::metadata(in_path).unwrap().len() as usize);
+
+        let wand = MagickWand::new();
+        wand.read_image_blob(&blob).unwrap();
+        assert_eq!(wand.get_image_format().unwrap(), "JPEG");
+    }
+
+    #[test]
+    fn add_gps_to_handle() {
+        let in_path = Path::new("sample.jpg");
+
+        let mut first = Metadata::new();
+        let mut second = Metadata::new();
+        first.reopen(in_path).unwrap();
+        second.reopen(in_path).unwrap();
+        let unopened = Metadata::new();
+
+        let gps_infos = [
+            GpsInfo { lat: 37.287075, lon: 126.574463, alt: 7.853204 },
+            GpsInfo { lat: -33.856784, lon: -151.215297, alt: -12.5 },
+        ];
+
+        first.add_gps_info(gps_infos[0]).unwrap();
+        second.add_gps_info(gps_infos[1]).unwrap();
+        assert!(unopened.add_gps_info(gps_infos[0]).is_err());
+
+        // values are kept in the handle as written, read them back
+        for (meta, gps_info) in [(&first, &gps_infos[0]), (&second, &gps_infos[1])] {
+            let recorded = meta.get_gps().unwrap().unwrap();
+            assert!((recorded.lat - gps_info.lat).abs() < 1e-6);
+            assert!((recorded.lon - gps_info.lon).abs() < 1e-6);
+            assert!((recorded.alt - gps_info.alt).abs() < 1e-3);
+        }
+    }
+
+    #[test]
+    fn jpeg_scaled_decode() {
+        prelude();
+
+        assert_eq!(exif::jpeg_dimensions(Path::new("sample.jpg")).unwrap(), (1479, 1479));
+        assert!(exif::jpeg_dimensions(Path::new("not-exist.jpg")).is_err());
+
+        // 45 MP to 12 MP is decoded at half, 1 MP at quarter, and never below the target
+        assert_eq!(jpeg_scale_denom(8192, 5464, 4226, 2819), 1);
+        assert_eq!(jpeg_scale_denom(8192, 5464, 4096, 2732), 2);
+        assert_eq!(jpeg_scale_denom(8192, 5464, 1225, 817), 4);
+        assert_eq!(jpeg_scale_denom(8192, 5464, 100, 67), 8);
+
+        let mut wand = MagickWand::new();
+        let target = jpeg_resize_target(&mut wand, Path::new("sample.jpg"), None, &Resize::Percentage(5)).unwrap();
+        let (width, height) = target.unwrap();
+
+        wand.read_image("sample.jpg").unwrap();
+        assert!(wand.get_image_width() >= width && wand.get_image_height() >= height);
+        assert!(wand.get_image_width() < 1479);
+    }
+
+    #[test]
+    fn estimate_memory_cost() {
+        let yaml = r#"import:
+  from: .
+  to: .
+policies:
+- rate: [1]
+  command:
+    resize: 5%
+- rate: [2]
+  command:
+    format: heic
+"#;
+        let conf = Config::build(String::from(yaml)).unwrap();
+        let file_len = fs::metadata("sample.jpg").unwrap().len();
+
+        let mut inspection = inspect_image_from_path(Path::new("sample.jpg")).unwrap();
+        inspection.gps_recorded = true;
+
+        // bypassed: copied without holding the file
+        inspection.rating = 0;
+        assert_eq!(memory_cost(&conf, &inspection, file_len, None), COPY_COST);
+
+        // resized to 5% is decoded at quarter, then resampled to 331x331
+        inspection.rating = 1;
+        assert_eq!(memory_cost(&conf, &inspection, file_len, None),
+                   (1479 * 1479 / 16 + 331 * 331) * PIXEL_CACHE_BYTES + file_len);
+
+        // converted at full size
+        inspection.rating = 2;
+        assert_eq!(memory_cost(&conf, &inspection, file_len, None), 1479 * 1479 * PIXEL_CACHE_BYTES + file_len);
+    }
+
+    #[test]
+    fn dry_run_without_decoding() {
+        let yaml = r#"import:
+  from: .
+  to: .
+policies:
+- rate: [1]
+  command:
+    resize: 25%
+    format: heic
+"#;
+        let conf = Config::build(String::from(yaml)).unwrap();
+        let out_dir = std::env::temp_dir().join("kapy-dry-run-test");
+        let _ = fs::remove_dir_all(&out_dir);
+
+        let in_path = Path::new("sample.jpg");
+        let file_len = fs::metadata(in_path).unwrap().len();
+        let mut inspection = inspect_image_from_path(in_path).unwrap();
+
+        // converted: a quarter of the pixels, as HEIC
+        inspection.rating = 1;
+        let stat = process(&conf, in_path, &out_dir, &inspection, None, None, true, |_| ()).unwrap();
+        assert_eq!(stat.converted, 1);
+        assert_eq!(stat.converted_statistics.resized, 1);
+        assert_eq!(stat.converted_statistics.converted_to_heic, 1);
+        assert_eq!(stat.plan.in_len, file_len);
+        assert!(stat.plan.out_len < file_len / 4);
+
+        // copied as it is
+        inspection.rating = 0;
+        let stat = process(&conf, in_path, &out_dir, &inspection, None, None, true, |_| ()).unwrap();
+        assert_eq!(stat.copying, 1);
+        assert_eq!(stat.plan.out_len, file_len);
+
+        assert!(!out_dir.exists());
+    }
+
+    #[test]
+    fn noop_convert_is_copied() {
+        let inspection = Inspection {
+            path: PathBuf::from("sample.jpg"),
+            format: JPEG_FORMAT.to_string(),
+            gps_recorded: false,
+            taken_at: Local::now(),
+            rating: 3,
+            dimensions: None,
+            stat: None,
+            fingerprint: None,
+        };
+
+        let noop = Command::Convert { resize: Resize::Percentage(100), format: Format::JPEG, quality: Quality::Preserve };
+        assert!(save_option_by_command(&noop, &inspection, None).unwrap().is_none());
+
+        // only metadata is rewritten when gps is added
+        let gps_info = GpsInfo { lat: 37.287075, lon: 126.574463, alt: 7.853204 };
+        let convert_info = save_option_by_command(&noop, &inspection, Some(gps_info)).unwrap().unwrap();
+        assert!(convert_info.is_metadata_only());
+
+        let resize = Command::Convert { resize: Resize::MPixels(12), format: Format::Preserve, quality: Quality::Preserve };
+        assert!(save_option_by_command(&resize, &inspection, None).unwrap().is_some());
+    }
 }
@@ -1,23 +1,31 @@
 pub mod image;
 pub mod gps;
-mod exif;
+pub mod exif;
+pub mod copy;
+pub mod budget;
+pub mod stats;
+pub mod walk;
 
+use std::collections::BTreeMap;
 use std::ops::Add;
 use std::path::Path;
-use std::rc::Rc;
+use std::time::Duration;
 
 use console::style;
 use anyhow::{Result, Error, anyhow};
 use chrono::{DateTime, FixedOffset, Local};
 
 use crate::config::Config;
-use crate::processor::exif::GpsInfo;
+use crate::processor::exif::{self, ExifError, GpsInfo};
 use crate::processor::gps::GpsSearch;
-use crate::processor::image::{HEIC_FORMAT, Inspection, ProcessState, Statistics as ImageStatistics};
+use crate::processor::image::{Inspection, ProcessState, Statistics as ImageStatistics};
+use crate::processor::stats::StageTimes;
+use crate::processor::walk::Destination;
 
 pub struct CloneStatistics {
     pub total_cloned: usize,
     pub image: Option<ImageStatistics>,
+    pub stage_times: StageTimes,    // stages outside of image processing (inspection, gps search)
 }
 
 impl CloneStatistics {
@@ -25,9 +33,47 @@ impl CloneStatistics {
         Self {
             total_cloned: 0,
             image: None,
+            stage_times: StageTimes::new(),
         }
     }
 
+    /*
+    stage         count      total      p50      p90      p99      max
+    read            120    38.20 s   310 ms   420 ms   610 ms   702 ms
+    ...
+    ---
+    120 images in 52.10 s (2.30 images/s)
+     */
+    pub fn print_stats(&self, elapsed: Duration) {
+        let mut stage_times = self.stage_times.clone();
+        if let Some(image_stat) = &self.image {
+            stage_times = stage_times + image_stat.stage_times.clone();
+        }
+
+        println!("{}", style("---").dim());
+        println!("{:<12} {:>7} {:>10} {:>9} {:>9} {:>9} {:>9}", "stage", "count", "total", "p50", "p90", "p99", "max");
+        for s in stage_times.summary().iter() {
+            println!("{:<12} {:>7} {:>8.2} s {:>6.0} ms {:>6.0} ms {:>6.0} ms {:>6.0} ms",
+                     s.stage.as_str(), s.count, s.total.as_secs_f64(),
+                     millis(s.p50), millis(s.p90), millis(s.p99), millis(s.max));
+        }
+
+        // counters inside libexif, when built with them
+        if let Some(counters) = exif::libexif_stats() {
+            println!("{}", style("---").dim());
+            println!("{:<20} {:>7} {:>10} {:>10}", "libexif", "calls", "total", "mean");
+            for (name, calls, total) in counters.iter() {
+                println!("{:<20} {:>7} {:>8.2} s {:>7.0} us",
+                         name, calls, total.as_secs_f64(), total.as_secs_f64() * 1e6 / *calls as f64);
+            }
+        }
+
+        println!("{}", style("---").dim());
+        let secs = elapsed.as_secs_f64();
+        println!("{} images in {:.2} s ({:.2} images/s)", style(self.total_cloned).cyan().bold(), secs,
+                 if secs > 0.0 { self.total_cloned as f64 / secs } else { 0.0 });
+    }
+
     /*
     123 total images (120 succeed / 3 failed)
     ---
@@ -51,7 +97,12 @@ impl CloneStatistics {
 
         if let Some(image_stat) = &self.image {
             println!("{:>width$} just copied", image_stat.copying);
-            println!("{:>width$} skipped", image_stat.skipped);
+            if image_stat.duplicates > 0 {
+                println!("{:>width$} skipped ({} cloned before under another name)",
+                         image_stat.skipped, image_stat.duplicates);
+            } else {
+                println!("{:>width$} skipped", image_stat.skipped);
+            }
             println!("{:>width$} converted", image_stat.converted);
 
             let converted_stat = &image_stat.converted_statistics;
@@ -68,16 +119,66 @@ impl CloneStatistics {
             println!("{:>width$} {:>inner_width$} converted to JPEG", style("-").yellow(), converted_stat.converted_to_jpeg);
         }
 
+        // print warnings, images cloned otherwise than planned
+        if let Some(image_stat) = self.image.as_ref().filter(|image_stat| !image_stat.warnings.is_empty()) {
+            println!("{}", style("---").dim());
+            println!("Warnings:");
+            for (path, e) in image_stat.warnings.iter() {
+                println!("{} {}: {:#}", style("-").yellow(),
+                         style(path.to_str().unwrap()).yellow().bold(), e);
+            }
+        }
+
         // print errors
         if errors.len() > 0 {
             println!("{}", style("---").dim());
             println!("Errors:");
             for (inspection, e) in errors.iter() {
-                println!("{} {}: {}", style("-").red(),
+                println!("{} {}: {:#}", style("-").red(),
                          style(inspection.path.to_str().unwrap()).red().bold(), e);
             }
+
+            // count by kind of metadata error, to tell a bad batch from a few broken files
+            let mut kinds: BTreeMap<String, usize> = BTreeMap::new();
+            for (_, e) in errors.iter() {
+                let kind = match e.chain().find_map(|cause| cause.downcast_ref::<ExifError>()) {
+                    Some(exif_error) => format!("{:?}", exif_error.kind),
+                    None => "Other".to_string(),
+                };
+
+                *kinds.entry(kind).or_insert(0) += 1;
+            }
+
+            println!("{}", style("---").dim());
+            let width = max_width(kinds.values().cloned().collect());
+            for (kind, count) in kinds.iter() {
+                println!("{:>width$} {}", style(count).red(), kind);
+            }
         }
     }
+
+    /*
+    ---
+    planned to write 1.20 GB from 3.40 GB (estimated)
+     */
+    pub fn print_plan(&self) {
+        let plan = match &self.image {
+            Some(image_stat) => image_stat.plan,
+            None => return,
+        };
+
+        println!("{}", style("---").dim());
+        println!("planned to write {} from {} {}", style(gigabytes(plan.out_len)).cyan().bold(),
+                 gigabytes(plan.in_len), style("(estimated)").dim());
+    }
+}
+
+fn gigabytes(len: u64) -> String {
+    format!("{:.2} GB", len as f64 / 1e9)
+}
+
+fn millis(d: Duration) -> f64 {
+    d.as_secs_f64() * 1000.0
 }
 
 fn max_width(nums: Vec<usize>) -> usize {
@@ -109,6 +210,7 @@ impl Add for CloneStatistics {
         Self {
             total_cloned: self.total_cloned + rhs.total_cloned,
             image: image_stat,
+            stage_times: self.stage_times + rhs.stage_times,
         }
     }
 }
@@ -120,47 +222,41 @@ pub enum CloneState {
     Converting(String, String, String),
 }
 
-pub fn clone_image<'a, F>(conf: &Config,
-                          in_file: &Path, out_dir: &Path,
-                          inspection: &Inspection,
-                          gpx: Rc<Box<dyn GpsSearch + 'a>>,
-                          dry_run: bool,
-                          when_update: F) -> Result<CloneStatistics>
+// find gps info for the image when it has not been recorded
+pub fn search_gps(inspection: &Inspection, gpx: &dyn GpsSearch) -> Option<GpsInfo> {
+    if inspection.gps_recorded {
+        return None;
+    }
+
+    // try to match gps
+    let taken_at = inspection.taken_at.to_fixed_offset();
+
+    gpx.search(&taken_at)
+}
+
+pub fn clone_image<F>(conf: &Config,
+                      in_file: &Path, out_dir: &Path,
+                      inspection: &Inspection,
+                      gps_info: Option<GpsInfo>,
+                      dest: Option<&Destination>,
+                      dry_run: bool,
+                      when_update: F) -> Result<CloneStatistics>
     where
         F: Fn(CloneState)
 {
     let mut statistics = CloneStatistics::new();
 
-    // check arguments
-    if !in_file.is_file() {
+    // check arguments, unless already known from walking
+    if inspection.stat.is_none() && !in_file.is_file() {
         return Err(anyhow!("Input path '{}' is not file", in_file.to_str().unwrap()));
     }
 
-    if !out_dir.is_dir() {
+    if dest.is_none() && !out_dir.is_dir() {
         return Err(anyhow!("Output path '{}' is not directory", in_file.to_str().unwrap()));
     }
 
-    // retrieve gps data
-    let mut gps_info = None;
-    if !inspection.gps_recorded && inspection.format != HEIC_FORMAT {
-        // try to match gps
-        // currently, EXIV2 the library to manipulate EXIF under hood is not support HEIF/HEIC
-        let gpx = gpx.clone();
-        let taken_at = inspection.taken_at.to_fixed_offset();
-
-        if let Some(waypoint) = gpx.search(&taken_at) {
-            gps_info = Some(GpsInfo {
-                lat: waypoint.point().y(),
-                lon: waypoint.point().x(),
-                alt: waypoint.elevation.unwrap_or(0.0),
-            });
-        } else {
-            gps_info = None
-        }
-    }
-
     // try to process command to manipulate image
-    match image::process(conf, in_file, out_dir, &inspection, gps_info, dry_run, |state| {
+    match image::process(conf, in_file, out_dir, &inspection, gps_info, dest, dry_run, |state| {
         match state {
             ProcessState::Reading(in_path) => {
                 when_update(CloneState::Reading(in_path));
@@ -181,7 +277,8 @@ pub fn clone_image<'a, F>(conf: &Config,
             statistics.image = Some(image_stat);
         }
         Err(e) => {
-            return Err(anyhow!("Failed to process image: {}", e.to_string()));
+            // keep the source error in the chain, print_with_error groups by it
+            return Err(e.context("Failed to process image"));
         }
     }
 
@@ -0,0 +1,139 @@
+use std::collections::BTreeMap;
+use std::ops::Add;
+use std::time::{Duration, Instant};
+
+// stages of a clone run, timed with the monotonic clock
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
+pub enum Stage {
+    Inspect,    // per call to libexif, covering a chunk of files
+    GpsSearch,
+    AddGps,
+    Read,       // reading and decoding through ImageMagick
+    Resize,
+    Write,      // encoding and writing through ImageMagick
+    Copy,
+}
+
+impl Stage {
+    pub fn as_str(&self) -> &str {
+        match self {
+            Stage::Inspect => "inspect",
+            Stage::GpsSearch => "gps search",
+            Stage::AddGps => "add gps",
+            Stage::Read => "read",
+            Stage::Resize => "resize",
+            Stage::Write => "write",
+            Stage::Copy => "copy",
+        }
+    }
+}
+
+// every span is kept, there are only a few per image
+#[derive(Debug, Clone, Default)]
+pub struct StageTimes {
+    spans: BTreeMap<Stage, Vec<Duration>>,
+}
+
+pub struct StageSummary {
+    pub stage: Stage,
+    pub count: usize,
+    pub total: Duration,
+    pub p50: Duration,
+    pub p90: Duration,
+    pub p99: Duration,
+    pub max: Duration,
+}
+
+impl StageTimes {
+    pub fn new() -> Self {
+        Self {
+            spans: BTreeMap::new(),
+        }
+    }
+
+    pub fn record(&mut self, stage: Stage, elapsed: Duration) {
+        self.spans.entry(stage).or_insert_with(Vec::new).push(elapsed);
+    }
+
+    pub fn time<T, F>(&mut self, stage: Stage, f: F) -> T
+        where
+            F: FnOnce() -> T,
+    {
+        let start = Instant::now();
+        let result = f();
+        self.record(stage, start.elapsed());
+
+        result
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.spans.is_empty()
+    }
+
+    // in order of stages
+    pub fn summary(&self) -> Vec<StageSummary> {
+        self.spans.iter().map(|(stage, spans)| {
+            let mut sorted = spans.clone();
+            sorted.sort();
+
+            StageSummary {
+                stage: *stage,
+                count: sorted.len(),
+                total: sorted.iter().sum(),
+                p50: percentile(&sorted, 50),
+                p90: percentile(&sorted, 90),
+                p99: percentile(&sorted, 99),
+                max: *sorted.last().unwrap(),    // never failed, no stage without spans
+            }
+        }).collect()
+    }
+}
+
+impl Add for StageTimes {
+    type Output = StageTimes;
+
+    fn add(mut self, rhs: Self) -> Self::Output {
+        for (stage, mut spans) in rhs.spans {
+            self.spans.entry(stage).or_insert_with(Vec::new).append(&mut spans);
+        }
+
+        self
+    }
+}
+
+// nearest-rank percentile of sorted spans
+fn percentile(sorted: &[Duration], p: usize) -> Duration {
+    let rank = (sorted.len() * p + 99) / 100;
+    sorted[rank.max(1) - 1]
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn summarize_stages() {
+        let mut times = StageTimes::new();
+        for ms in 1..=100 {
+            times.record(Stage::Read, Duration::from_millis(ms));
+        }
+
+        let mut other = StageTimes::new();
+        other.record(Stage::Copy, Duration::from_millis(5));
+        assert_eq!(other.time(Stage::Copy, || 42), 42);
+
+        let summary = (times + other).summary();
+        assert_eq!(summary.len(), 2);
+
+        let read = &summary[0];
+        assert_eq!(read.stage, Stage::Read);
+        assert_eq!(read.count, 100);
+        assert_eq!(read.total, Duration::from_millis(5050));
+        assert_eq!(read.p50, Duration::from_millis(50));
+        assert_eq!(read.p99, Duration::from_millis(99));
+        assert_eq!(read.max, Duration::from_millis(100));
+
+        assert_eq!(summary[1].stage, Stage::Copy);
+        assert_eq!(summary[1].count, 2);
+    }
+}
@@ -0,0 +1,323 @@
+use std::collections::{HashMap, HashSet};
+use std::ffi::OsString;
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::sync::Mutex;
+use std::time::SystemTime;
+
+use anyhow::Result;
+use walkdir::WalkDir;
+
+use crate::index::fingerprint::Fingerprints;
+
+// what is needed of a source file, taken from a single stat while walking
+//
+// std stats with statx on Linux, which gives the birth time as well
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct FileStat {
+    pub len: u64,
+    pub modified: SystemTime,
+    pub created: Option<SystemTime>,    // not every file system keeps it
+    pub inode: u64,
+}
+
+impl FileStat {
+    pub fn from_metadata(metadata: &fs::Metadata) -> Result<Self> {
+        Ok(FileStat {
+            len: metadata.len(),
+            modified: metadata.modified()?,
+            created: metadata.created().ok(),
+            inode: inode(metadata),
+        })
+    }
+
+    // birth time, or modification time where it is not kept
+    pub fn created_or_modified(&self) -> SystemTime {
+        self.created.unwrap_or(self.modified)
+    }
+}
+
+pub struct WalkedFile {
+    pub path: PathBuf,
+    pub stat: FileStat,
+}
+
+// files under dir with one of extensions (lowercase), hidden ones left out
+//
+// file types come from the directory entries; only the files taken are stat'ed, once
+pub fn walk_files(dir: &Path, max_depth: usize, extensions: &[&str]) -> Vec<WalkedFile> {
+    let mut files = Vec::new();
+
+    for entry in WalkDir::new(dir).max_depth(max_depth).into_iter() {
+        let entry = match entry {
+            Ok(v) => v,
+            Err(_) => continue,
+        };
+
+        let file_type = entry.file_type();
+        if !file_type.is_file() && !file_type.is_symlink() {
+            continue;
+        }
+
+        let path = entry.path();
+        match path.file_stem().and_then(|stem| stem.to_str()) {
+            Some(stem) if !stem.starts_with(".") => (),   // filter if file is hidden
+            _ => continue,
+        }
+
+        match path.extension().and_then(|ext| ext.to_str()) {
+            Some(ext) if extensions.contains(&ext.to_lowercase().as_str()) => (),
+            _ => continue,
+        }
+
+        // symbolic links are followed to what they point to
+        let metadata = if file_type.is_symlink() { fs::metadata(path) } else { entry.metadata().map_err(Into::into) };
+        let stat = match metadata {
+            Ok(metadata) if metadata.is_file() => FileStat::from_metadata(&metadata),
+            _ => continue,
+        };
+
+        if let Ok(stat) = stat {
+            files.push(WalkedFile {
+                path: entry.into_path(),
+                stat,
+            });
+        }
+    }
+
+    files
+}
+
+// files in the destination, listed once per directory instead of a stat per output
+//
+// outputs are claimed as well, so two sources of the same name are never written to one path;
+// with fingerprints, a duplicate is found under any name and another image of the same name is
+// written next to it, numbered
+pub struct Destination {
+    root: PathBuf,
+    state: Mutex<DestinationState>,
+}
+
+struct DestinationState {
+    dirs: HashMap<PathBuf, Listing>,
+    fingerprints: Option<Fingerprints>,
+    claimed: HashSet<u64>,      // fingerprints taken by this run
+}
+
+struct Listing {
+    exists: bool,
+    names: HashSet<OsString>,
+}
+
+pub enum Claim {
+    Taken(PathBuf),         // to be written, numbered if another image has the name
+    Exists(PathBuf),        // already there, of unknown content
+    Duplicate(PathBuf),     // the same image cloned before, possibly under another name
+}
+
+impl Destination {
+    pub fn new() -> Self {
+        Destination::with_fingerprints(Path::new(""), None)
+    }
+
+    pub fn with_fingerprints(root: &Path, fingerprints: Option<Fingerprints>) -> Self {
+        Destination {
+            root: root.to_path_buf(),
+            state: Mutex::new(DestinationState {
+                dirs: HashMap::new(),
+                fingerprints,
+                claimed: HashSet::new(),
+            }),
+        }
+    }
+
+    pub fn contains(&self, path: &Path) -> bool {
+        let mut state = self.state.lock().unwrap();
+        contains(&mut state.dirs, path)
+    }
+
+    pub fn claim(&self, path: &Path, fingerprint: Option<u64>) -> Claim {
+        let (dir, stem, ext) = match (path.parent(), path.file_stem(), path.extension()) {
+            (Some(dir), Some(stem), Some(ext)) => (dir, stem.to_string_lossy(), ext.to_string_lossy()),
+            _ => return Claim::Exists(path.to_path_buf()),
+        };
+
+        let mut state = self.state.lock().unwrap();
+        let DestinationState { dirs, fingerprints, claimed } = &mut *state;
+
+        let (fingerprints, fingerprint) = match (fingerprints.as_mut(), fingerprint) {
+            (Some(fingerprints), Some(fingerprint)) => (Some(fingerprints), fingerprint),
+            _ => (None, 0),
+        };
+
+        if let Some(ref mut fingerprints) = fingerprints {
+            if let Some(cloned) = fingerprints.get(fingerprint).map(|cloned| self.root.join(cloned)) {
+                if contains(dirs, &cloned) {
+                    return Claim::Duplicate(cloned);
+                }
+
+                fingerprints.remove(fingerprint);   // its output was deleted since
+            }
+        }
+
+        let mut candidate = path.to_path_buf();
+        for n in 1.. {
+            let name = candidate.file_name().unwrap().to_os_string();  // never failed
+            if listing(dirs, dir).names.insert(name) {
+                break;
+            }
+
+            // the name itself may be of an image cloned before this index was kept, left as it is
+            let owned = match (&fingerprints, candidate.strip_prefix(&self.root)) {
+                (Some(fingerprints), Ok(relative)) => fingerprints.is_owned(relative),
+                _ => false,
+            };
+            if n == 1 && !owned {
+                return Claim::Exists(candidate);
+            }
+
+            candidate = dir.join(format!("{}-{}.{}", stem, n, ext));
+        }
+
+        if let (Some(fingerprints), Ok(relative)) = (fingerprints, candidate.strip_prefix(&self.root)) {
+            fingerprints.insert(fingerprint, relative.to_path_buf());
+            claimed.insert(fingerprint);
+        }
+
+        Claim::Taken(candidate)
+    }
+
+    // image failed to be written, it is not a duplicate of anything
+    pub fn release(&self, fingerprint: Option<u64>) {
+        let mut state = self.state.lock().unwrap();
+        let DestinationState { fingerprints, claimed, .. } = &mut *state;
+
+        if let (Some(fingerprints), Some(fingerprint)) = (fingerprints.as_mut(), fingerprint) {
+            if claimed.remove(&fingerprint) {
+                fingerprints.remove(fingerprint);
+            }
+        }
+    }
+
+    pub fn save_fingerprints(&self) -> Result<()> {
+        match self.state.lock().unwrap().fingerprints.as_mut() {
+            Some(fingerprints) => fingerprints.save(),
+            None => Ok(()),
+        }
+    }
+
+    // create dir unless it is already known to exist
+    pub fn create_dir(&self, dir: &Path) -> Result<()> {
+        let mut state = self.state.lock().unwrap();
+        let listing = listing(&mut state.dirs, dir);
+
+        if !listing.exists {
+            fs::create_dir_all(dir)?;
+            listing.exists = true;
+        }
+
+        Ok(())
+    }
+}
+
+fn contains(dirs: &mut HashMap<PathBuf, Listing>, path: &Path) -> bool {
+    match (path.parent(), path.file_name()) {
+        (Some(dir), Some(name)) => listing(dirs, dir).names.contains(name),
+        _ => false,
+    }
+}
+
+// listed on first use; a missing directory is just empty
+fn listing<'a>(dirs: &'a mut HashMap<PathBuf, Listing>, dir: &Path) -> &'a mut Listing {
+    dirs.entry(dir.to_path_buf()).or_insert_with(|| {
+        match fs::read_dir(dir) {
+            Ok(entries) => Listing {
+                exists: true,
+                names: entries.filter_map(|entry| entry.ok().map(|entry| entry.file_name())).collect(),
+            },
+            Err(_) => Listing {
+                exists: false,
+                names: HashSet::new(),
+            },
+        }
+    })
+}
+
+#[cfg(unix)]
+fn inode(metadata: &fs::Metadata) -> u64 {
+    use std::os::unix::fs::MetadataExt;
+    metadata.ino()
+}
+
+#[cfg(not(unix))]
+fn inode(_metadata: &fs::Metadata) -> u64 {
+    0   // size and mtime are enough to tell changes apart
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn walk_and_claim() {
+        let root = std::env::temp_dir().join("kapy-walk-test");
+        let _ = fs::remove_dir_all(&root);
+        fs::create_dir_all(root.join("sub")).unwrap();
+
+        fs::copy("sample.jpg", root.join("sub").join("IMG_0001.JPG")).unwrap();
+        fs::write(root.join(".hidden.jpg"), b"").unwrap();
+        fs::write(root.join("note.txt"), b"").unwrap();
+
+        let files = walk_files(&root, 10, &["jpg", "jpeg", "heic"]);
+        assert_eq!(files.len(), 1);
+        assert_eq!(files[0].stat.len, fs::metadata("sample.jpg").unwrap().len());
+
+        let dest = Destination::new();
+        assert!(dest.contains(&root.join("note.txt")));
+        assert!(matches!(dest.claim(&root.join("note.txt"), None), Claim::Exists(_)));
+
+        // claimed once, including directories not created yet
+        let out_path = root.join("out").join("IMG_0001.JPG");
+        assert!(matches!(dest.claim(&out_path, None), Claim::Taken(_)));
+        assert!(matches!(dest.claim(&out_path, None), Claim::Exists(_)));
+        dest.create_dir(out_path.parent().unwrap()).unwrap();
+        assert!(root.join("out").is_dir());
+
+        let _ = fs::remove_dir_all(&root);
+    }
+
+    #[test]
+    fn claim_by_fingerprint() {
+        let root = std::env::temp_dir().join("kapy-claim-test");
+        let _ = fs::remove_dir_all(&root);
+        fs::create_dir_all(root.join("2023")).unwrap();
+        fs::write(root.join("2023").join("DSC_0001.JPG"), b"").unwrap();
+
+        let out_path = root.join("2023").join("DSC_0001.JPG");
+        let dest = Destination::with_fingerprints(&root, Some(Fingerprints::open(&root)));
+
+        // of unknown content, skipped as before
+        assert!(matches!(dest.claim(&out_path, Some(1)), Claim::Exists(_)));
+
+        // another image of a known one's name is numbered, the same image is a duplicate
+        let other_path = root.join("2023").join("DSC_0002.JPG");
+        assert!(matches!(dest.claim(&other_path, Some(2)), Claim::Taken(_)));
+        match dest.claim(&other_path, Some(3)) {
+            Claim::Taken(path) => assert_eq!(path, root.join("2023").join("DSC_0002-1.JPG")),
+            _ => panic!("numbered path must be taken"),
+        }
+        match dest.claim(&root.join("2023").join("DSC_0100.JPG"), Some(2)) {
+            Claim::Duplicate(path) => assert_eq!(path, other_path),
+            _ => panic!("known fingerprint must be a duplicate"),
+        }
+
+        // failed ones are forgotten
+        dest.release(Some(3));
+        dest.save_fingerprints().unwrap();
+        let fingerprints = Fingerprints::open(&root);
+        assert!(fingerprints.get(2).is_some());
+        assert!(fingerprints.get(3).is_none());
+
+        let _ = fs::remove_dir_all(&root);
+    }
+}